@@ -0,0 +1,196 @@
+// this is the entry point of the microbenchmarks for the hot paths of the client.
+// Built as bittorrent_bench when Google Benchmark is installed, for regression tracking run
+//   bittorrent_bench --benchmark_format=json --benchmark_out=results.json
+
+
+#include <benchmark/benchmark.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "lib/decode.hpp" // bencode decoding and encoding
+#include "lib/utils.hpp" // bytes_to_hex
+#include "lib/sha1.hpp" // piece hashes of v1 torrents
+#include "lib/sha256.hpp" // piece hashes of v2 torrents
+#include "lib/merkle.hpp" // v2 merkle leaves
+#include "lib/peers.hpp" // peer message framing
+#include "lib/piece_state.hpp" // piece picker
+
+// A multi-file metainfo like a real one: piece_count piece hashes and a file per 16 pieces
+std::string make_metainfo(size_t piece_count) {
+    std::mt19937 rng(42);
+    json info = json::object();
+    std::string pieces(piece_count * 20, '\0');
+    for (char& c : pieces) {
+        c = static_cast<char>(rng());
+    }
+    const int64_t piece_length = 256 * 1024;
+    json files = json::array();
+    for (size_t i = 0; i < std::max<size_t>(piece_count / 16, 1); ++i) {
+        files.push_back({{"length", piece_length * 16}, {"path", {"season 1", "episode " + std::to_string(i) + ".mkv"}}});
+    }
+    info["files"] = files;
+    info["name"] = "benchmark torrent";
+    info["piece length"] = piece_length;
+    info["pieces"] = pieces;
+    json torrent = json::object();
+    torrent["announce"] = "http://tracker.example.org:6969/announce";
+    torrent["comment"] = "generated for benchmarking";
+    torrent["info"] = info;
+    return bencode_decoded_value(torrent);
+}
+
+std::vector<uint8_t> random_bytes(size_t length) {
+    std::mt19937 rng(7);
+    std::vector<uint8_t> data(length);
+    for (uint8_t& byte : data) {
+        byte = static_cast<uint8_t>(rng());
+    }
+    return data;
+}
+
+static void BM_DecodeMetainfo(benchmark::State& state) {
+    std::string encoded = make_metainfo(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        json decoded = decode_bencoded_value(encoded);
+        benchmark::DoNotOptimize(decoded);
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(encoded.size()));
+}
+// 1000 pieces is a 250 MB torrent, 100000 a 25 GB one
+BENCHMARK(BM_DecodeMetainfo)->Arg(1000)->Arg(10000)->Arg(100000);
+
+static void BM_BencodeMetainfo(benchmark::State& state) {
+    std::string encoded = make_metainfo(static_cast<size_t>(state.range(0)));
+    json decoded = decode_bencoded_value(encoded);
+    for (auto _ : state) {
+        std::string reencoded = bencode_decoded_value(decoded);
+        benchmark::DoNotOptimize(reencoded);
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(encoded.size()));
+}
+BENCHMARK(BM_BencodeMetainfo)->Arg(1000)->Arg(10000)->Arg(100000);
+
+static void BM_Sha1Piece(benchmark::State& state) {
+    std::vector<uint8_t> piece = random_bytes(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        SHA1 sha1;
+        sha1.update(piece.data(), piece.size());
+        std::string digest = sha1.final();
+        benchmark::DoNotOptimize(digest);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Sha1Piece)->RangeMultiplier(4)->Range(16 << 10, 16 << 20);
+
+static void BM_Sha256Piece(benchmark::State& state) {
+    std::vector<uint8_t> piece = random_bytes(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        Sha256Digest digest = SHA256::hash(piece.data(), piece.size());
+        benchmark::DoNotOptimize(digest);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_Sha256Piece)->RangeMultiplier(4)->Range(16 << 10, 16 << 20);
+
+// v2 verification: the 16 KiB leaves of a piece and their merkle root
+static void BM_MerklePiece(benchmark::State& state) {
+    std::vector<uint8_t> piece = random_bytes(static_cast<size_t>(state.range(0)));
+    size_t leaves = piece.size() / MERKLE_BLOCK_SIZE;
+    for (auto _ : state) {
+        Sha256Digest root = merkle_root(hash_blocks(piece.data(), piece.size()), leaves);
+        benchmark::DoNotOptimize(root);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_MerklePiece)->RangeMultiplier(4)->Range(16 << 10, 16 << 20);
+
+static void BM_BytesToHex(benchmark::State& state) {
+    std::vector<uint8_t> pieces = random_bytes(static_cast<size_t>(state.range(0)) * 20);
+    for (auto _ : state) {
+        std::vector<std::string> hex = bytes_to_hex(pieces);
+        benchmark::DoNotOptimize(hex);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_BytesToHex)->Arg(1000)->Arg(100000);
+
+// Frame a message with send_peer_message and parse it back with read_peer_message
+// over a local socket pair, payload 4 is a have, 16 KiB + 8 a piece message
+static void BM_PeerMessageFramer(benchmark::State& state) {
+    int sockets[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+        state.SkipWithError("socketpair failed");
+        return;
+    }
+    std::vector<uint8_t> payload = random_bytes(static_cast<size_t>(state.range(0)));
+    for (auto _ : state) {
+        send_peer_message(sockets[0], MSG_PIECE, payload.data(), payload.size());
+        PeerMessage msg = read_peer_message(sockets[1]);
+        benchmark::DoNotOptimize(msg);
+    }
+    state.SetBytesProcessed(state.iterations() * (state.range(0) + 5));
+    close(sockets[0]);
+    close(sockets[1]);
+}
+BENCHMARK(BM_PeerMessageFramer)->Arg(4)->Arg(16 * 1024 + 8);
+
+// A piece state of the given size with uneven availability from 20 peers.
+// have_ratio of the pieces are already downloaded.
+PieceState make_piece_state(size_t piece_count, double have_ratio) {
+    std::mt19937 rng(3);
+    PieceState state(piece_count);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    for (int peer = 0; peer < 20; ++peer) {
+        Bitset pieces(piece_count);
+        for (size_t i = 0; i < piece_count; ++i) {
+            if (unit(rng) < 0.5) {
+                pieces.set(i);
+            }
+        }
+        state.add_availability(pieces);
+    }
+    for (size_t i = 0; i < piece_count; ++i) {
+        if (unit(rng) < have_ratio) {
+            state.mark_have(i);
+        }
+    }
+    return state;
+}
+
+static void BM_PickPiece(benchmark::State& state) {
+    const size_t piece_count = static_cast<size_t>(state.range(0));
+    PieceState pieces = make_piece_state(piece_count, 0.5);
+    Bitset peer_pieces(piece_count, true);
+    for (auto _ : state) {
+        size_t piece = pieces.pick_piece(peer_pieces, false);
+        benchmark::DoNotOptimize(piece);
+    }
+}
+BENCHMARK(BM_PickPiece)->RangeMultiplier(10)->Range(1000, 1000000);
+
+// the end of a download, the few missing pieces are spread over the whole bitset
+static void BM_PickPieceNearlyComplete(benchmark::State& state) {
+    const size_t piece_count = static_cast<size_t>(state.range(0));
+    PieceState pieces = make_piece_state(piece_count, 0.999);
+    for (auto _ : state) {
+        size_t piece = pieces.pick_piece(Bitset(), true);
+        benchmark::DoNotOptimize(piece);
+    }
+}
+BENCHMARK(BM_PickPieceNearlyComplete)->RangeMultiplier(10)->Range(1000, 1000000);
+
+// a peer's bitfield arriving and the peer going away again
+static void BM_BitfieldAvailability(benchmark::State& state) {
+    const size_t piece_count = static_cast<size_t>(state.range(0));
+    PieceState pieces = make_piece_state(piece_count, 0.5);
+    std::vector<uint8_t> bitfield = random_bytes((piece_count + 7) / 8);
+    for (auto _ : state) {
+        Bitset peer_pieces = Bitset::from_bytes(bitfield.data(), bitfield.size());
+        pieces.add_availability(peer_pieces);
+        pieces.remove_availability(peer_pieces);
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(piece_count));
+}
+BENCHMARK(BM_BitfieldAvailability)->RangeMultiplier(10)->Range(1000, 1000000);
+
+BENCHMARK_MAIN();
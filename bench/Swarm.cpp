@@ -0,0 +1,499 @@
+// this is the entry point of the loopback swarm simulator: a synthetic torrent is served by
+// local seeders and a local HTTP tracker on 127.0.0.1, and download_complete_file fetches it
+// from them. Reports throughput, time to first byte and client CPU per GB.
+// Seeders can be given latency and a bandwidth cap each to reproduce WAN behaviour.
+//   bittorrent_swarm --size 1G --piece-length 256K --peers 8 --latency 20,80 --bandwidth 50M
+
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <csignal>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "lib/decode.hpp" // bencode encoding of the metainfo and tracker replies
+#include "lib/sha1.hpp" // piece hashes
+#include "lib/peers.hpp" // peer message framing
+#include "lib/download.hpp" // download_complete_file
+#include "lib/nlohmann/json.hpp"
+using json = nlohmann::json;
+
+// link conditions of one fake peer, zero means unlimited
+struct PeerShaping {
+    std::chrono::microseconds latency{0}; // one way, added to everything the seeder sends
+    int64_t bandwidth = 0; // bytes per second
+};
+
+struct SwarmOptions {
+    int64_t size = 64 << 20;
+    int64_t piece_length = 256 << 10;
+    int peers = 4;
+    // per peer shaping, peer i gets entry i modulo the list size
+    std::vector<int64_t> latency_ms{0};
+    std::vector<int64_t> bandwidth{0};
+    std::string json_path;
+};
+
+// Counters the seeder process updates and the client process reads, they live
+// in a shared anonymous mapping created before the fork
+struct SwarmStats {
+    std::atomic<int64_t> first_block_ns{0}; // steady clock time the first block went out
+    std::atomic<int64_t> bytes_served{0};
+    std::atomic<int64_t> connections{0};
+};
+
+int64_t steady_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Function to parse a byte count with an optional K, M or G suffix (powers of 1024)
+int64_t parse_size(const std::string& text) {
+    size_t used = 0;
+    int64_t value = std::stoll(text, &used);
+    std::string suffix = text.substr(used);
+    if (suffix == "K" || suffix == "k") {
+        value <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        value <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        value <<= 30;
+    } else if (!suffix.empty()) {
+        throw std::runtime_error("Invalid size: " + text);
+    }
+    return value;
+}
+
+// Function to parse a comma separated list of sizes
+std::vector<int64_t> parse_size_list(const std::string& text) {
+    std::vector<int64_t> values;
+    std::stringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        values.push_back(parse_size(item));
+    }
+    if (values.empty()) {
+        throw std::runtime_error("Empty list: " + text);
+    }
+    return values;
+}
+
+// Function to frame a peer message into a buffer of its own, it is queued before being sent
+std::vector<uint8_t> frame_message(uint8_t id, const uint8_t* payload, size_t payload_length) {
+    std::vector<uint8_t> frame(5 + payload_length);
+    write_uint32(frame.data(), static_cast<uint32_t>(payload_length + 1));
+    frame[4] = id;
+    if (payload_length > 0) {
+        memcpy(frame.data() + 5, payload, payload_length);
+    }
+    return frame;
+}
+
+// Function to listen on an ephemeral loopback port, port receives the port picked
+socket_t listen_on_loopback(uint16_t& port) {
+    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET_VALUE) {
+        throw std::runtime_error("Failed to create socket");
+    }
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    socklen_t addr_length = sizeof(addr);
+    if (bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(sock, 64) != 0 ||
+        getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &addr_length) != 0) {
+        CLOSE_SOCKET(sock);
+        throw std::runtime_error("Failed to listen on 127.0.0.1");
+    }
+    port = ntohs(addr.sin_port);
+    return sock;
+}
+
+// Outgoing side of a seeder connection. A message leaves latency after it was queued and
+// the link carries at most bandwidth bytes a second, so pipelined requests see the same
+// round trips and throughput they would over a WAN.
+class ShapedSender {
+public:
+    ShapedSender(socket_t sock, PeerShaping shaping, SwarmStats* stats)
+        : sock(sock), shaping(shaping), stats(stats), worker([this]() { run(); }) {}
+
+    ~ShapedSender() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closing = true;
+        }
+        queued.notify_one();
+        worker.join();
+    }
+
+    ShapedSender(const ShapedSender&) = delete;
+    ShapedSender& operator=(const ShapedSender&) = delete;
+
+    void send(std::vector<uint8_t> bytes, bool block = false) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending.push_back({std::chrono::steady_clock::now() + shaping.latency, std::move(bytes), block});
+        }
+        queued.notify_one();
+    }
+
+private:
+    struct Pending {
+        std::chrono::steady_clock::time_point due;
+        std::vector<uint8_t> bytes;
+        bool block;
+    };
+
+    void run() {
+        // when the link is free again after the last message, a token bucket of one message
+        auto link_free = std::chrono::steady_clock::now();
+        while (true) {
+            Pending item;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queued.wait(lock, [&]() { return closing || !pending.empty(); });
+                if (closing) {
+                    return;
+                }
+                item = std::move(pending.front());
+                pending.pop_front();
+            }
+            auto start = std::max(item.due, link_free);
+            std::this_thread::sleep_until(start);
+            if (!send_all(sock, item.bytes.data(), item.bytes.size())) {
+                return;
+            }
+            if (shaping.bandwidth > 0) {
+                link_free = start + std::chrono::nanoseconds(static_cast<int64_t>(item.bytes.size()) * 1000000000 / shaping.bandwidth);
+            }
+            if (item.block) {
+                int64_t none = 0;
+                stats->first_block_ns.compare_exchange_strong(none, steady_now_ns());
+                stats->bytes_served += static_cast<int64_t>(item.bytes.size()) - 13;
+            }
+        }
+    }
+
+    socket_t sock;
+    PeerShaping shaping;
+    SwarmStats* stats;
+    std::mutex mutex;
+    std::condition_variable queued;
+    std::deque<Pending> pending;
+    bool closing = false;
+    std::thread worker; // last, it starts running in the constructor
+};
+
+// Function to seed data to one connected peer until it goes away.
+// The seeder has every piece, unchokes whoever is interested and serves any request.
+void serve_peer(socket_t sock, const std::vector<uint8_t>& data, int64_t piece_length, PeerShaping shaping,
+                SwarmStats* stats) {
+    char handshake[68];
+    if (!recv_exact(sock, handshake, sizeof(handshake))) {
+        CLOSE_SOCKET(sock);
+        return;
+    }
+    ++stats->connections;
+    int no_delay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    {
+        ShapedSender sender(sock, shaping, stats);
+        // answer with the info hash asked for, no extensions and a peer id of our own
+        std::vector<uint8_t> reply(handshake, handshake + 48);
+        std::fill(reply.begin() + 20, reply.begin() + 28, 0);
+        std::string peer_id = generate_peer_id();
+        reply.insert(reply.end(), peer_id.begin(), peer_id.end());
+        sender.send(std::move(reply));
+
+        size_t pieces = static_cast<size_t>((static_cast<int64_t>(data.size()) + piece_length - 1) / piece_length);
+        std::vector<uint8_t> bitfield((pieces + 7) / 8, 0xFF);
+        if (pieces % 8) {
+            bitfield.back() = static_cast<uint8_t>(0xFF << (8 - pieces % 8));
+        }
+        sender.send(frame_message(MSG_BITFIELD, bitfield.data(), bitfield.size()));
+
+        while (true) {
+            PeerMessage msg;
+            try {
+                msg = read_peer_message(sock);
+            } catch (const std::exception&) {
+                break;
+            }
+            if (msg.id == MSG_INTERESTED) {
+                sender.send(frame_message(MSG_UNCHOKE, nullptr, 0));
+            } else if (msg.id == MSG_REQUEST && msg.payload.size() == 12) {
+                int64_t offset = static_cast<int64_t>(read_uint32(msg.payload, 0)) * piece_length + read_uint32(msg.payload, 4);
+                uint32_t length = read_uint32(msg.payload, 8);
+                if (length > 128 * 1024 || offset + length > static_cast<int64_t>(data.size())) {
+                    break;
+                }
+                std::vector<uint8_t> frame = frame_message(MSG_PIECE, msg.payload.data(), 8);
+                frame.insert(frame.end(), data.begin() + offset, data.begin() + offset + length);
+                write_uint32(frame.data(), static_cast<uint32_t>(frame.size() - 4));
+                sender.send(std::move(frame), true);
+            }
+        }
+    }
+    CLOSE_SOCKET(sock);
+}
+
+// Function to run an HTTP tracker that hands every announce the same compact peer list
+void run_tracker(socket_t listener, const std::string& compact_peers) {
+    json reply = json::object();
+    reply["interval"] = 1800;
+    reply["peers"] = compact_peers;
+    std::string body = bencode_decoded_value(reply);
+    std::string response = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: " +
+                           std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    while (true) {
+        socket_t client = accept(listener, nullptr, nullptr);
+        if (client == INVALID_SOCKET_VALUE) {
+            continue;
+        }
+        // the announce parameters don't matter, read the request head and answer
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos) {
+            auto received = recv(client, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                break;
+            }
+            request.append(buffer, received);
+        }
+        send_all(client, reinterpret_cast<const uint8_t*>(response.data()), response.size());
+        CLOSE_SOCKET(client);
+    }
+}
+
+// Function to start the seeders and the tracker, this is the whole seeder process.
+// The tracker port goes to ready_fd once everyone listens; never returns.
+[[noreturn]] void run_swarm(const std::vector<uint8_t>& data, const SwarmOptions& options, SwarmStats* stats, int ready_fd) {
+    signal(SIGPIPE, SIG_IGN);
+    std::string compact_peers;
+    for (int i = 0; i < options.peers; ++i) {
+        PeerShaping shaping;
+        shaping.latency = std::chrono::milliseconds(options.latency_ms[i % options.latency_ms.size()]);
+        shaping.bandwidth = options.bandwidth[i % options.bandwidth.size()];
+        uint16_t port = 0;
+        socket_t listener = listen_on_loopback(port);
+        uint8_t entry[6] = {127, 0, 0, 1, static_cast<uint8_t>(port >> 8), static_cast<uint8_t>(port)};
+        compact_peers.append(reinterpret_cast<char*>(entry), sizeof(entry));
+        std::thread([listener, shaping, &data, &options, stats]() {
+            while (true) {
+                socket_t client = accept(listener, nullptr, nullptr);
+                if (client != INVALID_SOCKET_VALUE) {
+                    std::thread(serve_peer, client, std::cref(data), options.piece_length, shaping, stats).detach();
+                }
+            }
+        }).detach();
+    }
+    uint16_t tracker_port = 0;
+    socket_t tracker = listen_on_loopback(tracker_port);
+    if (write(ready_fd, &tracker_port, sizeof(tracker_port)) != sizeof(tracker_port)) {
+        _exit(1);
+    }
+    close(ready_fd);
+    run_tracker(tracker, compact_peers);
+    _exit(0);
+}
+
+// Function to make size bytes of random content, a piece per piece_length bytes
+std::vector<uint8_t> make_content(int64_t size) {
+    std::mt19937_64 rng(42);
+    std::vector<uint8_t> data(static_cast<size_t>(size));
+    size_t i = 0;
+    for (; i + 8 <= data.size(); i += 8) {
+        uint64_t word = rng();
+        memcpy(data.data() + i, &word, 8);
+    }
+    for (; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(rng());
+    }
+    return data;
+}
+
+// Function to bencode a single file metainfo for data announcing to tracker_port
+std::string make_metainfo(const std::vector<uint8_t>& data, int64_t piece_length, uint16_t tracker_port) {
+    std::string pieces;
+    for (size_t offset = 0; offset < data.size(); offset += static_cast<size_t>(piece_length)) {
+        SHA1 sha1;
+        sha1.update(data.data() + offset, std::min(static_cast<size_t>(piece_length), data.size() - offset));
+        std::vector<uint8_t> digest = hex_to_bytes(sha1.final());
+        pieces.append(digest.begin(), digest.end());
+    }
+    json info = json::object();
+    info["length"] = static_cast<int64_t>(data.size());
+    info["name"] = "swarm.bin";
+    info["piece length"] = piece_length;
+    info["pieces"] = pieces;
+    json torrent = json::object();
+    torrent["announce"] = "http://127.0.0.1:" + std::to_string(tracker_port) + "/announce";
+    torrent["info"] = info;
+    return bencode_decoded_value(torrent);
+}
+
+// CPU time this process used so far, seconds. The seeders run in a child and aren't counted.
+double process_cpu_seconds() {
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// Function to check the downloaded file against the content
+bool verify_output(const std::string& path, const std::vector<uint8_t>& data) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> contents((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return contents == data;
+}
+
+void show_usage(const std::string& program_name) {
+    std::cout << "Usage: " << program_name << " [options]" << std::endl;
+    std::cout << "  --size <bytes>                Size of the synthetic torrent, K/M/G suffixes (default 64M)" << std::endl;
+    std::cout << "  --piece-length <bytes>        Piece length (default 256K)" << std::endl;
+    std::cout << "  --peers <n>                   Number of local seeders (default 4)" << std::endl;
+    std::cout << "  --latency <ms,...>            One way latency per seeder, cycled over the seeders" << std::endl;
+    std::cout << "  --bandwidth <bytes/s,...>     Upload cap per seeder, cycled over the seeders, 0 is unlimited" << std::endl;
+    std::cout << "  --json <path>                 Also write the results as JSON" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    std::cout << std::unitbuf;
+    std::cerr << std::unitbuf;
+
+    SwarmOptions options;
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string option = argv[i];
+            if (option == "--help") {
+                show_usage(argv[0]);
+                return 0;
+            }
+            if (i + 1 >= argc) {
+                throw std::runtime_error("Missing value for " + option);
+            }
+            std::string value = argv[++i];
+            if (option == "--size") {
+                options.size = parse_size(value);
+            } else if (option == "--piece-length") {
+                options.piece_length = parse_size(value);
+            } else if (option == "--peers") {
+                options.peers = std::stoi(value);
+            } else if (option == "--latency") {
+                options.latency_ms = parse_size_list(value);
+            } else if (option == "--bandwidth") {
+                options.bandwidth = parse_size_list(value);
+            } else if (option == "--json") {
+                options.json_path = value;
+            } else {
+                throw std::runtime_error("Unknown option: " + option);
+            }
+        }
+        if (options.size <= 0 || options.piece_length < 16 * 1024 || options.peers < 1) {
+            throw std::runtime_error("Size, piece length (at least 16K) and peers must be positive");
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        show_usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<uint8_t> data = make_content(options.size);
+
+    // the seeders get a process of their own so the CPU time measured here is the client's
+    void* shared = mmap(nullptr, sizeof(SwarmStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        std::cerr << "Error: mmap failed" << std::endl;
+        return 1;
+    }
+    SwarmStats* stats = new (shared) SwarmStats();
+    int ready[2];
+    if (pipe(ready) != 0) {
+        std::cerr << "Error: pipe failed" << std::endl;
+        return 1;
+    }
+    pid_t seeders = fork();
+    if (seeders < 0) {
+        std::cerr << "Error: fork failed" << std::endl;
+        return 1;
+    }
+    if (seeders == 0) {
+        close(ready[0]);
+        try {
+            run_swarm(data, options, stats, ready[1]);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            _exit(1);
+        }
+    }
+    close(ready[1]);
+    uint16_t tracker_port = 0;
+    bool swarm_up = read(ready[0], &tracker_port, sizeof(tracker_port)) == sizeof(tracker_port);
+    close(ready[0]);
+
+    std::filesystem::path work_dir = std::filesystem::temp_directory_path() / ("bittorrent_swarm_" + std::to_string(getpid()));
+    std::string output_path = (work_dir / "swarm.bin").string();
+    json results = json::object();
+    int status = 0;
+    try {
+        if (!swarm_up) {
+            throw std::runtime_error("Seeders failed to start");
+        }
+        std::string metainfo = make_metainfo(data, options.piece_length, tracker_port);
+        std::filesystem::create_directories(work_dir);
+
+        double cpu_start = process_cpu_seconds();
+        int64_t start_ns = steady_now_ns();
+        download_complete_file(metainfo, output_path);
+        int64_t end_ns = steady_now_ns();
+        double cpu_seconds = process_cpu_seconds() - cpu_start;
+
+        double seconds = (end_ns - start_ns) / 1e9;
+        double gigabytes = static_cast<double>(options.size) / (1 << 30);
+        int64_t first_block_ns = stats->first_block_ns.load();
+        results["size"] = options.size;
+        results["piece_length"] = options.piece_length;
+        results["peers"] = options.peers;
+        results["latency_ms"] = options.latency_ms;
+        results["bandwidth"] = options.bandwidth;
+        results["seconds"] = seconds;
+        results["mb_per_second"] = options.size / seconds / (1 << 20);
+        results["time_to_first_byte_ms"] = first_block_ns ? (first_block_ns - start_ns) / 1e6 : -1.0;
+        results["cpu_seconds"] = cpu_seconds;
+        results["cpu_seconds_per_gb"] = cpu_seconds / gigabytes;
+        results["bytes_served"] = stats->bytes_served.load();
+        results["connections"] = stats->connections.load();
+        results["verified"] = verify_output(output_path, data);
+        if (!results["verified"].get<bool>()) {
+            status = 1;
+        }
+
+        std::cout << "\nSwarm results:" << std::endl;
+        for (const auto& [key, value] : results.items()) {
+            std::cout << "  " << key << ": " << value.dump() << std::endl;
+        }
+        if (!options.json_path.empty()) {
+            std::ofstream(options.json_path) << results.dump(2) << std::endl;
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        status = 1;
+    }
+
+    kill(seeders, SIGTERM);
+    waitpid(seeders, nullptr, 0);
+    std::error_code ignored;
+    std::filesystem::remove_all(work_dir, ignored);
+    return status;
+}
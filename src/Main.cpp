@@ -6,6 +6,11 @@
 #include "lib/utils.hpp" // read files, parse torrent
 #include "lib/peers.hpp" // show and discover peers
 #include "lib/download.hpp" // download functionality
+#include "lib/magnet.hpp" // magnet links and metadata exchange
+#include "lib/session.hpp" // many torrents in one process
+#include "lib/control.hpp" // daemon control socket
+#include "lib/metrics_server.hpp" // Prometheus metrics endpoint
+#include "lib/trace.hpp" // Chrome trace output
 #include "lib/nlohmann/json.hpp" // json library to efficiently store bencoded content
 using json = nlohmann::json;
 
@@ -37,10 +42,10 @@ int main(int argc, char* argv[]) {
             std::cout << decoded_value.dump() << std::endl;
         } else if (command == "info") {
             if(argc < 3) {
-                std::cerr << "Usage: " << argv[0] << " info <torrent_file>" << std::endl;
+                std::cerr << "Usage: " << argv[0] << " info <torrent_file|magnet_link>" << std::endl;
                 return 1;
             }
-            std::string encoded_value = read_file(argv[2]);
+            std::string encoded_value = load_torrent(argv[2]);
             info_torrent(encoded_value);
         } else if (command == "peers") {
             if(argc < 3) {
@@ -73,7 +78,11 @@ int main(int argc, char* argv[]) {
         } 
         else if (command == "download") {
             if (argc < 5) {
-                std::cerr << "Usage: " << argv[0] << " download -o <output_path|default> <torrent_file>" << std::endl;
+                std::cerr << "Usage: " << argv[0] << " download -o <output_path|default> <torrent_file|magnet_link>"
+                          << " [--sparse] [--direct] [--files <index,...>] [--download-limit <rate>] [--upload-limit <rate>]"
+                          << " [--wan-download-limit <rate>] [--wan-upload-limit <rate>]"
+                          << " [--metrics <[host:]port>] [--trace <file>] [--peer-cache <file|none>]"
+                          << " [--peer-cache-size <peers>]" << std::endl;
                 return 1;
             }
             if (std::string(argv[2]) != "-o") {
@@ -81,8 +90,195 @@ int main(int argc, char* argv[]) {
                 return 1;
             }
             std::string output_path = argv[3];
-            std::string encoded_value = read_file(argv[4]);
-            download_complete_file(encoded_value, output_path);
+            std::string source = argv[4];
+            StorageOptions options;
+            std::vector<size_t> selected_files;
+            std::unique_ptr<MetricsServer> metrics_server;
+            std::unique_ptr<TraceRecording> trace;
+            RateLimits limits;
+            RateLimits wan_limits;
+            std::string peer_cache_path = default_peer_cache_path();
+            size_t peer_cache_size = PeerCache::DEFAULT_CAPACITY;
+            for (int i = 5; i < argc; ++i) {
+                std::string option = argv[i];
+                if (option == "--sparse") {
+                    options.allocation = AllocationMode::Sparse;
+                } else if (option == "--direct") {
+                    options.direct_io = true;
+                } else if (option == "--files" && i + 1 < argc) {
+                    std::stringstream list(argv[++i]);
+                    std::string index;
+                    while (std::getline(list, index, ',')) {
+                        selected_files.push_back(std::stoul(index));
+                    }
+                } else if (option == "--download-limit" && i + 1 < argc) {
+                    limits.download = parse_rate(argv[++i]);
+                } else if (option == "--upload-limit" && i + 1 < argc) {
+                    limits.upload = parse_rate(argv[++i]);
+                } else if (option == "--wan-download-limit" && i + 1 < argc) {
+                    wan_limits.download = parse_rate(argv[++i]);
+                } else if (option == "--wan-upload-limit" && i + 1 < argc) {
+                    wan_limits.upload = parse_rate(argv[++i]);
+                } else if (option == "--metrics" && i + 1 < argc) {
+                    metrics_server = std::make_unique<MetricsServer>(argv[++i]);
+                    std::cerr << "Serving metrics on port " << metrics_server->port() << std::endl;
+                } else if (option == "--trace" && i + 1 < argc) {
+                    trace = std::make_unique<TraceRecording>(argv[++i]);
+                } else if (option == "--peer-cache" && i + 1 < argc) {
+                    peer_cache_path = argv[++i];
+                } else if (option == "--peer-cache-size" && i + 1 < argc) {
+                    peer_cache_size = std::stoul(argv[++i]);
+                } else {
+                    std::cerr << "Unknown option: " << option << std::endl;
+                    return 1;
+                }
+            }
+            // the peers found for a magnet link are handed on, the download needn't look for them again
+            ResolvedMagnet loaded = load_torrent_and_peers(source);
+            const std::string& encoded_value = loaded.torrent;
+            if (!selected_files.empty()) {
+                // file indices are those printed by the info command
+                options.wanted_files.assign(parse_torrent(encoded_value).info.files.size(), false);
+                for (size_t index : selected_files) {
+                    if (index >= options.wanted_files.size()) {
+                        throw std::runtime_error("No file with index " + std::to_string(index));
+                    }
+                    options.wanted_files[index] = true;
+                }
+            }
+            rate_limiter().set_class(PeerClass::Wan, wan_limits);
+            std::unique_ptr<PeerCache> peer_cache = open_peer_cache(peer_cache_path, peer_cache_size);
+            download_complete_file(encoded_value, output_path, options, limits, peer_cache.get(), loaded.peers);
+        } else if (command == "download_all") {
+            if (argc < 5 || std::string(argv[2]) != "-o") {
+                std::cerr << "Usage: " << argv[0] << " download_all -o <output_dir> <torrent_file|magnet_link>..."
+                          << " [--active <n>] [--download-limit <rate>] [--upload-limit <rate>]"
+                          << " [--metrics <[host:]port>] [--peer-cache <file|none>] [--peer-cache-size <peers>]" << std::endl;
+                return 1;
+            }
+            std::filesystem::path output_dir = argv[3];
+            std::vector<std::string> sources;
+            SessionSettings settings;
+            std::unique_ptr<MetricsServer> metrics_server;
+            for (int i = 4; i < argc; ++i) {
+                std::string option = argv[i];
+                if (option == "--active" && i + 1 < argc) {
+                    settings.active_downloads = std::stoul(argv[++i]);
+                } else if (option == "--download-limit" && i + 1 < argc) {
+                    settings.global_limits.download = parse_rate(argv[++i]);
+                } else if (option == "--upload-limit" && i + 1 < argc) {
+                    settings.global_limits.upload = parse_rate(argv[++i]);
+                } else if (option == "--metrics" && i + 1 < argc) {
+                    metrics_server = std::make_unique<MetricsServer>(argv[++i]);
+                    std::cerr << "Serving metrics on port " << metrics_server->port() << std::endl;
+                } else if (option == "--peer-cache" && i + 1 < argc) {
+                    settings.peer_cache_path = argv[++i];
+                } else if (option == "--peer-cache-size" && i + 1 < argc) {
+                    settings.peer_cache_size = std::stoul(argv[++i]);
+                } else if (option.rfind("--", 0) == 0) {
+                    std::cerr << "Unknown option: " << option << std::endl;
+                    return 1;
+                } else {
+                    sources.push_back(option);
+                }
+            }
+            std::filesystem::create_directories(output_dir);
+            Session session(settings);
+            size_t added = 0;
+            for (const std::string& source : sources) {
+                try {
+                    ResolvedMagnet loaded = load_torrent_and_peers(source);
+                    std::string name = get_default_output_path(parse_torrent(loaded.torrent).info);
+                    session.add(loaded.torrent, (output_dir / name).string(), {}, {}, loaded.peers);
+                    ++added;
+                } catch (const std::exception& e) {
+                    std::cerr << "Skipping " << source << ": " << e.what() << std::endl;
+                }
+            }
+            // one status line, rewritten every second until nothing is left to do
+            auto print_status = [&]() {
+                size_t complete = 0, downloading = 0;
+                int64_t downloaded = 0, wanted = 0;
+                for (const TorrentStatus& torrent : session.status()) {
+                    complete += torrent.state == TorrentState::Complete;
+                    downloading += torrent.state == TorrentState::Downloading;
+                    downloaded += torrent.downloaded;
+                    wanted += torrent.wanted;
+                }
+                std::cout << "\r" << complete << "/" << added << " complete, " << downloading
+                          << " downloading, " << downloaded / (1024 * 1024) << " of " << wanted / (1024 * 1024)
+                          << " MiB known so far   ";
+            };
+            bool idle = false;
+            while (!idle) {
+                print_status();
+                idle = session.wait_idle_for(std::chrono::seconds(1));
+            }
+            print_status();
+            std::cout << std::endl;
+            bool failed = false;
+            for (const TorrentStatus& torrent : session.status()) {
+                if (torrent.state == TorrentState::Failed) {
+                    std::cerr << "Failed to download " << torrent.name << ": " << torrent.error << std::endl;
+                    failed = true;
+                }
+            }
+            return failed || added < sources.size() ? 1 : 0;
+        } else if (command == "daemon") {
+            if (argc < 4 || std::string(argv[2]) != "--socket") {
+                std::cerr << "Usage: " << argv[0] << " daemon --socket <path> [--active <n>]"
+                          << " [--download-limit <rate>] [--upload-limit <rate>] [--metrics <[host:]port>]"
+                          << " [--peer-cache <file|none>] [--peer-cache-size <peers>]" << std::endl;
+                return 1;
+            }
+            std::string socket_path = argv[3];
+            SessionSettings settings;
+            std::unique_ptr<MetricsServer> metrics_server;
+            for (int i = 4; i < argc; ++i) {
+                std::string option = argv[i];
+                if (option == "--active" && i + 1 < argc) {
+                    settings.active_downloads = std::stoul(argv[++i]);
+                } else if (option == "--download-limit" && i + 1 < argc) {
+                    settings.global_limits.download = parse_rate(argv[++i]);
+                } else if (option == "--upload-limit" && i + 1 < argc) {
+                    settings.global_limits.upload = parse_rate(argv[++i]);
+                } else if (option == "--metrics" && i + 1 < argc) {
+                    metrics_server = std::make_unique<MetricsServer>(argv[++i]);
+                    std::cerr << "Serving metrics on port " << metrics_server->port() << std::endl;
+                } else if (option == "--peer-cache" && i + 1 < argc) {
+                    settings.peer_cache_path = argv[++i];
+                } else if (option == "--peer-cache-size" && i + 1 < argc) {
+                    settings.peer_cache_size = std::stoul(argv[++i]);
+                } else {
+                    std::cerr << "Unknown option: " << option << std::endl;
+                    return 1;
+                }
+            }
+            Session session(settings);
+            ControlServer server(socket_path, session);
+            std::cerr << "Listening for control requests on " << socket_path << std::endl;
+            server.run();
+        } else if (command == "control") {
+            if (argc < 4) {
+                std::cerr << "Usage: " << argv[0] << " control <socket_path> <request_json>... (- reads requests from stdin)"
+                          << std::endl;
+                return 1;
+            }
+            std::vector<std::string> requests;
+            for (int i = 3; i < argc; ++i) {
+                if (std::string(argv[i]) == "-") {
+                    // a batch, one request per line
+                    std::string line;
+                    while (std::getline(std::cin, line)) {
+                        if (line.find_first_not_of(" \t\r") != std::string::npos) {
+                            requests.push_back(line);
+                        }
+                    }
+                } else {
+                    requests.push_back(argv[i]);
+                }
+            }
+            return send_control_requests(argv[2], requests) ? 0 : 1;
         } else if (command == "help") {
             show_help(argv[0]);
         } else {
@@ -102,9 +298,38 @@ void show_help(const std::string& program_name) {
     std::cout << "Usage: " << program_name << " command [arguments...]" << std::endl;
     std::cout << "Commands:" << std::endl;
     std::cout << "  decode <encoded_value>                    Decode a bencoded value" << std::endl;
-    std::cout << "  info <torrent_file>                       Show info about a torrent file" << std::endl;
+    std::cout << "  info <torrent_file|magnet_link>           Show info about a torrent file" << std::endl;
     std::cout << "  peers <torrent_file>                      Show peers from a torrent file" << std::endl;
-    std::cout << "  download -o <output_path> <torrent_file>  Download complete file from torrent" << std::endl;
+    std::cout << "  download -o <output_path> <torrent_file|magnet_link>" << std::endl;
+    std::cout << "                                            Download complete file from torrent" << std::endl;
+    std::cout << "      --sparse                              Don't reserve disk space up front" << std::endl;
+    std::cout << "      --direct                              Write with O_DIRECT, bypassing the page cache" << std::endl;
+    std::cout << "      --files <index,...>                   Only download these files of a multi-file torrent" << std::endl;
+    std::cout << "      --download-limit <rate>               Cap download speed, bytes/s with K/M/G suffixes" << std::endl;
+    std::cout << "      --upload-limit <rate>                 Cap upload speed" << std::endl;
+    std::cout << "      --wan-download-limit <rate>           Cap download speed from peers outside the LAN" << std::endl;
+    std::cout << "      --wan-upload-limit <rate>             Cap upload speed to peers outside the LAN" << std::endl;
+    std::cout << "      --metrics <[host:]port>               Serve Prometheus metrics at /metrics while downloading" << std::endl;
+    std::cout << "      --trace <file>                        Write a Chrome trace of the download (tracing builds only)" << std::endl;
+    std::cout << "      --peer-cache <file|none>              Where peers are remembered across runs" << std::endl;
+    std::cout << "                                            (default ~/.cache/bittorrent/peers.cache)" << std::endl;
+    std::cout << "      --peer-cache-size <peers>             Peers the cache holds for all torrents (default 8192)" << std::endl;
+    std::cout << "  download_all -o <output_dir> <torrent_file|magnet_link>..." << std::endl;
+    std::cout << "                                            Download many torrents in one process" << std::endl;
+    std::cout << "      --active <n>                          Torrents downloading at the same time (default 4)" << std::endl;
+    std::cout << "      --download-limit <rate>               Cap the download speed of all torrents together" << std::endl;
+    std::cout << "      --upload-limit <rate>                 Cap the upload speed of all torrents together" << std::endl;
+    std::cout << "      --metrics <[host:]port>               Serve Prometheus metrics at /metrics while downloading" << std::endl;
+    std::cout << "      --peer-cache <file|none>              Where peers are remembered across runs" << std::endl;
+    std::cout << "      --peer-cache-size <peers>             Peers the cache holds, about 64 per torrent is plenty" << std::endl;
+    std::cout << "  daemon --socket <path>                    Run a session controlled over a Unix domain socket" << std::endl;
+    std::cout << "      --active <n>                          Torrents downloading at the same time (default 4)" << std::endl;
+    std::cout << "      --download-limit <rate>               Cap the download speed of all torrents together" << std::endl;
+    std::cout << "      --upload-limit <rate>                 Cap the upload speed of all torrents together" << std::endl;
+    std::cout << "      --metrics <[host:]port>               Serve Prometheus metrics at /metrics" << std::endl;
+    std::cout << "      --peer-cache <file|none>              Where peers are remembered across runs" << std::endl;
+    std::cout << "      --peer-cache-size <peers>             Peers the cache holds, about 64 per torrent is plenty" << std::endl;
+    std::cout << "  control <socket_path> <request_json>...   Send requests to a daemon, - reads them from stdin" << std::endl;
     std::cout << "  download_piece -o <output_path> <torrent_file> <piece_index>" << std::endl;
     std::cout << "  help                                      Show this help message" << std::endl;
 }
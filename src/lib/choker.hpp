@@ -0,0 +1,230 @@
+#ifndef CHOKER_HPP
+#define CHOKER_HPP
+
+// this file contains the tit-for-tat choking algorithm (regular unchoke every 10 s,
+// optimistic unchoke rotated every 30 s) and the rate meters it ranks peers by
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+// Measures a transfer rate in bytes per second.
+// Bytes are accumulated as they arrive and folded into a moving average
+// each time sample() is called, so adding bytes is just an addition.
+class RateMeter {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void add(uint64_t bytes) {
+        pending += bytes;
+        total_bytes += bytes;
+    }
+
+    // fold the bytes seen since the last sample into the average
+    void sample(Clock::time_point now) {
+        if (last_sample == Clock::time_point{}) {
+            last_sample = now;
+            return;
+        }
+        double seconds = std::chrono::duration<double>(now - last_sample).count();
+        if (seconds <= 0.0) {
+            return;
+        }
+        double current = static_cast<double>(pending) / seconds;
+        // weight the newest window at 1/2, older windows decay geometrically
+        average = has_average ? (average + current) / 2.0 : current;
+        has_average = true;
+        pending = 0;
+        last_sample = now;
+    }
+
+    double rate() const { return average; }
+    uint64_t total() const { return total_bytes; }
+
+private:
+    uint64_t pending = 0;
+    uint64_t total_bytes = 0;
+    double average = 0.0;
+    bool has_average = false;
+    Clock::time_point last_sample{};
+};
+
+// a choke/unchoke message the caller has to send to a peer
+struct ChokeDecision {
+    uint64_t peer;
+    bool choke;
+};
+
+// Tit-for-tat choker.
+// Every 10 s the interested peers are ranked by the rate they give us (their upload
+// to us while we leech, our upload to them while we seed) and the best ones are unchoked.
+// Every 30 s one extra choked peer is unchoked at random so new peers get a chance to
+// prove themselves; freshly connected peers are three times as likely to be picked.
+class Choker {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr Clock::duration REGULAR_INTERVAL = std::chrono::seconds(10);
+    static constexpr Clock::duration OPTIMISTIC_INTERVAL = std::chrono::seconds(30);
+    static constexpr Clock::duration NEW_PEER_WINDOW = std::chrono::seconds(60);
+
+    // slots is the total number of unchoked interested peers, including the optimistic one;
+    // seed fixes the optimistic picks, for tests
+    explicit Choker(size_t slots = 4, uint32_t seed = std::random_device{}())
+        : unchoke_slots(std::max<size_t>(slots, 1)), rng(seed) {}
+
+    void add_peer(uint64_t id, Clock::time_point now) {
+        ChokerPeer& peer = peers[id];
+        peer.connected_at = now;
+    }
+
+    void remove_peer(uint64_t id) {
+        peers.erase(id);
+        if (optimistic_peer == id) {
+            has_optimistic = false;
+        }
+    }
+
+    void set_interested(uint64_t id, bool interested) {
+        auto it = peers.find(id);
+        if (it != peers.end()) {
+            it->second.interested = interested;
+        }
+    }
+
+    // bytes we received from the peer
+    void on_downloaded(uint64_t id, uint64_t bytes) {
+        auto it = peers.find(id);
+        if (it != peers.end()) {
+            it->second.download.add(bytes);
+        }
+    }
+
+    // bytes we sent to the peer
+    void on_uploaded(uint64_t id, uint64_t bytes) {
+        auto it = peers.find(id);
+        if (it != peers.end()) {
+            it->second.upload.add(bytes);
+        }
+    }
+
+    // once we have every piece, rank by our upload rate instead of their upload to us
+    void set_seeding(bool value) { seeding = value; }
+
+    bool is_choked(uint64_t id) const {
+        auto it = peers.find(id);
+        return it == peers.end() || it->second.choked;
+    }
+
+    size_t peer_count() const { return peers.size(); }
+
+    // the peer holding the optimistic slot, if any
+    std::optional<uint64_t> optimistic() const {
+        return has_optimistic ? std::optional<uint64_t>(optimistic_peer) : std::nullopt;
+    }
+
+    // Run the choker. Returns the state changes the caller has to send,
+    // or nothing if no round is due yet.
+    std::vector<ChokeDecision> tick(Clock::time_point now) {
+        std::vector<ChokeDecision> decisions;
+        if (last_regular != Clock::time_point{} && now - last_regular < REGULAR_INTERVAL) {
+            return decisions;
+        }
+        last_regular = now;
+
+        for (auto& [id, peer] : peers) {
+            peer.download.sample(now);
+            peer.upload.sample(now);
+        }
+
+        if (!has_optimistic || now - last_optimistic >= OPTIMISTIC_INTERVAL) {
+            rotate_optimistic(now);
+        }
+
+        // rank everyone by the rate that matters in the current mode
+        std::vector<uint64_t> ranked;
+        ranked.reserve(peers.size());
+        for (const auto& [id, peer] : peers) {
+            if (!(has_optimistic && id == optimistic_peer)) {
+                ranked.push_back(id);
+            }
+        }
+        std::sort(ranked.begin(), ranked.end(), [this](uint64_t a, uint64_t b) {
+            return rank_rate(peers.at(a)) > rank_rate(peers.at(b));
+        });
+
+        // Unchoke the best interested peers. Uninterested peers that rank above the
+        // last unchoked downloader are unchoked too, so they can start right away
+        // if they become interested.
+        size_t regular_slots = has_optimistic ? unchoke_slots - 1 : unchoke_slots;
+        size_t downloaders = 0;
+        for (uint64_t id : ranked) {
+            ChokerPeer& peer = peers.at(id);
+            bool unchoke = downloaders < regular_slots;
+            if (unchoke && peer.interested) {
+                ++downloaders;
+            }
+            set_choked(id, peer, !unchoke, decisions);
+        }
+
+        if (has_optimistic) {
+            set_choked(optimistic_peer, peers.at(optimistic_peer), false, decisions);
+        }
+        return decisions;
+    }
+
+private:
+    struct ChokerPeer {
+        bool interested = false;
+        bool choked = true;
+        RateMeter download;
+        RateMeter upload;
+        Clock::time_point connected_at{};
+    };
+
+    double rank_rate(const ChokerPeer& peer) const {
+        return seeding ? peer.upload.rate() : peer.download.rate();
+    }
+
+    void set_choked(uint64_t id, ChokerPeer& peer, bool choke, std::vector<ChokeDecision>& decisions) {
+        if (peer.choked != choke) {
+            peer.choked = choke;
+            decisions.push_back({id, choke});
+        }
+    }
+
+    void rotate_optimistic(Clock::time_point now) {
+        last_optimistic = now;
+        has_optimistic = false;
+
+        // candidates are interested peers we are choking, new peers weighted 3x
+        std::vector<uint64_t> candidates;
+        for (const auto& [id, peer] : peers) {
+            if (!peer.interested || !peer.choked) {
+                continue;
+            }
+            int weight = (now - peer.connected_at < NEW_PEER_WINDOW) ? 3 : 1;
+            candidates.insert(candidates.end(), weight, id);
+        }
+        if (candidates.empty()) {
+            return;
+        }
+        std::uniform_int_distribution<size_t> dis(0, candidates.size() - 1);
+        optimistic_peer = candidates[dis(rng)];
+        has_optimistic = true;
+    }
+
+    size_t unchoke_slots;
+    bool seeding = false;
+    std::unordered_map<uint64_t, ChokerPeer> peers;
+    uint64_t optimistic_peer = 0;
+    bool has_optimistic = false;
+    Clock::time_point last_regular{};
+    Clock::time_point last_optimistic{};
+    std::mt19937 rng;
+};
+
+#endif
@@ -0,0 +1,394 @@
+#ifndef CONNECTION_HPP
+#define CONNECTION_HPP
+
+// this file contains PeerConnection, a handshaked connection to a peer that stays
+// open across pieces and takes care of extension messages (metadata, PEX) on the side
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <set>
+#include <string>
+#include <vector>
+#include "extension.hpp"
+#include "peers.hpp"
+#include "pex.hpp"
+#include "piece_state.hpp"
+#include "rate_limit.hpp"
+
+// How many block requests to keep outstanding with one peer. The peer's delivery rate
+// is sampled over short windows and the queue holds rate * TARGET_QUEUE_TIME worth of
+// blocks, at least two round trips' worth so a far away peer's pipe stays full. The
+// round trip is the minimum seen lately: queueing at the peer inflates the rest, and
+// deeper queues would then make for ever deeper ones. A fast peer grows its queue in a
+// few windows, a slow one keeps few requests waiting on it.
+class RequestQueue {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t INITIAL_DEPTH = 5;
+    static constexpr size_t MAX_DEPTH = 250;
+    static constexpr int64_t BLOCK_SIZE = 16 * 1024;
+    // how long a request may wait in the peer's queue
+    static constexpr std::chrono::milliseconds TARGET_QUEUE_TIME{1000};
+    // a peer with requests outstanding and no block for this long is snubbing us
+    static constexpr std::chrono::seconds SNUB_TIMEOUT{60};
+
+    size_t depth() const { return std::min(current_depth, peer_limit); }
+
+    // the most requests the peer said it queues (reqq in its extended handshake)
+    void set_peer_limit(size_t limit) { peer_limit = std::clamp<size_t>(limit, 1, MAX_DEPTH); }
+
+    // a block requested round_trip ago arrived
+    void block_received(int64_t bytes, Clock::duration round_trip, Clock::time_point now) {
+        if (now - min_rtt_stamp > MIN_RTT_WINDOW || round_trip < min_rtt) {
+            min_rtt = round_trip;
+            min_rtt_stamp = now;
+        }
+        if (!window_open) {
+            // the first window opened when its first block was asked for
+            window_start = now - round_trip;
+            window_open = true;
+        }
+        window_bytes += bytes;
+        auto elapsed = now - window_start;
+        if (elapsed < RATE_WINDOW) {
+            return;
+        }
+        double sample = static_cast<double>(window_bytes) / std::chrono::duration<double>(elapsed).count();
+        rate = rate == 0 ? sample : rate * 0.75 + sample * 0.25;
+        window_start = now;
+        window_bytes = 0;
+        snubbed = false;
+        resize();
+    }
+
+    // no data for SNUB_TIMEOUT, down to one request until the peer delivers again
+    void snub() {
+        snubbed = true;
+        rate = 0;
+        window_open = false;
+        window_bytes = 0;
+        current_depth = 1;
+    }
+
+    bool is_snubbed() const { return snubbed; }
+    // bytes per second, 0 until the first window closes
+    double delivery_rate() const { return rate; }
+
+private:
+    static constexpr std::chrono::milliseconds RATE_WINDOW{500};
+    static constexpr std::chrono::seconds MIN_RTT_WINDOW{10};
+
+    void resize() {
+        double horizon = std::max(std::chrono::duration<double>(TARGET_QUEUE_TIME).count(),
+                                  2 * std::chrono::duration<double>(min_rtt).count());
+        double blocks = std::ceil(rate * horizon / BLOCK_SIZE);
+        current_depth = static_cast<size_t>(std::clamp(blocks, 2.0, static_cast<double>(MAX_DEPTH)));
+    }
+
+    size_t current_depth = INITIAL_DEPTH;
+    size_t peer_limit = MAX_DEPTH;
+    double rate = 0;
+    bool window_open = false;
+    int64_t window_bytes = 0;
+    Clock::time_point window_start;
+    Clock::duration min_rtt = Clock::duration::max();
+    Clock::time_point min_rtt_stamp;
+    bool snubbed = false;
+};
+
+class PeerConnection {
+public:
+    // connect, handshake and announce our extensions; peers learned over PEX go to pool
+    PeerConnection(const PeerAddress& peer, const std::vector<uint8_t>& info_hash, PeerPool* pool = nullptr)
+        : PeerConnection(connect_to_peer(peer.ip, peer.port), peer, info_hash, pool) {}
+
+    // the same over a socket already connected to peer, which the connection takes over
+    PeerConnection(socket_t connected, const PeerAddress& peer, const std::vector<uint8_t>& info_hash,
+                   PeerPool* pool = nullptr)
+        : sock(connected), peer_address(peer), peer_pool(pool), peer_class(classify_peer(peer.ip)),
+          bytes_downloaded(metrics().counter("bittorrent_peer_downloaded_bytes_total",
+                                             "Bytes received from a peer", {{"peer", peer_key(peer)}})),
+          bytes_uploaded(metrics().counter("bittorrent_peer_uploaded_bytes_total",
+                                           "Bytes sent to a peer", {{"peer", peer_key(peer)}})),
+          queue_depth(metrics().gauge("bittorrent_peer_request_queue_depth",
+                                      "Block requests we allow outstanding with a peer", {{"peer", peer_key(peer)}})) {
+        // 30 seconds to answer the handshake, the receive timeout is raised once it did
+        set_socket_timeout(sock, 30);
+        try {
+            handshake = exchange_handshake(sock, info_hash);
+        } catch (...) {
+            release_metrics();
+            throw;
+        }
+        bytes_uploaded.add(68);
+        bytes_downloaded.add(68);
+        if (handshake.supports_extensions()) {
+            try {
+                bytes_uploaded.add(send_extended_handshake(sock));
+            } catch (...) {
+                CLOSE_SOCKET(sock);
+                release_metrics();
+                throw;
+            }
+        }
+        if (peer_pool) {
+            peer_pool->mark_connected(peer_address, true);
+        }
+        queue_depth.set(static_cast<int64_t>(requests.depth()));
+        // Once connected a peer may go quiet for a while, keep-alives come every two minutes.
+        // Waiting longer than SNUB_TIMEOUT lets the download loop tell a stalled peer apart.
+        set_socket_timeout(sock, static_cast<int>((RequestQueue::SNUB_TIMEOUT + RECEIVE_TIMEOUT_MARGIN).count()));
+    }
+
+    ~PeerConnection() {
+        track_availability(nullptr);
+        if (peer_pool) {
+            // how it did this time ranks it next time, a peer that stalled counts as slow
+            if (requests.delivery_rate() > 0 || requests.is_snubbed()) {
+                peer_pool->record_throughput(peer_address, static_cast<int64_t>(requests.delivery_rate()));
+            }
+            peer_pool->mark_connected(peer_address, false);
+        }
+        CLOSE_SOCKET(sock);
+        release_metrics();
+    }
+
+    PeerConnection(const PeerConnection&) = delete;
+    PeerConnection& operator=(const PeerConnection&) = delete;
+
+    // how much longer than SNUB_TIMEOUT a receive may wait
+    static constexpr std::chrono::seconds RECEIVE_TIMEOUT_MARGIN{30};
+
+    socket_t socket() const { return sock; }
+    const PeerAddress& address() const { return peer_address; }
+
+    bool supports_fast() const { return handshake.supports_fast(); }
+    bool supports_v2() const { return handshake.supports_v2(); }
+
+    // Read the next message. Extension messages are handled here and never returned;
+    // choke state and piece availability are updated before the message is returned.
+    PeerMessage read_message() {
+        while (true) {
+            PeerMessage msg = read_peer_message(sock);
+            bytes_downloaded.add(4 + msg.length);
+            if (msg.id == EXTENDED_MESSAGE_ID) {
+                handle_extended_message(msg);
+                continue;
+            }
+            update_state(msg);
+            return msg;
+        }
+    }
+
+    // Send a message to the peer once the upload limits allow it, counted in its upload metrics
+    void send_message(uint8_t id, const uint8_t* payload = nullptr, size_t payload_length = 0) {
+        rate_limiter().acquire(Direction::Upload, static_cast<int64_t>(5 + payload_length), peer_class, limits);
+        send_peer_message(sock, id, payload, payload_length);
+        bytes_uploaded.add(5 + payload_length);
+    }
+
+    // false only if the peer told us it doesn't have the piece
+    bool may_have_piece(int piece_index) const {
+        return may_have_all() || peer_pieces.test(piece_index);
+    }
+
+    // the peer sent have_all, or nothing yet so we optimistically assume it's a seed
+    bool may_have_all() const { return peer_has_all || !availability_known; }
+
+    // LAN or WAN, picks the peer class rate limits that apply
+    PeerClass rate_class() const { return peer_class; }
+
+    // the torrent's own rate limits, on top of the shared ones; nullptr for none
+    RateLimitBuckets* rate_limits() const { return limits; }
+    void set_rate_limits(RateLimitBuckets* torrent_limits) { limits = torrent_limits; }
+
+    // sizes the pipeline of block requests to this peer
+    RequestQueue& request_queue() { return requests; }
+
+    // Function to collapse the request queue of a peer that stopped sending data
+    void snub() {
+        requests.snub();
+        queue_depth.set(static_cast<int64_t>(requests.depth()));
+    }
+
+    // Function to note a block arrived round_trip after it was requested
+    void block_received(int64_t bytes, RequestQueue::Clock::duration round_trip) {
+        requests.block_received(bytes, round_trip, RequestQueue::Clock::now());
+        queue_depth.set(static_cast<int64_t>(requests.depth()));
+    }
+
+    // the peer sent a bitfield, have_all/have_none or a have
+    bool knows_availability() const { return availability_known; }
+
+    // pieces the peer announced with bitfield and have messages
+    const Bitset& pieces() const { return peer_pieces; }
+
+    // Count what this peer has in state's availability until the connection closes
+    // or another state is given. nullptr stops tracking.
+    void track_availability(PieceState* state) {
+        if (piece_state) {
+            piece_state->remove_availability(peer_pieces);
+            if (peer_has_all) {
+                piece_state->remove_seed();
+            }
+        }
+        piece_state = state;
+        if (piece_state) {
+            piece_state->add_availability(peer_pieces);
+            if (peer_has_all) {
+                piece_state->add_seed();
+            }
+        }
+    }
+
+    // requests for this piece are served even while we are choked
+    bool is_allowed_fast(int piece_index) const {
+        return allowed_fast.count(piece_index) != 0;
+    }
+
+    // the peer rejected a request for an allowed fast piece, it has taken the piece back
+    void revoke_allowed_fast(int piece_index) { allowed_fast.erase(piece_index); }
+
+    // gossip the peers we can reach if the last ut_pex message is a minute old
+    void send_pex_if_due() {
+        uint8_t pex_id = extensions.id_for("ut_pex");
+        auto now = std::chrono::steady_clock::now();
+        if (!peer_pool || pex_id == 0 || !pex.due(now)) {
+            return;
+        }
+        PexMessage message;
+        if (pex.next_message(peer_pool->reachable_peers(), peer_address, now, message)) {
+            bytes_uploaded.add(send_extended_message(sock, pex_id, encode_pex_message(message)));
+        }
+    }
+
+    // the peer is choking us
+    bool peer_choking = true;
+    // we told the peer we are interested
+    bool am_interested = false;
+    // pieces the peer suggested with suggest_piece, most recent last
+    std::vector<int> suggested_pieces;
+
+private:
+    void update_state(const PeerMessage& msg) {
+        switch (msg.id) {
+        case MSG_CHOKE:
+            peer_choking = true;
+            break;
+        case MSG_UNCHOKE:
+            peer_choking = false;
+            break;
+        case MSG_BITFIELD: {
+            PieceState* state = piece_state;
+            track_availability(nullptr);
+            peer_pieces = Bitset::from_bytes(msg.payload.data(), msg.payload.size());
+            peer_has_all = false;
+            availability_known = true;
+            track_availability(state);
+            break;
+        }
+        case MSG_HAVE:
+            if (msg.payload.size() == 4) {
+                set_have(read_uint32(msg.payload, 0));
+            }
+            break;
+        case MSG_HAVE_ALL:
+        case MSG_HAVE_NONE: {
+            PieceState* state = piece_state;
+            track_availability(nullptr);
+            peer_pieces = Bitset();
+            peer_has_all = msg.id == MSG_HAVE_ALL;
+            availability_known = true;
+            track_availability(state);
+            break;
+        }
+        case MSG_ALLOWED_FAST:
+            if (msg.payload.size() == 4) {
+                allowed_fast.insert(static_cast<int>(read_uint32(msg.payload, 0)));
+            }
+            break;
+        case MSG_SUGGEST_PIECE:
+            if (msg.payload.size() == 4) {
+                suggested_pieces.push_back(static_cast<int>(read_uint32(msg.payload, 0)));
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    void set_have(uint32_t piece_index) {
+        // a seed is counted with add_seed, its pieces stay empty so nothing is counted twice
+        if (peer_has_all) {
+            return;
+        }
+        if (piece_index >= peer_pieces.size()) {
+            peer_pieces.resize(piece_index + 1);
+        }
+        if (!peer_pieces.test(piece_index)) {
+            peer_pieces.set(piece_index);
+            if (piece_state) {
+                piece_state->add_availability(piece_index);
+            }
+        }
+        // a have without a bitfield means the peer started with nothing
+        availability_known = true;
+    }
+
+    void handle_extended_message(const PeerMessage& msg) {
+        if (msg.payload.empty()) {
+            return;
+        }
+        try {
+            if (msg.payload[0] == EXTENDED_HANDSHAKE_ID) {
+                extensions = parse_extended_handshake(msg.payload);
+                if (extensions.request_queue_limit > 0) {
+                    requests.set_peer_limit(static_cast<size_t>(extensions.request_queue_limit));
+                }
+                // the peer's address in the other IP family, raced against this one next time
+                bool over_v6 = peer_address.ip.find(':') != std::string::npos;
+                const std::string& other = over_v6 ? extensions.ipv4 : extensions.ipv6;
+                if (peer_pool && !other.empty()) {
+                    uint16_t port = extensions.listen_port ? extensions.listen_port : peer_address.port;
+                    peer_pool->add_alternate(peer_address, {other, port});
+                }
+            } else if (msg.payload[0] == UT_PEX_ID && peer_pool) {
+                PexMessage message = parse_pex_message(std::string(msg.payload.begin() + 1, msg.payload.end()));
+                peer_pool->add(message.added, PeerSource::Pex);
+            }
+        } catch (const std::exception&) {
+            // a broken extension message is not worth dropping the connection over
+        }
+    }
+
+    // Function to drop this peer's metric series, they would otherwise pile up for every peer ever seen
+    void release_metrics() {
+        MetricLabels labels{{"peer", peer_key(peer_address)}};
+        metrics().release("bittorrent_peer_downloaded_bytes_total", labels);
+        metrics().release("bittorrent_peer_uploaded_bytes_total", labels);
+        metrics().release("bittorrent_peer_request_queue_depth", labels);
+    }
+
+    WSAInitializer wsa;
+    socket_t sock;
+    PeerAddress peer_address;
+    PeerPool* peer_pool;
+    PeerClass peer_class;
+    RateLimitBuckets* limits = nullptr;
+    Counter& bytes_downloaded;
+    Counter& bytes_uploaded;
+    Gauge& queue_depth;
+    RequestQueue requests;
+    HandshakeResult handshake;
+    ExtendedHandshake extensions;
+    PexState pex;
+    Bitset peer_pieces;
+    PieceState* piece_state = nullptr;
+    bool peer_has_all = false;
+    bool availability_known = false;
+    std::set<int> allowed_fast;
+};
+
+#endif
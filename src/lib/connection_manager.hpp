@@ -0,0 +1,258 @@
+#ifndef CONNECTION_MANAGER_HPP
+#define CONNECTION_MANAGER_HPP
+
+// this file contains the connection manager: non-blocking connects to many candidate peers
+// at once, each given a timeout, with a few connected sockets kept on standby so a peer that
+// goes away is replaced without waiting. A peer known by an IPv4 and an IPv6 address has
+// both raced, the second started HAPPY_EYEBALLS_DELAY after the first (RFC 8305)
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "connection.hpp"
+#include "peers.hpp"
+
+struct ConnectionSettings {
+    // connects in progress at once
+    size_t half_open_limit = 8;
+    // connected sockets kept ready besides the connection in use
+    size_t standby = 2;
+    std::chrono::milliseconds connect_timeout = CONNECT_TIMEOUT;
+};
+
+class ConnectionManager {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr std::chrono::milliseconds HAPPY_EYEBALLS_DELAY{250};
+    // peers drop connections that never handshake, so standby sockets are closed after a while.
+    // They aren't replaced until a connection is taken, or the same peers would be dialled again
+    // every STANDBY_MAX_AGE for as long as the connection in use lasts
+    static constexpr std::chrono::seconds STANDBY_MAX_AGE{20};
+
+    ConnectionManager(PeerPool& peer_pool, const std::vector<uint8_t>& info_hash,
+                      const ConnectionSettings& settings = {})
+        : pool(peer_pool), info_hash(info_hash), settings(settings) {}
+
+    ~ConnectionManager() {
+        for (Attempt& attempt : attempts) {
+            close_sockets(attempt);
+            pool.release(attempt.peer);
+        }
+        for (const Ready& ready : standby) {
+            CLOSE_SOCKET(ready.sock);
+            pool.release(ready.peer);
+        }
+    }
+
+    ConnectionManager(const ConnectionManager&) = delete;
+    ConnectionManager& operator=(const ConnectionManager&) = delete;
+
+    // Function to start connects to top up the standby set, once since the last connection was
+    // taken, and collect finished ones, without waiting
+    void maintain() { step(Clock::duration::zero()); }
+
+    // Function to get a handshaked connection to the best peer that answers, waiting for
+    // connects in progress when none is on standby. Throws once every candidate failed.
+    std::unique_ptr<PeerConnection> next_connection() {
+        refill = true;
+        while (true) {
+            step(Clock::duration::zero());
+            if (standby.empty()) {
+                if (attempts.empty()) {
+                    throw std::runtime_error("No more peers to connect to");
+                }
+                step(WAIT_SLICE);
+                continue;
+            }
+            Ready ready = standby.front();
+            standby.pop_front();
+            if (pool.is_banned(ready.peer)) {
+                CLOSE_SOCKET(ready.sock);
+                pool.release(ready.peer);
+                continue;
+            }
+            try {
+                return std::make_unique<PeerConnection>(ready.sock, ready.peer, info_hash, &pool);
+            } catch (const std::exception& e) {
+                std::cerr << "\nFailed to connect to " << peer_key(ready.peer) << ": " << e.what() << std::endl;
+                pool.mark_failed(ready.peer);
+            }
+        }
+    }
+
+    size_t half_open() const {
+        size_t count = 0;
+        for (const Attempt& attempt : attempts) {
+            for (socket_t sock : attempt.sockets) {
+                count += sock != INVALID_SOCKET_VALUE;
+            }
+        }
+        return count;
+    }
+
+    size_t ready() const { return standby.size(); }
+
+private:
+    static constexpr std::chrono::milliseconds WAIT_SLICE{50};
+
+    // one peer being connected to, over one or two addresses
+    struct Attempt {
+        PeerAddress peer;                   // as the pool knows it
+        std::vector<PeerAddress> addresses; // raced in this order
+        std::vector<socket_t> sockets;      // one per started address, invalid once it failed
+        Clock::time_point started;
+        Clock::time_point next_start;       // when the next address joins the race
+        bool connected = false;
+    };
+
+    struct Ready {
+        PeerAddress peer;
+        socket_t sock;
+        Clock::time_point since;
+    };
+
+    static void close_sockets(Attempt& attempt) {
+        for (socket_t& sock : attempt.sockets) {
+            if (sock != INVALID_SOCKET_VALUE) {
+                CLOSE_SOCKET(sock);
+                sock = INVALID_SOCKET_VALUE;
+            }
+        }
+    }
+
+    static bool all_failed(const Attempt& attempt) {
+        for (socket_t sock : attempt.sockets) {
+            if (sock != INVALID_SOCKET_VALUE) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void start_next_address(Attempt& attempt, Clock::time_point now) {
+        const PeerAddress& address = attempt.addresses[attempt.sockets.size()];
+        try {
+            attempt.sockets.push_back(start_connect(address.ip, address.port));
+        } catch (const std::exception&) {
+            attempt.sockets.push_back(INVALID_SOCKET_VALUE);
+        }
+        attempt.next_start = now + HAPPY_EYEBALLS_DELAY;
+    }
+
+    // Start connects while the standby set is short and the half-open limit allows. With dead
+    // peers about that is many at once; with live ones a few more connect than needed, the
+    // extra sockets wait on standby until they age out. Once the set is full it is left to
+    // age out until next_connection takes from it again.
+    void start_attempts(Clock::time_point now) {
+        size_t target = std::max<size_t>(settings.standby, 1);
+        if (standby.size() >= target) {
+            refill = false;
+        }
+        if (!refill) {
+            return;
+        }
+        size_t in_progress = half_open();
+        while (standby.size() < target && in_progress < settings.half_open_limit) {
+            std::vector<PeerAddress> candidates = pool.take_candidates(1);
+            if (candidates.empty()) {
+                return;
+            }
+            Attempt attempt{candidates[0], pool.addresses(candidates[0]), {}, now, now};
+            start_next_address(attempt, now);
+            in_progress += attempt.sockets.back() != INVALID_SOCKET_VALUE;
+            attempts.push_back(std::move(attempt));
+        }
+    }
+
+    // start due addresses, wait up to wait for connects to finish and sort out the results
+    void step(Clock::duration wait) {
+        Clock::time_point now = Clock::now();
+        while (!standby.empty() && now - standby.front().since > STANDBY_MAX_AGE) {
+            CLOSE_SOCKET(standby.front().sock);
+            pool.release(standby.front().peer);
+            standby.pop_front();
+        }
+        start_attempts(now);
+
+        std::vector<pollfd> fds;
+        std::vector<std::pair<size_t, size_t>> owners; // attempt and address of each entry in fds
+        for (size_t i = 0; i < attempts.size(); ++i) {
+            Attempt& attempt = attempts[i];
+            // the next address joins once its delay is up, or straight away when the others failed
+            if (!attempt.connected && attempt.sockets.size() < attempt.addresses.size() &&
+                (now >= attempt.next_start || all_failed(attempt))) {
+                start_next_address(attempt, now);
+            }
+            for (size_t j = 0; j < attempt.sockets.size(); ++j) {
+                if (attempt.sockets[j] != INVALID_SOCKET_VALUE) {
+                    fds.push_back({attempt.sockets[j], POLLOUT, 0});
+                    owners.emplace_back(i, j);
+                }
+            }
+        }
+        if (!fds.empty()) {
+            int timeout_ms = static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(wait).count());
+            int ready_count = POLL_SOCKETS(fds.data(), static_cast<unsigned long>(fds.size()), timeout_ms);
+            now = Clock::now();
+            if (ready_count > 0) {
+                for (size_t k = 0; k < fds.size(); ++k) {
+                    if (fds[k].revents == 0) {
+                        continue;
+                    }
+                    Attempt& attempt = attempts[owners[k].first];
+                    socket_t& sock = attempt.sockets[owners[k].second];
+                    if (sock == INVALID_SOCKET_VALUE) {
+                        continue; // another address of this peer won already
+                    }
+                    if (finish_connect(sock)) {
+                        // first one through wins, the other address is dropped
+                        standby.push_back({attempt.peer, sock, now});
+                        sock = INVALID_SOCKET_VALUE;
+                        close_sockets(attempt);
+                        attempt.connected = true;
+                        // it finished after the last poll that saw it pending, which may have been a
+                        // whole piece ago, so take the middle of that stretch rather than all of it
+                        Clock::time_point after = std::max(last_poll, attempt.started);
+                        pool.connect_succeeded(attempt.peer, after + (now - after) / 2 - attempt.started);
+                    } else {
+                        CLOSE_SOCKET(sock);
+                        sock = INVALID_SOCKET_VALUE;
+                    }
+                }
+            }
+            last_poll = now;
+        }
+
+        // attempts that are decided: connected, failed on every address or out of time
+        now = Clock::now();
+        std::deque<Attempt> undecided;
+        for (Attempt& attempt : attempts) {
+            if (attempt.connected) {
+                continue;
+            }
+            bool exhausted = all_failed(attempt) && attempt.sockets.size() == attempt.addresses.size();
+            if (exhausted || now - attempt.started > settings.connect_timeout) {
+                close_sockets(attempt);
+                pool.mark_failed(attempt.peer);
+                continue;
+            }
+            undecided.push_back(std::move(attempt));
+        }
+        attempts.swap(undecided);
+    }
+
+    PeerPool& pool;
+    std::vector<uint8_t> info_hash;
+    ConnectionSettings settings;
+    std::deque<Attempt> attempts;
+    std::deque<Ready> standby; // oldest first
+    bool refill = true;        // standby hasn't been full since a connection was taken
+    Clock::time_point last_poll;
+};
+
+#endif
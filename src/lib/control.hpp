@@ -0,0 +1,321 @@
+#ifndef CONTROL_HPP
+#define CONTROL_HPP
+
+// this file contains the daemon's control interface: JSON requests, one per line, over a
+// Unix domain socket, answered with one JSON line each. A client may send many requests
+// on one connection, which is how batches of torrents are submitted.
+//
+//   {"command": "add", "source": "/abs/path/file.torrent", "output": "default"}
+//   {"command": "add", "torrents": [{"source": "magnet:?xt=..."}, {"source": "/abs/b.torrent"}]}
+//   {"command": "pause", "id": 1}     also "resume" and "remove"
+//   {"command": "status"}
+//   {"command": "shutdown"}
+//
+// Answers carry "ok" and, when it is false, "error". An add is answered once the torrent
+// is queued; a magnet link shows as "fetching" in status until its metadata arrived.
+
+#include <functional>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include "magnet.hpp"
+#include "reactor.hpp"
+#include "session.hpp"
+#include "nlohmann/json.hpp"
+
+#ifndef _WIN32
+    #include <sys/stat.h>
+    #include <sys/un.h>
+#endif
+
+using json = nlohmann::json;
+
+// Function to add one torrent described by an add request, returns its id
+inline TorrentId add_control_torrent(Session& session, const json& request) {
+    if (!request.contains("source")) {
+        throw std::runtime_error("add needs a source");
+    }
+    StorageOptions options;
+    RateLimits limits;
+    if (request.value("sparse", false)) {
+        options.allocation = AllocationMode::Sparse;
+    }
+    options.direct_io = request.value("direct", false);
+    if (request.contains("download_limit")) {
+        limits.download = parse_rate(request["download_limit"].get<std::string>());
+    }
+    if (request.contains("upload_limit")) {
+        limits.upload = parse_rate(request["upload_limit"].get<std::string>());
+    }
+    std::optional<std::vector<size_t>> files;
+    if (request.contains("files")) {
+        files = request["files"].get<std::vector<size_t>>();
+    }
+    std::string source = request["source"].get<std::string>();
+    std::string output = request.value("output", std::string("default"));
+    if (source.compare(0, 7, "magnet:") == 0) {
+        // fetching the metadata can take minutes, a session worker does it and not this thread
+        return session.add_magnet(source, output, options, limits, files);
+    }
+    std::string encoded_value = read_file(source);
+    if (files) {
+        select_files(options, parse_torrent(encoded_value).info.files.size(), *files);
+    }
+    return session.add(encoded_value, output, options, limits);
+}
+
+inline json torrent_status_json(const TorrentStatus& status) {
+    json torrent = {{"id", status.id},
+                    {"name", status.name},
+                    {"info_hash", status.info_hash},
+                    {"output", status.output_path},
+                    {"state", torrent_state_name(status.state)},
+                    {"downloaded", status.downloaded},
+                    {"wanted", status.wanted}};
+    if (!status.error.empty()) {
+        torrent["error"] = status.error;
+    }
+    return torrent;
+}
+
+// Function to carry out one control request. Failures are answered, not thrown.
+inline json handle_control_request(Session& session, const json& request) {
+    try {
+        std::string command = request.at("command").get<std::string>();
+        if (command == "add") {
+            if (!request.contains("torrents")) {
+                return {{"ok", true}, {"id", add_control_torrent(session, request)}};
+            }
+            // one answer for the whole batch, with the id or the error of each torrent in order
+            json results = json::array();
+            for (const json& torrent : request["torrents"]) {
+                try {
+                    results.push_back({{"ok", true}, {"id", add_control_torrent(session, torrent)}});
+                } catch (const std::exception& e) {
+                    results.push_back({{"ok", false}, {"error", e.what()}});
+                }
+            }
+            return {{"ok", true}, {"results", results}};
+        }
+        if (command == "pause" || command == "resume" || command == "remove") {
+            TorrentId id = request.at("id").get<TorrentId>();
+            if (command == "pause") {
+                session.pause(id);
+            } else if (command == "resume") {
+                session.resume(id);
+            } else {
+                session.remove(id);
+            }
+            return {{"ok", true}};
+        }
+        if (command == "status") {
+            json torrents = json::array();
+            for (const TorrentStatus& status : session.status()) {
+                torrents.push_back(torrent_status_json(status));
+            }
+            return {{"ok", true}, {"torrents", torrents}};
+        }
+        throw std::runtime_error("Unknown command: " + command);
+    } catch (const std::exception& e) {
+        return {{"ok", false}, {"error", e.what()}};
+    }
+}
+
+// Function to render an answer as one line; torrent names need not be valid UTF-8
+inline std::string control_line(const json& message) {
+    return message.dump(-1, ' ', false, json::error_handler_t::replace) + "\n";
+}
+
+// Serves control requests for a session on a Unix domain socket, on the thread calling run()
+class ControlServer {
+public:
+    ControlServer(const std::string& socket_path, Session& session) : path(socket_path), session(session) {
+#ifdef _WIN32
+        throw std::runtime_error("The control socket needs Unix domain sockets");
+#else
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) {
+            throw std::runtime_error("Control socket path is too long: " + path);
+        }
+        path.copy(addr.sun_path, path.size());
+        listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listener == INVALID_SOCKET_VALUE) {
+            throw std::runtime_error("Failed to create socket");
+        }
+        // a socket file left behind by a daemon that didn't shut down cleanly; anything
+        // else at the path, or the socket of a daemon still running, is left alone
+        struct stat st{};
+        if (lstat(path.c_str(), &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) {
+                CLOSE_SOCKET(listener);
+                throw std::runtime_error(path + " exists and is not a socket");
+            }
+            socket_t probe = socket(AF_UNIX, SOCK_STREAM, 0);
+            bool listening = probe != INVALID_SOCKET_VALUE &&
+                             connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+            if (probe != INVALID_SOCKET_VALUE) {
+                CLOSE_SOCKET(probe);
+            }
+            if (listening) {
+                CLOSE_SOCKET(listener);
+                throw std::runtime_error("A daemon is already listening on " + path);
+            }
+            unlink(path.c_str());
+        }
+        // Whoever can connect controls the session, so the socket is created owner only
+        // rather than chmod'ed after bind. The umask is process wide, but torrents are only
+        // added through this socket, so no download is creating files yet.
+        mode_t old_umask = umask(0177);
+        int bound = bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        umask(old_umask);
+        if (bound == SOCKET_ERROR_VALUE || listen(listener, 16) == SOCKET_ERROR_VALUE) {
+            CLOSE_SOCKET(listener);
+            throw std::runtime_error("Failed to listen on " + path);
+        }
+        reactor.add_reader(listener, [this] { accept_client(); });
+#endif
+    }
+
+    ~ControlServer() {
+        for (const auto& [client, pending] : clients) {
+            CLOSE_SOCKET(client);
+        }
+        CLOSE_SOCKET(listener);
+#ifndef _WIN32
+        unlink(path.c_str());
+#endif
+    }
+
+    ControlServer(const ControlServer&) = delete;
+    ControlServer& operator=(const ControlServer&) = delete;
+
+    // Function to answer requests until a shutdown request comes in
+    void run() {
+        while (!shutting_down) {
+            reactor.run_once(std::chrono::seconds(1));
+        }
+    }
+
+private:
+    void accept_client() {
+        socket_t client = accept(listener, nullptr, nullptr);
+        if (client == INVALID_SOCKET_VALUE) {
+            return;
+        }
+        // answers are written whole on the reactor thread, so a client that stops reading
+        // holds up every other client until the send times out, then it is dropped
+        set_socket_timeout(client, 5);
+        set_socket_send_timeout(client, 5);
+        clients[client] = "";
+        reactor.add_reader(client, [this, client] { read_client(client); });
+    }
+
+    void drop_client(socket_t client) {
+        reactor.remove_reader(client);
+        clients.erase(client);
+        CLOSE_SOCKET(client);
+    }
+
+    // one recv per wakeup, so it never blocks; answers every complete line received
+    void read_client(socket_t client) {
+        char buffer[4096];
+        auto received = recv(client, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            drop_client(client);
+            return;
+        }
+        std::string& pending = clients[client];
+        pending.append(buffer, static_cast<size_t>(received));
+        size_t newline;
+        while ((newline = pending.find('\n')) != std::string::npos) {
+            std::string line = pending.substr(0, newline);
+            pending.erase(0, newline + 1);
+            if (line.find_first_not_of(" \t\r") == std::string::npos) {
+                continue;
+            }
+            std::string answer = control_line(answer_line(line));
+            if (!send_all(client, reinterpret_cast<const uint8_t*>(answer.data()), answer.size())) {
+                drop_client(client);
+                return;
+            }
+        }
+        if (pending.size() > MAX_REQUEST_SIZE) {
+            drop_client(client);
+        }
+    }
+
+    json answer_line(const std::string& line) {
+        json request = json::parse(line, nullptr, false);
+        if (request.is_discarded() || !request.is_object()) {
+            return {{"ok", false}, {"error", "Requests are JSON objects, one per line"}};
+        }
+        if (request.value("command", std::string()) == "shutdown") {
+            shutting_down = true;
+            return {{"ok", true}};
+        }
+        return handle_control_request(session, request);
+    }
+
+    static constexpr size_t MAX_REQUEST_SIZE = 1 << 20;
+
+    std::string path;
+    Session& session;
+    Reactor reactor;
+    socket_t listener = INVALID_SOCKET_VALUE;
+    std::map<socket_t, std::string> clients; // unanswered partial lines
+    bool shutting_down = false;
+};
+
+// Function to send requests to a daemon and print its answers, false if any failed
+inline bool send_control_requests(const std::string& socket_path, const std::vector<std::string>& requests) {
+#ifdef _WIN32
+    throw std::runtime_error("The control socket needs Unix domain sockets");
+#else
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("Control socket path is too long: " + socket_path);
+    }
+    socket_path.copy(addr.sun_path, socket_path.size());
+    socket_t sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET_VALUE) {
+        throw std::runtime_error("Failed to create socket");
+    }
+    if (connect(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR_VALUE) {
+        CLOSE_SOCKET(sock);
+        throw std::runtime_error("Failed to connect to daemon at " + socket_path);
+    }
+    // every request is answered without waiting on the network, magnet links included
+    set_socket_timeout(sock, 30);
+    bool all_ok = true;
+    std::string received;
+    for (const std::string& request : requests) {
+        std::string line = request + "\n";
+        if (!send_all(sock, reinterpret_cast<const uint8_t*>(line.data()), line.size())) {
+            CLOSE_SOCKET(sock);
+            throw std::runtime_error("Failed to send request to daemon");
+        }
+        size_t newline;
+        while ((newline = received.find('\n')) == std::string::npos) {
+            char buffer[4096];
+            auto count = recv(sock, buffer, sizeof(buffer), 0);
+            if (count <= 0) {
+                CLOSE_SOCKET(sock);
+                throw std::runtime_error("Daemon closed the connection");
+            }
+            received.append(buffer, static_cast<size_t>(count));
+        }
+        std::string answer = received.substr(0, newline);
+        received.erase(0, newline + 1);
+        std::cout << answer << std::endl;
+        json parsed = json::parse(answer, nullptr, false);
+        all_ok = all_ok && !parsed.is_discarded() && parsed.value("ok", false);
+    }
+    CLOSE_SOCKET(sock);
+    return all_ok;
+#endif
+}
+
+#endif
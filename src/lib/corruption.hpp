@@ -0,0 +1,124 @@
+#ifndef CORRUPTION_HPP
+#define CORRUPTION_HPP
+
+// this file contains hash failure attribution: every copy of a piece that failed
+// verification is remembered block by block with the peer that sent each block,
+// and once a good copy arrives the blocks are compared to find out who sent bad data
+
+#include <map>
+#include <string>
+#include <vector>
+#include "merkle.hpp"
+#include "peers.hpp"
+#include "piece_state.hpp"
+
+// one received copy of a piece: a digest and the sender of every 16 KiB block
+struct BlockRecord {
+    std::vector<Sha256Digest> digests;
+    std::vector<PeerAddress> peers;
+};
+
+// Function to record a copy of a piece, block_peers holds the sender of each block
+inline BlockRecord record_blocks(const uint8_t* data, size_t length, std::vector<PeerAddress> block_peers) {
+    BlockRecord record{hash_blocks(data, length), std::move(block_peers)};
+    if (record.peers.size() != record.digests.size()) {
+        throw std::runtime_error("Block senders don't match the blocks of the piece");
+    }
+    return record;
+}
+
+// Hash failures of one download. A peer is banned once a block it sent is proven
+// wrong by a copy that passed, or when enough of the pieces it sent alone failed
+// that waiting for proof would only waste more bandwidth.
+class CorruptionTracker {
+public:
+    // failed pieces a peer may have sent without being caught on a block
+    static constexpr int MAX_UNPROVEN_FAILURES = 3;
+
+    // A copy of piece failed verification. Returns the peers that just used up their
+    // allowance of unproven failures and should be banned.
+    std::vector<PeerAddress> record_failure(size_t piece, BlockRecord copy) {
+        std::vector<PeerAddress> to_ban;
+        for (const PeerAddress& peer : distinct_peers(copy)) {
+            if (++strikes[peer_key(peer)] == MAX_UNPROVEN_FAILURES) {
+                to_ban.push_back(peer);
+            }
+        }
+        failed_copies[piece].push_back(std::move(copy));
+        return to_ban;
+    }
+
+    bool has_failures(size_t piece) const { return failed_copies.count(piece) != 0; }
+
+    // Pieces the peer sent a bad copy of, so they are fetched from someone else.
+    // Sized piece_count for PieceState::pick_piece, or empty while nothing failed.
+    Bitset pieces_failed_by(const PeerAddress& peer, size_t piece_count) const {
+        Bitset pieces;
+        if (failed_copies.empty()) {
+            return pieces;
+        }
+        pieces.resize(piece_count);
+        std::string key = peer_key(peer);
+        for (const auto& [piece, copies] : failed_copies) {
+            for (const BlockRecord& copy : copies) {
+                for (const PeerAddress& sender : copy.peers) {
+                    if (peer_key(sender) == key) {
+                        pieces.set(piece);
+                    }
+                }
+            }
+        }
+        return pieces;
+    }
+
+    // The piece passed with good's blocks. Everyone who sent a different block in a
+    // failed copy is returned for banning; peers whose blocks all matched get their
+    // strike back. The failed copies are forgotten.
+    std::vector<PeerAddress> resolve(size_t piece, const BlockRecord& good) {
+        std::vector<PeerAddress> guilty;
+        auto it = failed_copies.find(piece);
+        if (it == failed_copies.end()) {
+            return guilty;
+        }
+        std::map<std::string, bool> sent_bad_block;
+        for (const BlockRecord& copy : it->second) {
+            for (size_t block = 0; block < copy.digests.size(); ++block) {
+                std::string key = peer_key(copy.peers[block]);
+                bool bad = block >= good.digests.size() || copy.digests[block] != good.digests[block];
+                // a peer that also sent the good block only had a transfer go wrong
+                if (bad && block < good.peers.size() && peer_key(good.peers[block]) == key) {
+                    bad = false;
+                }
+                if (bad && !sent_bad_block[key]) {
+                    guilty.push_back(copy.peers[block]);
+                }
+                sent_bad_block[key] = sent_bad_block[key] || bad;
+            }
+        }
+        for (const auto& [key, bad] : sent_bad_block) {
+            if (!bad && strikes[key] > 0) {
+                --strikes[key];
+            }
+        }
+        failed_copies.erase(it);
+        return guilty;
+    }
+
+private:
+    static std::vector<PeerAddress> distinct_peers(const BlockRecord& copy) {
+        std::vector<PeerAddress> peers;
+        std::map<std::string, bool> seen;
+        for (const PeerAddress& peer : copy.peers) {
+            if (!seen[peer_key(peer)]) {
+                seen[peer_key(peer)] = true;
+                peers.push_back(peer);
+            }
+        }
+        return peers;
+    }
+
+    std::map<size_t, std::vector<BlockRecord>> failed_copies;
+    std::map<std::string, int> strikes; // failed copies per peer, by peer_key
+};
+
+#endif
@@ -13,7 +13,7 @@ json decode_integer(std::string::const_iterator& it, const std::string::const_it
 json decode_list(std::string::const_iterator& it, const std::string::const_iterator& end);
 json decode_dict(std::string::const_iterator& it, const std::string::const_iterator& end);
 json decode_bencoded_value(const std::string& encoded_value);
-std::string bencode_decoded_value(json &decoded_value);
+std::string bencode_decoded_value(const json &decoded_value);
 
 inline json decode_string(std::string::const_iterator& it, const std::string::const_iterator& end) {
     std::string number_string;
@@ -25,6 +25,9 @@ inline json decode_string(std::string::const_iterator& it, const std::string::co
     }
     ++it; // Skip ':'
     int64_t length = std::stoll(number_string.c_str());
+    if (length < 0 || length > end - it) {
+        throw std::runtime_error("Invalid encoded string length");
+    }
     std::string str(it, it + length);
     it += length;
     return json(str);
@@ -97,7 +100,7 @@ inline json decode_bencoded_value(const std::string& encoded_value) {
     return decode_bencoded_value(it, end);
 }
 
-inline std::string bencode_decoded_value(json &decoded_value) {
+inline std::string bencode_decoded_value(const json &decoded_value) {
     std::string encoded_value;
     if (decoded_value.is_string()) {
         std::string str = decoded_value.get<std::string>();
@@ -107,8 +110,7 @@ inline std::string bencode_decoded_value(json &decoded_value) {
     } else if (decoded_value.is_array()) {
         encoded_value += "l";
         for (const auto& value : decoded_value) {
-            json obj = value.object();
-            encoded_value += bencode_decoded_value(obj);
+            encoded_value += bencode_decoded_value(value);
         }
         encoded_value += "e";
     } else if (decoded_value.is_object()) {
@@ -0,0 +1,705 @@
+#ifndef DHT_HPP
+#define DHT_HPP
+
+// this file contains a Kademlia DHT node (BEP 5) used to find peers without a tracker:
+// routing table, KRPC queries over UDP and iterative lookups
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include "decode.hpp"
+#include "peers.hpp"
+#include "reactor.hpp"
+
+#ifndef _WIN32
+    #include <netdb.h>
+#endif
+
+using NodeId = std::array<uint8_t, 20>;
+
+// well known nodes used to join the DHT
+const std::vector<std::pair<std::string, uint16_t>> DHT_BOOTSTRAP_NODES = {
+    {"router.bittorrent.com", 6881},
+    {"dht.transmissionbt.com", 6881},
+    {"router.utorrent.com", 6881},
+};
+
+inline NodeId random_node_id() {
+    static std::mt19937 gen(std::random_device{}());
+    std::uniform_int_distribution<> dis(0, 255);
+    NodeId id;
+    for (uint8_t& byte : id) {
+        byte = static_cast<uint8_t>(dis(gen));
+    }
+    return id;
+}
+
+inline NodeId node_id_from_bytes(const std::string& bytes) {
+    if (bytes.size() != 20) {
+        throw std::runtime_error("Invalid node id length");
+    }
+    NodeId id;
+    std::copy(bytes.begin(), bytes.end(), id.begin());
+    return id;
+}
+
+inline std::string node_id_to_bytes(const NodeId& id) {
+    return std::string(id.begin(), id.end());
+}
+
+// number of leading bits a and b have in common (160 if equal)
+inline int common_prefix_bits(const NodeId& a, const NodeId& b) {
+    for (size_t i = 0; i < a.size(); ++i) {
+        uint8_t diff = a[i] ^ b[i];
+        if (diff != 0) {
+            return static_cast<int>(i * 8) + std::countl_zero(diff);
+        }
+    }
+    return 160;
+}
+
+// true if a is closer to target than b by XOR distance
+inline bool closer_to(const NodeId& target, const NodeId& a, const NodeId& b) {
+    for (size_t i = 0; i < target.size(); ++i) {
+        uint8_t da = a[i] ^ target[i];
+        uint8_t db = b[i] ^ target[i];
+        if (da != db) {
+            return da < db;
+        }
+    }
+    return false;
+}
+
+// 6 byte compact form of an IPv4 endpoint
+inline std::string compact_address(const sockaddr_in& addr) {
+    std::string out(6, '\0');
+    memcpy(out.data(), &addr.sin_addr.s_addr, 4);
+    memcpy(out.data() + 4, &addr.sin_port, 2);
+    return out;
+}
+
+inline sockaddr_in address_from_compact(const std::string& data, size_t offset) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    memcpy(&addr.sin_addr.s_addr, data.data() + offset, 4);
+    memcpy(&addr.sin_port, data.data() + offset + 4, 2);
+    return addr;
+}
+
+inline bool same_address(const sockaddr_in& a, const sockaddr_in& b) {
+    return a.sin_addr.s_addr == b.sin_addr.s_addr && a.sin_port == b.sin_port;
+}
+
+// a node we know about
+struct DhtContact {
+    NodeId id;
+    sockaddr_in addr;
+    std::chrono::steady_clock::time_point last_seen;
+    int failed_queries = 0;
+};
+
+// Kademlia routing table.
+// Bucket i holds up to K nodes that share exactly i leading bits with our id,
+// which is the fully split form of the BEP 5 table.
+class RoutingTable {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr size_t K = 8;
+    static constexpr Clock::duration QUESTIONABLE_AFTER = std::chrono::minutes(15);
+    static constexpr int MAX_FAILURES = 2;
+
+    explicit RoutingTable(const NodeId& self_id) : self(self_id) {}
+
+    // a node answered us or sent us a query
+    void heard_from(const NodeId& id, const sockaddr_in& addr, Clock::time_point now) {
+        int index = common_prefix_bits(self, id);
+        if (index >= 160) {
+            return; // that's us
+        }
+        std::vector<DhtContact>& bucket = buckets[index];
+        for (size_t i = 0; i < bucket.size(); ++i) {
+            if (bucket[i].id == id) {
+                // move to the back, the bucket is ordered least recently seen first
+                DhtContact contact = bucket[i];
+                contact.addr = addr;
+                contact.last_seen = now;
+                contact.failed_queries = 0;
+                bucket.erase(bucket.begin() + i);
+                bucket.push_back(contact);
+                bucket_changed[index] = now;
+                return;
+            }
+        }
+        DhtContact contact{id, addr, now, 0};
+        if (bucket.size() < K) {
+            bucket.push_back(contact);
+            bucket_changed[index] = now;
+            return;
+        }
+        // full bucket: good nodes are never replaced, bad and stale ones are
+        for (DhtContact& existing : bucket) {
+            if (existing.failed_queries >= MAX_FAILURES || now - existing.last_seen > QUESTIONABLE_AFTER) {
+                existing = contact;
+                bucket_changed[index] = now;
+                return;
+            }
+        }
+    }
+
+    // a query to addr timed out
+    void failed(const sockaddr_in& addr) {
+        for (std::vector<DhtContact>& bucket : buckets) {
+            for (auto it = bucket.begin(); it != bucket.end(); ++it) {
+                if (same_address(it->addr, addr)) {
+                    if (++it->failed_queries > MAX_FAILURES) {
+                        bucket.erase(it);
+                    }
+                    return;
+                }
+            }
+        }
+    }
+
+    std::vector<DhtContact> closest(const NodeId& target, size_t count) const {
+        std::vector<DhtContact> all;
+        for (const std::vector<DhtContact>& bucket : buckets) {
+            for (const DhtContact& contact : bucket) {
+                if (contact.failed_queries < MAX_FAILURES) {
+                    all.push_back(contact);
+                }
+            }
+        }
+        size_t n = std::min(count, all.size());
+        std::partial_sort(all.begin(), all.begin() + n, all.end(), [&](const DhtContact& a, const DhtContact& b) {
+            return closer_to(target, a.id, b.id);
+        });
+        all.resize(n);
+        return all;
+    }
+
+    // indices of non-empty buckets nothing happened in for a while
+    std::vector<int> stale_buckets(Clock::time_point now) const {
+        std::vector<int> stale;
+        for (int i = 0; i < 160; ++i) {
+            if (!buckets[i].empty() && now - bucket_changed[i] > QUESTIONABLE_AFTER) {
+                stale.push_back(i);
+            }
+        }
+        return stale;
+    }
+
+    size_t size() const {
+        size_t total = 0;
+        for (const std::vector<DhtContact>& bucket : buckets) {
+            total += bucket.size();
+        }
+        return total;
+    }
+
+private:
+    NodeId self;
+    std::array<std::vector<DhtContact>, 160> buckets;
+    std::array<Clock::time_point, 160> bucket_changed{};
+};
+
+// A DHT node speaking KRPC over UDP on a Reactor.
+// Answers ping/find_node/get_peers/announce_peer from other nodes and runs
+// iterative lookups with up to alpha queries in flight.
+class Dht {
+public:
+    using Clock = std::chrono::steady_clock;
+    using PeersCallback = std::function<void(const std::vector<PeerAddress>&)>;
+    static constexpr size_t DEFAULT_ALPHA = 3;
+    static constexpr Clock::duration QUERY_TIMEOUT = std::chrono::seconds(3);
+    static constexpr Clock::duration TOKEN_ROTATION = std::chrono::minutes(5);
+    static constexpr Clock::duration PEER_EXPIRY = std::chrono::minutes(30);
+    static constexpr size_t MAX_PEERS_PER_HASH = 200;
+    static constexpr size_t MAX_VALUES_PER_RESPONSE = 50;
+
+    Dht(Reactor& event_loop, uint16_t port = 0, size_t lookup_alpha = DEFAULT_ALPHA)
+        : reactor(event_loop), udp(port), self(random_node_id()), table(self),
+          alpha(std::max<size_t>(lookup_alpha, 1)), secret(random_secret()), previous_secret(secret) {
+        reactor.add_reader(udp.handle(), [this]() { on_readable(); });
+        maintenance_timer = reactor.call_later(TOKEN_ROTATION, [this]() { maintenance(); });
+    }
+
+    ~Dht() {
+        reactor.remove_reader(udp.handle());
+        reactor.cancel(maintenance_timer);
+        for (auto& [tid, pending] : transactions) {
+            reactor.cancel(pending.timer);
+        }
+    }
+
+    Dht(const Dht&) = delete;
+    Dht& operator=(const Dht&) = delete;
+
+    const NodeId& id() const { return self; }
+    uint16_t port() const { return udp.local_port(); }
+    size_t node_count() const { return table.size(); }
+
+    // Contact a node we only know the address of. Once it answers it is in the table.
+    void add_node(const sockaddr_in& addr) {
+        send_query(addr, "find_node", {{"target", node_id_to_bytes(self)}}, [](const json*) {});
+    }
+
+    // Join the network through the given routers and look up our own id
+    // to fill the buckets around us. done runs when that lookup finishes.
+    void bootstrap(const std::vector<std::pair<std::string, uint16_t>>& routers, std::function<void()> done = {}) {
+        std::vector<sockaddr_in> seeds;
+        for (const auto& [host, host_port] : routers) {
+            addrinfo hints{};
+            hints.ai_family = AF_INET;
+            hints.ai_socktype = SOCK_DGRAM;
+            addrinfo* result = nullptr;
+            if (getaddrinfo(host.c_str(), std::to_string(host_port).c_str(), &hints, &result) != 0) {
+                continue;
+            }
+            for (addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+                seeds.push_back(*reinterpret_cast<sockaddr_in*>(ai->ai_addr));
+            }
+            freeaddrinfo(result);
+        }
+        bootstrap(seeds, std::move(done));
+    }
+
+    void bootstrap(const std::vector<sockaddr_in>& seeds, std::function<void()> done = {}) {
+        auto lookup = std::make_shared<Lookup>();
+        lookup->target = self;
+        lookup->on_done = [done](const std::vector<PeerAddress>&) { if (done) done(); };
+        // seeds have no known id yet, give them ours so they sort first
+        for (const sockaddr_in& addr : seeds) {
+            lookup->shortlist.push_back({self, addr, Candidate::Fresh, ""});
+        }
+        start_lookup(lookup);
+    }
+
+    // Iterative find_node towards target
+    void find_node(const NodeId& target, std::function<void()> done = {}) {
+        auto lookup = std::make_shared<Lookup>();
+        lookup->target = target;
+        lookup->on_done = [done](const std::vector<PeerAddress>&) { if (done) done(); };
+        start_lookup(lookup);
+    }
+
+    // Iterative get_peers for a 20 byte info hash. If announce_port is set we
+    // announce ourselves to the closest nodes that handed us a token.
+    void get_peers(const std::vector<uint8_t>& info_hash, PeersCallback done, uint16_t announce_port = 0) {
+        auto lookup = std::make_shared<Lookup>();
+        lookup->target = node_id_from_bytes(std::string(info_hash.begin(), info_hash.end()));
+        lookup->get_peers = true;
+        lookup->announce_port = announce_port;
+        lookup->on_done = std::move(done);
+        start_lookup(lookup);
+    }
+
+private:
+    // a node taking part in a lookup
+    struct Candidate {
+        enum State { Fresh, Pending, Responded, Failed };
+        NodeId id;
+        sockaddr_in addr;
+        State state;
+        std::string token;
+    };
+
+    struct Lookup {
+        NodeId target;
+        bool get_peers = false;
+        uint16_t announce_port = 0;
+        std::vector<Candidate> shortlist; // sorted by distance to target
+        size_t in_flight = 0;
+        bool finished = false;
+        std::set<std::string> seen_peers;
+        std::vector<PeerAddress> peers;
+        PeersCallback on_done;
+    };
+
+    using ResponseCallback = std::function<void(const json*)>; // nullptr on timeout or error
+
+    struct Transaction {
+        sockaddr_in addr;
+        ResponseCallback callback;
+        uint64_t timer;
+    };
+
+    struct StoredPeer {
+        std::string compact;
+        Clock::time_point added;
+    };
+
+    static std::string random_secret() {
+        NodeId bytes = random_node_id();
+        return std::string(bytes.begin(), bytes.end());
+    }
+
+    // token handed out to addr, valid for this and the previous secret
+    std::string make_token(const sockaddr_in& addr, const std::string& key) const {
+        SHA1 sha1;
+        sha1.update(compact_address(addr) + key);
+        std::vector<uint8_t> digest = hex_to_bytes(sha1.final());
+        return std::string(digest.begin(), digest.begin() + 8);
+    }
+
+    bool valid_token(const sockaddr_in& addr, const std::string& token) const {
+        return token == make_token(addr, secret) || token == make_token(addr, previous_secret);
+    }
+
+    std::string compact_nodes(const NodeId& target) const {
+        std::string nodes;
+        for (const DhtContact& contact : table.closest(target, RoutingTable::K)) {
+            nodes += node_id_to_bytes(contact.id) + compact_address(contact.addr);
+        }
+        return nodes;
+    }
+
+    void send_query(const sockaddr_in& to, const std::string& method, json args, ResponseCallback callback) {
+        uint16_t counter = ++transaction_counter;
+        std::string tid{static_cast<char>(counter >> 8), static_cast<char>(counter & 0xFF)};
+        args["id"] = node_id_to_bytes(self);
+        json msg = {{"t", tid}, {"y", "q"}, {"q", method}, {"a", args}};
+        uint64_t timer = reactor.call_later(QUERY_TIMEOUT, [this, tid]() {
+            auto it = transactions.find(tid);
+            if (it == transactions.end()) {
+                return;
+            }
+            Transaction transaction = std::move(it->second);
+            transactions.erase(it);
+            table.failed(transaction.addr);
+            transaction.callback(nullptr);
+        });
+        transactions[tid] = {to, std::move(callback), timer};
+        udp.send_to(bencode_decoded_value(msg), to);
+    }
+
+    void send_response(const sockaddr_in& to, const std::string& tid, json values) {
+        values["id"] = node_id_to_bytes(self);
+        json msg = {{"t", tid}, {"y", "r"}, {"r", values}};
+        udp.send_to(bencode_decoded_value(msg), to);
+    }
+
+    void send_error(const sockaddr_in& to, const std::string& tid, int code, const std::string& text) {
+        json msg = {{"t", tid}, {"y", "e"}, {"e", json::array({code, text})}};
+        udp.send_to(bencode_decoded_value(msg), to);
+    }
+
+    void on_readable() {
+        std::string data;
+        sockaddr_in from{};
+        while (udp.receive_from(data, from)) {
+            try {
+                json msg = decode_bencoded_value(data);
+                std::string type = msg.at("y").get<std::string>();
+                if (type == "q") {
+                    handle_query(msg, from);
+                } else if (type == "r" || type == "e") {
+                    handle_response(msg, from);
+                }
+            } catch (const std::exception&) {
+                // garbage from the network is dropped
+            }
+        }
+    }
+
+    void handle_query(const json& msg, const sockaddr_in& from) {
+        std::string tid = msg.at("t").get<std::string>();
+        std::string method = msg.at("q").get<std::string>();
+        const json& args = msg.at("a");
+        NodeId sender = node_id_from_bytes(args.at("id").get<std::string>());
+        table.heard_from(sender, from, Clock::now());
+
+        if (method == "ping") {
+            send_response(from, tid, json::object());
+        } else if (method == "find_node") {
+            NodeId target = node_id_from_bytes(args.at("target").get<std::string>());
+            send_response(from, tid, {{"nodes", compact_nodes(target)}});
+        } else if (method == "get_peers") {
+            std::string info_hash = args.at("info_hash").get<std::string>();
+            json values = json::object();
+            values["token"] = make_token(from, secret);
+            auto it = peer_store.find(info_hash);
+            if (it != peer_store.end() && !it->second.empty()) {
+                json list = json::array();
+                for (const StoredPeer& peer : it->second) {
+                    if (list.size() >= MAX_VALUES_PER_RESPONSE) {
+                        break;
+                    }
+                    list.push_back(peer.compact);
+                }
+                values["values"] = list;
+            } else {
+                values["nodes"] = compact_nodes(node_id_from_bytes(info_hash));
+            }
+            send_response(from, tid, values);
+        } else if (method == "announce_peer") {
+            if (!valid_token(from, args.at("token").get<std::string>())) {
+                send_error(from, tid, 203, "Bad token");
+                return;
+            }
+            std::string info_hash = args.at("info_hash").get<std::string>();
+            node_id_from_bytes(info_hash); // validates the length
+            sockaddr_in peer_addr = from;
+            bool implied_port = args.contains("implied_port") && args["implied_port"].get<int64_t>() != 0;
+            if (!implied_port) {
+                peer_addr.sin_port = htons(static_cast<uint16_t>(args.at("port").get<int64_t>()));
+            }
+            store_peer(info_hash, compact_address(peer_addr));
+            send_response(from, tid, json::object());
+        } else {
+            send_error(from, tid, 204, "Method Unknown");
+        }
+    }
+
+    void handle_response(const json& msg, const sockaddr_in& from) {
+        std::string tid = msg.at("t").get<std::string>();
+        auto it = transactions.find(tid);
+        if (it == transactions.end() || !same_address(it->second.addr, from)) {
+            return;
+        }
+        Transaction transaction = std::move(it->second);
+        transactions.erase(it);
+        reactor.cancel(transaction.timer);
+
+        if (msg.at("y").get<std::string>() == "e" || !msg.contains("r")) {
+            transaction.callback(nullptr);
+            return;
+        }
+        const json& values = msg.at("r");
+        table.heard_from(node_id_from_bytes(values.at("id").get<std::string>()), from, Clock::now());
+        transaction.callback(&values);
+    }
+
+    void store_peer(const std::string& info_hash, const std::string& compact) {
+        std::vector<StoredPeer>& peers = peer_store[info_hash];
+        for (StoredPeer& peer : peers) {
+            if (peer.compact == compact) {
+                peer.added = Clock::now();
+                return;
+            }
+        }
+        if (peers.size() >= MAX_PEERS_PER_HASH) {
+            peers.erase(peers.begin());
+        }
+        peers.push_back({compact, Clock::now()});
+    }
+
+    void start_lookup(const std::shared_ptr<Lookup>& lookup) {
+        for (const DhtContact& contact : table.closest(lookup->target, RoutingTable::K * 2)) {
+            add_candidate(*lookup, contact.id, contact.addr);
+        }
+        step(lookup);
+    }
+
+    void add_candidate(Lookup& lookup, const NodeId& id, const sockaddr_in& addr) {
+        if (id == self) {
+            return;
+        }
+        for (const Candidate& candidate : lookup.shortlist) {
+            if (candidate.id == id || same_address(candidate.addr, addr)) {
+                return;
+            }
+        }
+        Candidate candidate{id, addr, Candidate::Fresh, ""};
+        auto pos = std::upper_bound(lookup.shortlist.begin(), lookup.shortlist.end(), candidate,
+            [&](const Candidate& a, const Candidate& b) { return closer_to(lookup.target, a.id, b.id); });
+        lookup.shortlist.insert(pos, candidate);
+    }
+
+    // Keep alpha queries in flight towards the K closest live candidates.
+    // The lookup is over once all of those have answered.
+    void step(const std::shared_ptr<Lookup>& lookup) {
+        if (lookup->finished) {
+            return;
+        }
+        size_t considered = 0;
+        bool converged = true;
+        for (size_t i = 0; i < lookup->shortlist.size() && considered < RoutingTable::K; ++i) {
+            Candidate& candidate = lookup->shortlist[i];
+            if (candidate.state == Candidate::Failed) {
+                continue;
+            }
+            ++considered;
+            if (candidate.state == Candidate::Fresh && lookup->in_flight < alpha) {
+                query_candidate(lookup, i);
+            }
+            if (candidate.state != Candidate::Responded) {
+                converged = false;
+            }
+        }
+        if (converged && lookup->in_flight == 0) {
+            finish_lookup(lookup);
+        }
+    }
+
+    void query_candidate(const std::shared_ptr<Lookup>& lookup, size_t index) {
+        Candidate& candidate = lookup->shortlist[index];
+        candidate.state = Candidate::Pending;
+        ++lookup->in_flight;
+        sockaddr_in addr = candidate.addr;
+
+        json args = json::object();
+        std::string method = lookup->get_peers ? "get_peers" : "find_node";
+        args[lookup->get_peers ? "info_hash" : "target"] = node_id_to_bytes(lookup->target);
+
+        send_query(addr, method, args, [this, lookup, addr](const json* values) {
+            --lookup->in_flight;
+            // the shortlist may have been reordered, find the candidate by address
+            auto it = std::find_if(lookup->shortlist.begin(), lookup->shortlist.end(),
+                [&](const Candidate& c) { return same_address(c.addr, addr); });
+            if (it != lookup->shortlist.end()) {
+                if (values == nullptr) {
+                    it->state = Candidate::Failed;
+                } else {
+                    it->state = Candidate::Responded;
+                    // seeds were added under our id, now we know theirs
+                    it->id = node_id_from_bytes(values->at("id").get<std::string>());
+                    if (values->contains("token")) {
+                        it->token = (*values)["token"].get<std::string>();
+                    }
+                }
+            }
+            if (values != nullptr) {
+                absorb_response(*lookup, *values);
+            }
+            step(lookup);
+        });
+    }
+
+    void absorb_response(Lookup& lookup, const json& values) {
+        if (values.contains("nodes")) {
+            std::string nodes = values["nodes"].get<std::string>();
+            for (size_t offset = 0; offset + 26 <= nodes.size(); offset += 26) {
+                add_candidate(lookup, node_id_from_bytes(nodes.substr(offset, 20)), address_from_compact(nodes, offset + 20));
+            }
+        }
+        // seeds were inserted unsorted under our id
+        std::stable_sort(lookup.shortlist.begin(), lookup.shortlist.end(), [&](const Candidate& a, const Candidate& b) {
+            return closer_to(lookup.target, a.id, b.id);
+        });
+        if (values.contains("values") && values["values"].is_array()) {
+            for (const json& value : values["values"]) {
+                std::string compact = value.get<std::string>();
+                if (compact.size() == 6 && lookup.seen_peers.insert(compact).second) {
+                    lookup.peers.push_back({format_ip_address(compact, 0), get_peer_port(compact, 4)});
+                }
+            }
+        }
+    }
+
+    void finish_lookup(const std::shared_ptr<Lookup>& lookup) {
+        lookup->finished = true;
+        if (lookup->get_peers && lookup->announce_port != 0) {
+            size_t announced = 0;
+            for (const Candidate& candidate : lookup->shortlist) {
+                if (announced >= RoutingTable::K) {
+                    break;
+                }
+                if (candidate.state != Candidate::Responded || candidate.token.empty()) {
+                    continue;
+                }
+                json args = {{"info_hash", node_id_to_bytes(lookup->target)},
+                             {"port", lookup->announce_port},
+                             {"token", candidate.token}};
+                send_query(candidate.addr, "announce_peer", args, [](const json*) {});
+                ++announced;
+            }
+        }
+        if (lookup->on_done) {
+            lookup->on_done(lookup->peers);
+        }
+    }
+
+    // rotate the token secret, expire stored peers and refresh quiet buckets
+    void maintenance() {
+        Clock::time_point now = Clock::now();
+        previous_secret = secret;
+        secret = random_secret();
+
+        for (auto it = peer_store.begin(); it != peer_store.end();) {
+            std::vector<StoredPeer>& peers = it->second;
+            peers.erase(std::remove_if(peers.begin(), peers.end(),
+                [&](const StoredPeer& peer) { return now - peer.added > PEER_EXPIRY; }), peers.end());
+            it = peers.empty() ? peer_store.erase(it) : std::next(it);
+        }
+
+        for (int bucket : table.stale_buckets(now)) {
+            // a random id that falls into that bucket: same prefix, flipped next bit
+            NodeId target = random_node_id();
+            for (int bit = 0; bit <= bucket; ++bit) {
+                uint8_t mask = static_cast<uint8_t>(0x80 >> (bit % 8));
+                bool self_bit = self[bit / 8] & mask;
+                bool want = (bit == bucket) ? !self_bit : self_bit;
+                target[bit / 8] = want ? (target[bit / 8] | mask) : (target[bit / 8] & ~mask);
+            }
+            find_node(target);
+        }
+        maintenance_timer = reactor.call_later(TOKEN_ROTATION, [this]() { maintenance(); });
+    }
+
+    Reactor& reactor;
+    UdpSocket udp;
+    NodeId self;
+    RoutingTable table;
+    size_t alpha;
+    std::string secret;
+    std::string previous_secret;
+    uint64_t maintenance_timer = 0;
+    uint16_t transaction_counter = 0;
+    std::map<std::string, Transaction> transactions;
+    std::map<std::string, std::vector<StoredPeer>> peer_store;
+};
+
+// Ask the DHT for peers of an info hash. Joins the network with a temporary
+// node on its own event loop, so it can stand in for a missing tracker.
+inline std::vector<PeerAddress> dht_find_peers(const std::vector<uint8_t>& info_hash,
+                                               std::chrono::seconds timeout = std::chrono::seconds(30)) {
+    WSAInitializer wsa;
+    Reactor reactor;
+    Dht dht(reactor);
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    bool bootstrapped = false;
+    dht.bootstrap(DHT_BOOTSTRAP_NODES, [&]() { bootstrapped = true; });
+    reactor.run_until([&]() { return bootstrapped; }, timeout / 2);
+
+    bool done = false;
+    std::vector<PeerAddress> peers;
+    dht.get_peers(info_hash, [&](const std::vector<PeerAddress>& found) {
+        peers = found;
+        done = true;
+    });
+    reactor.run_until([&]() { return done; }, deadline - std::chrono::steady_clock::now());
+    return peers;
+}
+
+// Get peers for a torrent from its trackers, falling back to the DHT
+// when there are none or none of them answers.
+inline std::vector<PeerAddress> discover_peers(const std::vector<std::string>& trackers, const std::vector<uint8_t>& info_hash, int64_t left) {
+    std::vector<PeerAddress> peers;
+    for (const std::string& tracker : trackers) {
+        try {
+            std::vector<PeerAddress> found = request_tracker_peers(tracker, info_hash, left);
+            peers.insert(peers.end(), found.begin(), found.end());
+        } catch (const std::exception& e) {
+            std::cerr << tracker << ": " << e.what() << std::endl;
+        }
+    }
+    if (peers.empty()) {
+        peers = dht_find_peers(info_hash);
+    }
+    if (peers.empty()) {
+        throw std::runtime_error("No peers found");
+    }
+    return peers;
+}
+
+#endif
@@ -3,219 +3,406 @@
 
 // this file contains fns needed to download a piece or complete file in a torrent
 
+#include <atomic>
 #include <iostream>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include "peers.hpp"
+#include "dht.hpp"
+#include "connection.hpp"
+#include "connection_manager.hpp"
+#include "corruption.hpp"
+#include "storage.hpp"
+#include "piece_state.hpp"
+#include "hasher.hpp"
+#include "rate_limit.hpp"
+
+// BEP 52 lets peers refuse hash requests for more hashes than this, pieces over
+// 8 MiB have more leaves and are asked for in several requests
+constexpr size_t MAX_HASHES_PER_REQUEST = 512;
+
+// the leaf hashes of one v2 piece while the answers to its hash requests come in
+struct PieceHashRequest {
+    const uint8_t* root = nullptr;    // pieces root of the file the piece is in
+    uint32_t first_leaf = 0;          // index of the piece's first block in the file
+    size_t hashes_per_request = 0;
+    std::vector<Sha256Digest> leaves; // filled in as the answers arrive
+    Bitset answered;                  // one bit per request
+};
 
-// WorkerQueue to manage indices of pieces to be downloaded
-class WorkerQueue {
-public:
-    void add_piece(int piece_index) {
-        std::lock_guard<std::mutex> lock(queue_mutex);
-        queue.push(piece_index);
+// Function to ask for the leaf hashes of a v2 piece, the 16 KiB blocks of the piece
+// are the leaves under its node in the piece layer. request keeps what was asked for
+// so the hashes messages answering it can be put together.
+inline void send_hash_request(PeerConnection& connection, const Info& info, int piece_index, const PieceHash& piece_hash, PieceHashRequest& request) {
+    const FileEntry& file = info.files[file_for_piece(info, piece_index)];
+    int64_t first_leaf = (static_cast<int64_t>(piece_index) * info.plength - file.offset) / static_cast<int64_t>(MERKLE_BLOCK_SIZE);
+    request.root = file.pieces_root.data();
+    request.first_leaf = static_cast<uint32_t>(first_leaf);
+    // leaf counts are powers of two, so every request is as long as the others
+    request.hashes_per_request = std::min(piece_hash.merkle_leaves, MAX_HASHES_PER_REQUEST);
+    request.leaves.assign(piece_hash.merkle_leaves, Sha256Digest{});
+    request.answered = Bitset(piece_hash.merkle_leaves / request.hashes_per_request);
+    for (size_t i = 0; i < request.answered.size(); ++i) {
+        uint8_t message[48];
+        memcpy(message, request.root, 32);
+        write_uint32(message + 32, 0);                                                  // base layer, the leaves
+        write_uint32(message + 36, static_cast<uint32_t>(request.first_leaf + i * request.hashes_per_request)); // index
+        write_uint32(message + 40, static_cast<uint32_t>(request.hashes_per_request)); // length
+        write_uint32(message + 44, 0);                                                  // proof layers, we know the piece hash
+        connection.send_message(MSG_HASH_REQUEST, message, sizeof(message));
     }
+}
 
-    bool get_next_piece(int& piece_index) {
-        std::lock_guard<std::mutex> lock(queue_mutex);
-        if (queue.empty()) {
-            return false;
-        }
-        piece_index = queue.front();
-        queue.pop();
-        return true;
+// Function to take the leaf hashes out of a hashes message answering one of request's
+// messages. Once every answer is in and they hash up to the piece hash they go to leaves.
+inline bool parse_hashes_message(const MessageBuffer& payload, PieceHashRequest& request, const PieceHash& piece_hash,
+                          std::vector<Sha256Digest>& leaves) {
+    size_t length = request.hashes_per_request;
+    if (payload.size() != 48 + length * 32 || !std::equal(request.root, request.root + 32, payload.begin()) ||
+        read_uint32(payload, 32) != 0 || read_uint32(payload, 40) != length || read_uint32(payload, 44) != 0) {
+        return false;
     }
-
-    bool contains(int piece_index) const {
-        std::lock_guard<std::mutex> lock(queue_mutex);
-        std::queue<int> temp = queue;
-        while (!temp.empty()) {
-            if (temp.front() == piece_index) {
-                return true;
-            }
-            temp.pop();
-        }
+    uint32_t index = read_uint32(payload, 36);
+    if (index < request.first_leaf || (index - request.first_leaf) % length != 0 ||
+        (index - request.first_leaf) / length >= request.answered.size()) {
         return false;
     }
-
-    bool empty() const {
-        std::lock_guard<std::mutex> lock(queue_mutex);
-        return queue.empty();
+    size_t part = (index - request.first_leaf) / length;
+    for (size_t i = 0; i < length; ++i) {
+        memcpy(request.leaves[part * length + i].data(), payload.data() + 48 + i * 32, 32);
     }
+    request.answered.set(part);
+    if (!request.answered.all()) {
+        return false;
+    }
+    Sha256Digest root = merkle_root(request.leaves, piece_hash.merkle_leaves);
+    if (!std::equal(root.begin(), root.end(), piece_hash.expected)) {
+        return false;
+    }
+    leaves = std::move(request.leaves);
+    return true;
+}
 
-private:
-    std::queue<int> queue;
-    mutable std::mutex queue_mutex;
+// One piece being downloaded from a peer: which of its blocks were asked for and which
+// arrived. It outlives a call of download_piece_into when its requests went out while the
+// piece before it was finishing, the next call carries on where they left off.
+struct PieceDownload {
+    static constexpr int BLOCK_SIZE = 16 * 1024; // 16 KiB
+
+    // data must hold piece_size(info, piece_index) bytes and outlive the download
+    PieceDownload(const Info& info, int piece_index, uint8_t* piece_data, PieceHashJob& job)
+        : index(piece_index), data(piece_data), length(piece_size(info, piece_index)), hash_job(job),
+          block_count(static_cast<size_t>((length + BLOCK_SIZE - 1) / BLOCK_SIZE)), requested(block_count),
+          received(block_count), request_times(block_count), piece_hash(expected_piece_hash(info, piece_index)) {}
+
+    const int index;
+    uint8_t* const data;
+    const int64_t length; // the last piece may be shorter
+    PieceHashJob& hash_job;
+
+    // requested (asked for at some point) and received; outstanding ones are requested but not received
+    const size_t block_count;
+    Bitset requested;
+    Bitset received;
+    size_t outstanding = 0;
+    // when each block was last asked for, for the request round trip metric
+    std::vector<std::chrono::steady_clock::time_point> request_times;
+
+    // leaf hashes of the blocks once the peer sent them and they check out, empty until then
+    const PieceHash piece_hash;
+    std::vector<Sha256Digest> block_hashes;
+    PieceHashRequest hash_request;
+    bool hashes_requested = false;
+    size_t corrupt_blocks = 0;
+    bool started = false; // interested and the hash request are sent
 };
 
+// Function to download a piece over an open connection into piece.data.
+// Keeps as many block requests in flight as the connection's RequestQueue allows. Requests
+// go out while we are unchoked, or at any time for pieces in the peer's allowed fast set.
+// Once every block of the piece is asked for and the queue has room, next_piece is called
+// for the piece to go on with and its blocks are requested too, so the pipeline doesn't
+// drain at piece boundaries. That piece is returned, its download continues in the next call.
+// Received data is handed to the piece's hash job as it lands, with a pool behind the job
+// verification happens on a hasher thread and this returns without waiting for it.
+// For v2 pieces the leaf hashes are requested from peers that speak v2 first, blocks
+// arriving after them are checked on their own and a corrupt one is asked for again.
+inline PieceDownload* download_piece_into(PeerConnection& connection, const Info& info, PieceDownload& piece,
+                                          const std::function<PieceDownload*()>& next_piece = {}) {
+    TRACE_SPAN_ARG("piece", piece.index);
+    const int BLOCK_SIZE = PieceDownload::BLOCK_SIZE;
+    PieceDownload* next = nullptr;
+
+    // Function to check the peer can give us the piece and start asking for it
+    auto start = [&](PieceDownload& started) {
+        if (!connection.may_have_piece(started.index)) {
+            throw std::runtime_error("Peer does not have piece " + std::to_string(started.index));
+        }
+        if (started.started) {
+            return;
+        }
+        started.started = true;
+        // Send interested message
+        if (!connection.am_interested) {
+            connection.send_message(MSG_INTERESTED);
+            connection.am_interested = true;
+        }
+        started.hashes_requested = started.piece_hash.merkle_leaves > 1 && connection.supports_v2();
+        if (started.hashes_requested) {
+            // sent ahead of the block requests so the answer normally arrives before any block
+            send_hash_request(connection, info, started.index, started.piece_hash, started.hash_request);
+        }
+    };
+    start(piece);
+
+    GaugeShare blocks_in_flight(client_metrics().blocks_in_flight);
+    // The hash absorbs blocks in order as they arrive; one that arrives early waits
+    // in the piece's data until the gap before it is filled
+    auto hash_ready_blocks = [&](PieceDownload& target) {
+        size_t contiguous = target.received.find_first_clear();
+        int64_t ready = contiguous == Bitset::npos ? target.length : static_cast<int64_t>(contiguous) * BLOCK_SIZE;
+        target.hash_job.bytes_ready(static_cast<size_t>(ready));
+    };
+    auto outstanding = [&] { return piece.outstanding + (next ? next->outstanding : 0); };
+    // the piece a message is about, nullptr for one we aren't downloading (any more)
+    auto piece_for = [&](uint32_t index) -> PieceDownload* {
+        if (index == static_cast<uint32_t>(piece.index)) {
+            return &piece;
+        }
+        return next && index == static_cast<uint32_t>(next->index) ? next : nullptr;
+    };
+    // last time a block came in, or nothing was outstanding; older than SNUB_TIMEOUT means snubbed
+    auto last_progress = std::chrono::steady_clock::now();
+    // a peer that takes requests and sends nothing back is dropped, giving the pieces to another peer
+    auto check_snubbed = [&]() {
+        if (outstanding() > 0 && std::chrono::steady_clock::now() - last_progress > RequestQueue::SNUB_TIMEOUT) {
+            connection.snub();
+            throw std::runtime_error("Peer sent no data for " + std::to_string(RequestQueue::SNUB_TIMEOUT.count()) +
+                                     " seconds");
+        }
+    };
 
-
-// Function to download a specific piece
-std::vector<uint8_t> download_piece(const std::string& peer_ip, int peer_port, 
-                                  const Info& info, const std::vector<uint8_t>& info_hash, 
-                                  int piece_index) {
-    // Initialize socket
-    WSAInitializer wsa;
-    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
-    if (sock == INVALID_SOCKET_VALUE) {
-        throw std::runtime_error("Failed to create socket");
-    }
-    
-    // Connect to peer
-    struct sockaddr_in peer_addr;
-    peer_addr.sin_family = AF_INET;
-    peer_addr.sin_port = htons(peer_port);
-    if (inet_pton(AF_INET, peer_ip.c_str(), &peer_addr.sin_addr) <= 0) {
-        CLOSE_SOCKET(sock);
-        throw std::runtime_error("Invalid peer IP address");
-    }
-    
-    if (connect(sock, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) == SOCKET_ERROR_VALUE) {
-        CLOSE_SOCKET(sock);
-        throw std::runtime_error("Failed to connect to peer");
-    }
-    
-    // Perform handshake
-    std::string peer_id = generate_peer_id();
-    std::string handshake;
-    handshake.push_back(19);
-    handshake += "BitTorrent protocol";
-    handshake.append(8, '\0');
-    handshake.append(info_hash.begin(), info_hash.end());
-    handshake += peer_id;
-    
-    if (send(sock, handshake.c_str(), handshake.length(), 0) != handshake.length()) {
-        CLOSE_SOCKET(sock);
-        throw std::runtime_error("Failed to send handshake");
-    }
-    
-    // Receive handshake response
-    char response[68];
-    if (recv(sock, response, sizeof(response), 0) != 68) {
-        CLOSE_SOCKET(sock);
-        throw std::runtime_error("Failed to receive handshake response");
-    }
-    
-    // Wait for bitfield message
-    PeerMessage bitfield = read_peer_message(sock);
-    if (bitfield.id != 5) { // 5 is bitfield message ID
-        CLOSE_SOCKET(sock);
-        throw std::runtime_error("Expected bitfield message");
-    }
-    
-    // Send interested message
-    send_peer_message(sock, 2); // 2 is interested message ID
-    
-    // Wait for unchoke message
-    PeerMessage unchoke = read_peer_message(sock);
-    if (unchoke.id != 1) { // 1 is unchoke message ID
-        CLOSE_SOCKET(sock);
-        throw std::runtime_error("Expected unchoke message");
-    }
-    
-    // Calculate piece length and block size
-    const int BLOCK_SIZE = 16 * 1024; // 16 KiB
-    int64_t piece_length = (piece_index == info.pieces.size() / 20 - 1) 
-        ? (info.length % info.plength) : info.plength;
-    
-    // Download piece in blocks
-    std::vector<uint8_t> piece_data;
-    piece_data.reserve(piece_length);
-    
-    for (int64_t offset = 0; offset < piece_length; offset += BLOCK_SIZE) {
+    auto send_request = [&](PieceDownload& target, size_t block) {
+        int64_t offset = static_cast<int64_t>(block) * BLOCK_SIZE;
         // Calculate block length (last block might be smaller)
-        int block_length = std::min(BLOCK_SIZE, static_cast<int>(piece_length - offset));
+        int block_length = std::min(BLOCK_SIZE, static_cast<int>(target.length - offset));
         
         // Prepare request message payload
-        std::vector<uint8_t> request_payload(12);
-        uint32_t index = htonl(piece_index);
-        uint32_t begin = htonl(offset);
-        uint32_t length = htonl(block_length);
-        
-        memcpy(request_payload.data(), &index, 4);
-        memcpy(request_payload.data() + 4, &begin, 4);
-        memcpy(request_payload.data() + 8, &length, 4);
-        
-        // Send request message
-        send_peer_message(sock, 6, request_payload); // 6 is request message ID
+        uint8_t request_payload[12];
+        write_uint32(request_payload, target.index);
+        write_uint32(request_payload + 4, static_cast<uint32_t>(offset));
+        write_uint32(request_payload + 8, block_length);
         
-        // Receive piece message
-        PeerMessage piece_msg = read_peer_message(sock);
-        if (piece_msg.id != 7) { // 7 is piece message ID
-            CLOSE_SOCKET(sock);
-            throw std::runtime_error("Expected piece message");
+        connection.send_message(MSG_REQUEST, request_payload, sizeof(request_payload));
+        target.request_times[block] = std::chrono::steady_clock::now();
+        target.requested.set(block);
+        ++target.outstanding;
+    };
+    // block index of an outstanding request at offset begin, npos if we aren't waiting for it
+    auto outstanding_block = [&](const PieceDownload& target, int64_t begin) {
+        size_t block = static_cast<size_t>(begin / BLOCK_SIZE);
+        if (begin % BLOCK_SIZE != 0 || !target.requested.test(block) || target.received.test(block)) {
+            return Bitset::npos;
         }
-        
-        // Extract block data (skip first 8 bytes of payload which contain index and begin)
-        piece_data.insert(piece_data.end(), 
-                         piece_msg.payload.begin() + 8, 
-                         piece_msg.payload.end());
-    }
-    
-    // Verify piece hash
-    SHA1 sha1;
-    std::string piece_str(piece_data.begin(), piece_data.end());
-    sha1.update(piece_str);
-    std::string hash = sha1.final();
+        return block;
+    };
+    // Fill the pipeline with the piece's blocks whenever the peer lets us ask; false when
+    // the rate limits keep the rest for later
+    auto request_blocks = [&](PieceDownload& target, size_t depth) {
+        bool may_request = !connection.peer_choking || connection.is_allowed_fast(target.index);
+        size_t next_block = target.requested.find_first_clear();
+        while (may_request && next_block != Bitset::npos && outstanding() < depth) {
+            // blocks are paid for when requested, so the peer is never asked for more than the
+            // rate limits let in; with nothing in flight we wait here, otherwise for the next block
+            int64_t block_length = std::min<int64_t>(BLOCK_SIZE, target.length - static_cast<int64_t>(next_block) * BLOCK_SIZE);
+            auto wait = rate_limiter().try_acquire(Direction::Download, block_length, connection.rate_class(),
+                                                   connection.rate_limits());
+            if (wait != RateLimiter::Clock::duration::zero()) {
+                if (outstanding() > 0) {
+                    return false;
+                }
+                std::this_thread::sleep_for(wait);
+                continue;
+            }
+            send_request(target, next_block);
+            next_block = target.requested.find_first_clear(next_block + 1);
+        }
+        return true;
+    };
     
-    // Convert the hex string to bytes for comparison
-    std::vector<uint8_t> piece_hash;
-    for (size_t i = 0; i < hash.length(); i += 2) {
-        std::string byte = hash.substr(i, 2);
-        piece_hash.push_back(static_cast<uint8_t>(std::stoi(byte, nullptr, 16)));
+    while (!piece.received.all()) {
+        if (outstanding() == 0) {
+            last_progress = std::chrono::steady_clock::now();
+        }
+        // as many requests as the peer's measured rate can serve within the target latency,
+        // the next piece's blocks go out once all of this one's are asked for
+        size_t depth = connection.request_queue().depth();
+        if (request_blocks(piece, depth) && piece.requested.find_first_clear() == Bitset::npos && outstanding() < depth) {
+            if (!next && next_piece && (next = next_piece())) {
+                start(*next);
+            }
+            if (next) {
+                request_blocks(*next, depth);
+            }
+        }
+        blocks_in_flight.set(static_cast<int64_t>(outstanding()));
+        
+        PeerMessage msg;
+        {
+            // stalls show up as long waits for a bitfield or an unchoke
+            TRACE_SPAN(!connection.knows_availability() ? "bitfield wait"
+                       : connection.peer_choking ? "unchoke wait" : "receive");
+            try {
+                msg = connection.read_message();
+            } catch (const std::exception&) {
+                // the receive timeout is longer than SNUB_TIMEOUT, a peer sitting on our requests ends up here
+                check_snubbed();
+                throw;
+            }
+        }
+        switch (msg.id) {
+        case MSG_PIECE: {
+            PieceDownload* target = msg.payload.size() < 8 ? nullptr : piece_for(read_uint32(msg.payload, 0));
+            if (!target) {
+                break; // a late block from an earlier piece
+            }
+            int64_t begin = read_uint32(msg.payload, 4);
+            size_t block_length = msg.payload.size() - 8;
+            size_t block = outstanding_block(*target, begin);
+            if (block == Bitset::npos || begin + static_cast<int64_t>(block_length) > target->length) {
+                break; // not something we asked for
+            }
+            last_progress = std::chrono::steady_clock::now();
+            auto round_trip = last_progress - target->request_times[block];
+            connection.block_received(static_cast<int64_t>(block_length), round_trip);
+            client_metrics().request_rtt.observe(std::chrono::duration<double>(round_trip).count());
+            TRACE_ASYNC("block", static_cast<uint64_t>(target->index) * 65536 + block + 1,
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(target->request_times[block].time_since_epoch()).count());
+            if (!target->block_hashes.empty() &&
+                SHA256::hash(msg.payload.data() + 8, block_length) != target->block_hashes[block]) {
+                // ask again straight away instead of failing the whole piece later
+                target->requested.reset(block);
+                --target->outstanding;
+                if (++target->corrupt_blocks > target->block_count) {
+                    throw std::runtime_error("Peer keeps sending corrupt blocks of piece " + std::to_string(target->index));
+                }
+                break;
+            }
+            // Extract block data (skip first 8 bytes of payload which contain index and begin)
+            memcpy(target->data + begin, msg.payload.data() + 8, block_length);
+            target->received.set(block);
+            --target->outstanding;
+            hash_ready_blocks(*target);
+            break;
+        }
+        case MSG_CHOKE:
+            // Without the fast extension a choke silently drops every pending request.
+            // With it the peer rejects them explicitly, except allowed fast ones which stay valid.
+            if (!connection.supports_fast()) {
+                for (PieceDownload* target : {&piece, next}) {
+                    if (target) {
+                        target->requested = target->received;
+                        target->outstanding = 0;
+                    }
+                }
+            }
+            break;
+        case MSG_REJECT_REQUEST: {
+            PieceDownload* target = msg.payload.size() < 12 ? nullptr : piece_for(read_uint32(msg.payload, 0));
+            if (!target) {
+                break;
+            }
+            size_t block = outstanding_block(*target, read_uint32(msg.payload, 4));
+            if (block == Bitset::npos) {
+                break;
+            }
+            --target->outstanding;
+            // A reject while we are unchoked means the peer won't serve this piece at all
+            if (!connection.peer_choking) {
+                throw std::runtime_error("Peer rejected request for piece " + std::to_string(target->index));
+            }
+            // While choked it no longer lets us have the piece fast. The block is asked for
+            // again once we are unchoked, not straight away, or we would loop on rejects
+            connection.revoke_allowed_fast(target->index);
+            target->requested.reset(block);
+            break;
+        }
+        case MSG_HASHES:
+            // hashes that don't add up to the piece hash are ignored, the piece is still checked as a whole
+            for (PieceDownload* target : {&piece, next}) {
+                if (target && target->hashes_requested && target->block_hashes.empty() &&
+                    parse_hashes_message(msg.payload, target->hash_request, target->piece_hash, target->block_hashes)) {
+                    break;
+                }
+            }
+            break;
+        case MSG_HAVE_NONE:
+        case MSG_BITFIELD:
+            for (PieceDownload* target : {&piece, next}) {
+                if (target && !connection.may_have_piece(target->index)) {
+                    throw std::runtime_error("Peer does not have piece " + std::to_string(target->index));
+                }
+            }
+            break;
+        default:
+            // unchoke, have, have_all, allowed_fast, suggest and keep-alive only update
+            // connection state; we don't serve pieces so requests from the peer are ignored,
+            // a hash reject leaves the piece to be verified as a whole
+            break;
+        }
+
+        connection.send_pex_if_due();
+        check_snubbed();
     }
     
-    // Compare with expected hash from torrent file
-    for (size_t i = 0; i < 20; i++) {
-        if (piece_hash[i] != info.pieces[piece_index * 20 + i]) {
-            CLOSE_SOCKET(sock);
-            throw std::runtime_error("Piece hash verification failed");
-        }
+    // Every block has been handed to the hasher, let it verify
+    piece.hash_job.finish();
+    return next;
+}
+
+// the same for one piece on its own, piece_data must hold piece_size(info, piece_index) bytes
+inline void download_piece_into(PeerConnection& connection, const Info& info, int piece_index, uint8_t* piece_data,
+                                PieceHashJob& hash_job) {
+    PieceDownload piece(info, piece_index, piece_data, hash_job);
+    download_piece_into(connection, info, piece);
+}
+
+// Function to download and verify a specific piece over an open connection
+inline std::vector<uint8_t> download_piece(PeerConnection& connection, const Info& info, int piece_index) {
+    std::vector<uint8_t> piece_data(piece_size(info, piece_index));
+    // no pool, the piece is hashed on this thread as it arrives
+    auto hash_job = std::make_shared<PieceHashJob>(piece_index, piece_data.data(), piece_data.size(),
+                                                   expected_piece_hash(info, piece_index));
+    bool verified = false;
+    hash_job->on_complete = [&verified](bool ok) { verified = ok; };
+    download_piece_into(connection, info, piece_index, piece_data.data(), *hash_job);
+    if (!verified) {
+        throw std::runtime_error("Piece hash verification failed");
     }
-    CLOSE_SOCKET(sock);
     return piece_data;
 }
 
-void handle_download_piece(const std::string& encoded_value, const std::string& output_path, int piece_index) {
+// Function to download a specific piece from a peer on a fresh connection
+inline std::vector<uint8_t> download_piece(const std::string& peer_ip, int peer_port, 
+                                  const Info& info, const std::vector<uint8_t>& info_hash, 
+                                  int piece_index) {
+    PeerConnection connection({peer_ip, static_cast<uint16_t>(peer_port)}, info_hash);
+    return download_piece(connection, info, piece_index);
+}
+
+inline void handle_download_piece(const std::string& encoded_value, const std::string& output_path, int piece_index) {
     // Parse torrent file
-    parse_torrent(encoded_value);
-    
-    // Get peers from tracker
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        throw std::runtime_error("Failed to initialize CURL");
-    }
-    
-    std::string url = torr.announce + "?info_hash=";
-    for (uint8_t byte : torr.info.hash) {
-        char hex[4];
-        snprintf(hex, sizeof(hex), "%%%02x", byte);
-        url += hex;
-    }
-    url += "&peer_id=PC0001-1234567890123";
-    url += "&port=6881&uploaded=0&downloaded=0&left=" + std::to_string(torr.info.length);
-    url += "&compact=1";
-    
-    std::string response;
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        curl_easy_cleanup(curl);
-        throw std::runtime_error("Failed to perform tracker request");
-    }
-    curl_easy_cleanup(curl);
+    Torrent torr = parse_torrent(encoded_value);
     
-    // Parse tracker response
-    json decoded_response = decode_bencoded_value(response);
-    std::string peers = decoded_response["peers"].get<std::string>();
+    // Get peers from tracker, or the DHT if there is none
+    std::vector<PeerAddress> peers = discover_peers(torr.trackers, torr.info.hash, torr.info.length);
     
     // Get first peer
-    std::string peer_ip = format_ip_address(peers, 0);
-    uint16_t peer_port = get_peer_port(peers, 4);
+    std::string peer_ip = peers[0].ip;
+    uint16_t peer_port = peers[0].port;
     
     // Download the piece
     std::vector<uint8_t> piece_data = download_piece(peer_ip, peer_port, torr.info, torr.info.hash, piece_index);
@@ -229,7 +416,11 @@ void handle_download_piece(const std::string& encoded_value, const std::string&
 }
 
 // Function to get default output path from torrent info
-std::string get_default_output_path(const Info& info) {
+inline std::string get_default_output_path(const Info& info) {
+    // Multi-file torrents go into a directory named after the torrent
+    if (info.multi_file) {
+        return info.name;
+    }
     // If there's a path specified in the torrent, use the last component
     if (!info.path.empty()) {
         return info.path.back();
@@ -238,7 +429,7 @@ std::string get_default_output_path(const Info& info) {
     return info.name;
 }
 
-void show_progress(size_t downloaded, size_t total) {
+inline void show_progress(size_t downloaded, size_t total) {
     int bar_width = 50;
     float progress = static_cast<float>(downloaded) / static_cast<float>(total);
     int pos = static_cast<int>(bar_width * progress);
@@ -252,165 +443,372 @@ void show_progress(size_t downloaded, size_t total) {
     std::cout.flush();
 }
 
-void recheck_existing_file(const std::string& output_path, const Info& info, WorkerQueue& worker_queue) {
-    std::ifstream file(output_path, std::ios::binary);
-    if (!file) {
-        std::cerr << "No existing file found. All pieces will be added to the queue.\n";
-        for (size_t i = 0; i < info.pieces.size() / 20; ++i) {
-            worker_queue.add_piece(static_cast<int>(i));
+// Function to mark the pieces already on disk as had and the unwanted ones as not wanted
+inline void recheck_existing_file(FileStorage& storage, const Info& info, PieceState& state) {
+    const size_t total_pieces = piece_count(info);
+    std::vector<uint8_t> buffer(info.plength);
+    for (size_t i = 0; i < total_pieces; ++i) {
+        if (!storage.wants_piece(i)) {
+            state.set_wanted(i, false);
+            continue;
         }
-        return;
-    }
-
-    const size_t piece_count = info.pieces.size() / 20;
-    for (size_t i = 0; i < piece_count; ++i) {
-        size_t piece_length = (i == piece_count - 1) ? (info.length % info.plength) : info.plength;
-        std::vector<char> buffer(piece_length);  // Use char buffer for reading file
-
-        file.seekg(i * info.plength);
-        file.read(buffer.data(), piece_length);
-
-        if (file.gcount() != static_cast<std::streamsize>(piece_length)) {
-            worker_queue.add_piece(static_cast<int>(i));
+        size_t piece_length = static_cast<size_t>(piece_size(info, i));
+        if (!storage.read_piece(i, buffer.data(), piece_length)) {
             continue;
         }
 
-        // Convert the char buffer to a string
-        std::string piece_str(buffer.begin(), buffer.end());
-
-        SHA1 sha1;
-        sha1.update(piece_str);  // Pass the string to sha1.update
-        std::string piece_hash_bytes = sha1.final();
-
-        std::string expected_hash(info.pieces.begin() + i * 20, info.pieces.begin() + (i + 1) * 20);
-        if (piece_hash_bytes == expected_hash) {
+        if (verify_piece(expected_piece_hash(info, i), buffer.data(), piece_length)) {
             std::cout << "Piece " << i << " verified.\n";
-        } else {
-            worker_queue.add_piece(static_cast<int>(i));
+            state.mark_have(i);
         }
     }
 }
 
-// Function to download complete file
-void download_complete_file(const std::string& encoded_value, const std::string& output_path) {
-    parse_torrent(encoded_value);
-    
-    std::string actual_output_path = (output_path == "default") ? get_default_output_path(torr.info) : output_path;
-    std::cerr << "Using output path: " << actual_output_path << std::endl;
+// Bytes of wanted pieces verified so far, readable from other threads while downloading
+struct DownloadProgress {
+    std::atomic<int64_t> downloaded{0};
+    std::atomic<int64_t> wanted{0};
+};
 
-    WorkerQueue worker_queue;
+// What a download borrows from whoever runs it; anything left out it makes for itself
+struct DownloadContext {
+    HashPool* hash_pool = nullptr;           // hasher threads shared with other torrents
+    const std::atomic<bool>* stop = nullptr; // checked between pieces
+    DownloadProgress* progress = nullptr;
+    bool show_progress = true;               // progress bar and status lines on stdout
+    PeerCache* peer_cache = nullptr;         // peers remembered across runs, none if null
+    std::vector<PeerAddress> peers;          // found while resolving a magnet link, trackers and DHT aren't asked again
+};
 
-    // Create empty file if it doesn't exist
-    {
-        std::ofstream init_file(actual_output_path, std::ios::binary);
-        if (!init_file) {
-            throw std::runtime_error("Failed to create output file: " + actual_output_path);
-        }
-        // Pre-allocate the file size
-        init_file.seekp(torr.info.length - 1);
-        init_file.put('\0');
-        init_file.close();
+// Function to download a torrent, false if context.stop was set before it completed
+inline bool download_torrent(const Torrent& torr, const std::string& output_path, const StorageOptions& options,
+                      const RateLimits& limits, const DownloadContext& context) {
+    TRACE_THREAD_NAME("download");
+
+    std::string actual_output_path = (output_path == "default") ? get_default_output_path(torr.info) : output_path;
+    if (context.show_progress) {
+        std::cerr << "Using output path: " << actual_output_path << std::endl;
     }
 
-    recheck_existing_file(actual_output_path, torr.info, worker_queue);
+    PieceState piece_state(piece_count(torr.info));
 
-    if (worker_queue.empty()) {
-        std::cout << "File is already complete and valid. Nothing to download.\n";
-        return;
-    }
+    // Create the files (and directories) if they don't exist, keeping existing data
+    FileStorage storage(torr.info, actual_output_path, options);
+    storage.create_files();
 
-    CURL* curl = curl_easy_init();
-    if (!curl) {
-        throw std::runtime_error("Failed to initialize CURL");
+    {
+        TRACE_SPAN("recheck");
+        recheck_existing_file(storage, torr.info, piece_state);
     }
 
-    std::string url = torr.announce + "?info_hash=";
-    for (uint8_t byte : torr.info.hash) {
-        char hex[4];
-        snprintf(hex, sizeof(hex), "%%%02x", byte);
-        url += hex;
+    auto stopped = [&] { return context.stop && context.stop->load(std::memory_order_relaxed); };
+    auto report_progress = [&](size_t downloaded, size_t wanted) {
+        if (context.progress) {
+            context.progress->downloaded.store(static_cast<int64_t>(downloaded), std::memory_order_relaxed);
+            context.progress->wanted.store(static_cast<int64_t>(wanted), std::memory_order_relaxed);
+        }
+        if (context.show_progress) {
+            show_progress(downloaded, wanted);
+        }
+    };
+
+    if (piece_state.complete()) {
+        report_progress(storage.wanted_length(), storage.wanted_length());
+        if (context.show_progress) {
+            std::cout << "File is already complete and valid. Nothing to download.\n";
+        }
+        return true;
     }
-    url += "&peer_id=PC0001-1234567890123";
-    url += "&port=6881&uploaded=0&downloaded=0&left=" + std::to_string(torr.info.length);
-    url += "&compact=1";
-
-    std::string response;
-    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-    
-    CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        curl_easy_cleanup(curl);
-        throw std::runtime_error("Failed to perform tracker request");
+    if (stopped()) {
+        return false;
     }
-    curl_easy_cleanup(curl);
 
-    json decoded_response = decode_bencoded_value(response);
-    std::string peers = decoded_response["peers"].get<std::string>();
-    
-    std::string peer_ip = format_ip_address(peers, 0);
-    uint16_t peer_port = get_peer_port(peers, 4);
+    // Peers learned over PEX while downloading are added to the same pool, and the peers
+    // that worked last time come first
+    PeerPool peer_pool;
+    peer_pool.use_cache(context.peer_cache, torr.info.hash);
+    // connects to several peers at once between pieces, so a dead peer costs no waiting and
+    // a replacement is usually connected before the current peer goes away
+    ConnectionManager connections(peer_pool, torr.info.hash);
+    peer_pool.add(context.peers, PeerSource::Magnet);
+    // remembered peers are connected to while the trackers are asked
+    connections.maintain();
+    if (context.peers.empty()) {
+        TRACE_SPAN("discover peers");
+        try {
+            peer_pool.add(discover_peers(torr.trackers, torr.info.hash, torr.info.length), PeerSource::Tracker);
+        } catch (const std::exception& e) {
+            if (peer_pool.size() == 0) {
+                throw;
+            }
+            std::cerr << e.what() << ", using remembered peers" << std::endl;
+        }
+    }
+    std::unique_ptr<PeerConnection> connection;
+    // this torrent's limits, the global and peer class ones are set on rate_limiter()
+    RateLimitBuckets torrent_limits(limits);
     
     size_t downloaded_size = 0;
-    size_t total_pieces = torr.info.pieces.size() / 20;
-    show_progress(downloaded_size, torr.info.length);
+    size_t total_pieces = piece_count(torr.info);
     // Count already downloaded pieces for progress bar
-    std::ifstream count_file(actual_output_path, std::ios::binary);
-    if (count_file) {
-        for (size_t i = 0; i < total_pieces; ++i) {
-            if (!worker_queue.contains(static_cast<int>(i))) {
-                downloaded_size += (i == total_pieces - 1) ? 
-                    (torr.info.length % torr.info.plength) : torr.info.plength;
-            }
+    size_t wanted_size = storage.wanted_length();
+    for (size_t i = 0; i < total_pieces; ++i) {
+        if (piece_state.wants_piece(i) && piece_state.has_piece(i)) {
+            downloaded_size += piece_size(torr.info, i);
         }
     }
-
-    // Open file in binary mode for reading and writing
-    std::fstream output_file(actual_output_path, std::ios::binary | std::ios::in | std::ios::out);
-    if (!output_file) {
-        throw std::runtime_error("Failed to open output file for writing: " + actual_output_path);
+    report_progress(downloaded_size, wanted_size);
+
+    size_t piece_index = PieceState::NONE;
+
+    // Verified pieces come back from the hasher threads through this queue,
+    // piece state and the connection are only touched on this thread.
+    // Failed pieces, and good copies of pieces that failed before, come with their blocks
+    struct HashResult {
+        size_t piece;
+        bool ok;
+        PeerAddress peer;
+        std::string write_error;
+        BlockRecord blocks;
+    };
+    CorruptionTracker corruption;
+    auto ban_peers = [&](const std::vector<PeerAddress>& peers) {
+        for (const PeerAddress& peer : peers) {
+            if (peer_pool.is_banned(peer)) {
+                continue;
+            }
+            std::cerr << "\nBanning peer " << peer_key(peer) << " for sending corrupt data" << std::endl;
+            peer_pool.ban(peer);
+            if (connection && peer_key(connection->address()) == peer_key(peer)) {
+                connection.reset();
+            }
+        }
+    };
+    std::mutex results_mutex;
+    std::condition_variable results_ready;
+    std::deque<HashResult> results;
+    size_t in_flight = 0; // pieces handed to the hashers and not back yet
+
+    // Enough buffers to keep downloading while every hasher is busy, running out
+    // means the disk or the hashers can't keep up and downloading waits for them.
+    // The buffers are declared first so they outlive our own hashers, which finish
+    // their queued jobs when they are joined.
+    size_t hasher_count = context.hash_pool ? context.hash_pool->thread_count() : HashPool::default_thread_count();
+    AlignedBufferPool piece_buffers(torr.info.plength, hasher_count + 2);
+    std::unique_ptr<HashPool> own_hash_pool;
+    if (!context.hash_pool) {
+        own_hash_pool = std::make_unique<HashPool>(hasher_count);
     }
-
-    int piece_index;
-    int retry_count = 0;
-    const int MAX_RETRIES = 3;
-
-    while (worker_queue.get_next_piece(piece_index)) {
-        try {
-            std::vector<uint8_t> piece_data = download_piece(peer_ip, peer_port, torr.info, torr.info.hash, piece_index);
-            
-            // Seek to the correct position and write the piece
-            output_file.seekp(static_cast<std::streampos>(piece_index) * torr.info.plength);
-            if (!output_file.good()) {
-                throw std::runtime_error("Failed to seek in output file");
+    HashPool& hash_pool = context.hash_pool ? *context.hash_pool : *own_hash_pool;
+
+    // Hash jobs refer to this frame and hold pool buffers until they are done, pieces left
+    // half downloaded included. A shared pool outlives us, so wait for all of them before leaving.
+    struct DrainHashJobs {
+        AlignedBufferPool& buffers;
+        ~DrainHashJobs() { buffers.wait_all_returned(); }
+    } drain_hash_jobs{piece_buffers};
+
+    auto process_results = [&](bool wait) {
+        std::deque<HashResult> ready;
+        {
+            std::unique_lock<std::mutex> lock(results_mutex);
+            if (wait) {
+                TRACE_SPAN("wait for hashers");
+                results_ready.wait(lock, [&] { return !results.empty(); });
             }
-
-            output_file.write(reinterpret_cast<const char*>(piece_data.data()), piece_data.size());
-            if (!output_file.good()) {
-                throw std::runtime_error("Failed to write piece to file");
+            ready.swap(results);
+        }
+        for (const HashResult& result : ready) {
+            --in_flight;
+            if (!result.write_error.empty()) {
+                throw std::runtime_error(result.write_error);
             }
-
-            // Flush after each piece to ensure it's written to disk
-            output_file.flush();
-            
-            downloaded_size += piece_data.size();
-            show_progress(downloaded_size, torr.info.length);
-            retry_count = 0;  // Reset retry counter after successful download
+            if (!result.ok) {
+                // free to be picked again, but not from the peers that sent this copy
+                piece_state.clear_requested(result.piece);
+                client_metrics().hash_failures.add();
+                std::cerr << "\nPiece " << result.piece << " hash verification failed, sent by "
+                          << peer_key(result.peer) << std::endl;
+                ban_peers(corruption.record_failure(result.piece, std::move(result.blocks)));
+                continue;
+            }
+            if (corruption.has_failures(result.piece)) {
+                ban_peers(corruption.resolve(result.piece, result.blocks));
+            }
+            piece_state.mark_have(result.piece);
+            downloaded_size += piece_size(torr.info, result.piece);
+            report_progress(downloaded_size, wanted_size);
+            if (connection) {
+                uint8_t have_payload[4];
+                write_uint32(have_payload, static_cast<uint32_t>(result.piece));
+                try {
+                    connection->send_message(MSG_HAVE, have_payload, sizeof(have_payload));
+                } catch (const std::exception& e) {
+                    // the peer is gone, the rest of the results still count and the loop connects to another
+                    std::cerr << "\nError: " << e.what() << std::endl;
+                    peer_pool.mark_failed(connection->address());
+                    connection.reset();
+                }
+            }
+        }
+    };
+
+    // A piece handed out for download: its buffer, the job verifying it and its blocks
+    struct ActivePiece {
+        std::shared_ptr<AlignedBufferPool::Buffer> data;
+        std::shared_ptr<PieceHashJob> hash_job;
+        std::unique_ptr<PieceDownload> blocks;
+    };
+    // Function to set a piece up for download from the current connection
+    auto start_piece = [&](size_t index) {
+        auto active = std::make_unique<ActivePiece>();
+        // Blocks land straight in an aligned pool buffer that can go to disk with O_DIRECT.
+        // The hasher thread that verifies the piece also writes it and returns the buffer.
+        active->data = std::make_shared<AlignedBufferPool::Buffer>(piece_buffers.acquire());
+        size_t piece_length = static_cast<size_t>(piece_size(torr.info, index));
+        active->hash_job = std::make_shared<PieceHashJob>(index, active->data->get(), piece_length,
+                                                          expected_piece_hash(torr.info, index), &hash_pool);
+        // the whole piece comes over this connection, so every block has the same sender
+        bool failed_before = corruption.has_failures(index);
+        active->hash_job->on_complete = [&, piece_data = active->data, index, piece_length, failed_before,
+                                         peer = connection->address()](bool ok) mutable {
+            HashResult result{index, ok, peer, "", {}};
+            if (!ok || failed_before) {
+                size_t block_count = (piece_length + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE;
+                result.blocks = record_blocks(piece_data->get(), piece_length, std::vector<PeerAddress>(block_count, peer));
+            }
+            if (ok) {
+                try {
+                    storage.write_piece(index, piece_data->get(), piece_length);
+                } catch (const std::exception& e) {
+                    result.write_error = e.what();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(results_mutex);
+                results.push_back(std::move(result));
+                results_ready.notify_one();
+            }
+            // the last thing touching the frame, drain_hash_jobs waits for the buffer
+            piece_data.reset();
+        };
+        active->blocks = std::make_unique<PieceDownload>(torr.info, static_cast<int>(index), active->data->get(),
+                                                         *active->hash_job);
+        piece_state.mark_requested(index);
+        return active;
+    };
+    // the piece whose requests went out while the one before it finished, on the current connection
+    std::unique_ptr<ActivePiece> carried;
+    auto drop_carried = [&] {
+        if (carried) {
+            piece_state.clear_requested(static_cast<size_t>(carried->blocks->index));
+            carried.reset();
+        }
+    };
+
+    // A peer that fails is replaced by the next one from the pool, for as long as it has
+    // candidates; errors that aren't a peer's, disk errors say, end the download
+    while (!piece_state.complete()) {
+        piece_index = PieceState::NONE;
+        process_results(false);
+        if (!connection) {
+            // the connection it was requested on is gone, a banned peer's included
+            drop_carried();
+        }
+        if (piece_state.complete()) {
+            break;
+        }
+        if (stopped()) {
+            drop_carried();
+            // pieces still being verified are written, the rest is picked up by the recheck next time
+            while (in_flight > 0) {
+                process_results(true);
+            }
+            return false;
+        }
+        connections.maintain();
+        if (!connection) {
+            try {
+                connection = connections.next_connection();
+            } catch (const std::exception&) {
+                // out of peers, but the pieces being verified may be all that was missing
+                while (in_flight > 0) {
+                    process_results(true);
+                }
+                if (piece_state.complete()) {
+                    break;
+                }
+                throw;
+            }
+            connection->track_availability(&piece_state);
+            connection->set_rate_limits(&torrent_limits);
+        }
+        try {
+            // the rarest piece this peer has that we still need, unless it sent us a bad copy of it
+            Bitset failed_here = corruption.pieces_failed_by(connection->address(), total_pieces);
+            std::unique_ptr<ActivePiece> current = std::move(carried);
+            if (!current) {
+                piece_index = piece_state.pick_piece(connection->pieces(), connection->may_have_all(), &failed_here);
+                if (piece_index == PieceState::NONE) {
+                    if (in_flight > 0) {
+                        // the rest is being verified, a failure makes its piece pickable again
+                        process_results(true);
+                        continue;
+                    }
+                    // nothing wrong with it, it goes back to the pool to be asked again once it has more
+                    peer_pool.set_aside(connection->address());
+                    connection.reset();
+                    continue;
+                }
+                current = start_piece(piece_index);
+            }
+            piece_index = static_cast<size_t>(current->blocks->index);
+            // the piece after it is picked the same way once all of this one's blocks are asked for
+            download_piece_into(*connection, torr.info, *current->blocks, [&]() -> PieceDownload* {
+                size_t next_index = piece_state.pick_piece(connection->pieces(), connection->may_have_all(), &failed_here);
+                if (next_index == PieceState::NONE) {
+                    return nullptr;
+                }
+                carried = start_piece(next_index);
+                return carried->blocks.get();
+            });
+            ++in_flight;
         }
         catch (const std::exception& e) {
-            std::cerr << "\nError downloading piece " << piece_index << ": " << e.what() << std::endl;
-            if (++retry_count < MAX_RETRIES) {
-                std::cerr << "Retrying... (Attempt " << retry_count + 1 << " of " << MAX_RETRIES << ")" << std::endl;
-                worker_queue.add_piece(piece_index);  // Put the piece back in the queue
+            drop_carried();
+            if (piece_index != PieceState::NONE && connection && !connection->may_have_piece(piece_index)) {
+                // it was taken for a seed until its bitfield came, the next pick goes by what it has
+                piece_state.clear_requested(piece_index);
                 continue;
             }
-            throw;  // Re-throw after max retries
+            if (piece_index != PieceState::NONE) {
+                std::cerr << "\nError downloading piece " << piece_index << ": " << e.what() << std::endl;
+                piece_state.clear_requested(piece_index);  // free to be picked again
+            } else {
+                std::cerr << "\nError: " << e.what() << std::endl;
+            }
+            // Give up on this peer, the next round connects to another one from the pool
+            if (connection) {
+                peer_pool.mark_failed(connection->address());
+                connection.reset();
+            }
         }
     }
 
-    output_file.close();
-    std::cout << "\nDownload completed successfully!" << std::endl;
+    if (context.show_progress) {
+        std::cout << "\nDownload completed successfully!" << std::endl;
+    }
+    return true;
+}
+
+// Function to download complete file
+inline void download_complete_file(const std::string& encoded_value, const std::string& output_path,
+                            const StorageOptions& options = {}, const RateLimits& limits = {},
+                            PeerCache* peer_cache = nullptr, const std::vector<PeerAddress>& peers = {}) {
+    DownloadContext context;
+    context.peer_cache = peer_cache;
+    context.peers = peers;
+    download_torrent(parse_torrent(encoded_value), output_path, options, limits, context);
 }
 
 #endif
\ No newline at end of file
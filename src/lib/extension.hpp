@@ -0,0 +1,103 @@
+#ifndef EXTENSION_HPP
+#define EXTENSION_HPP
+
+// this file contains the extension protocol (BEP 10): the extended handshake and the
+// framing of extension messages inside peer message id 20
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+#include "decode.hpp"
+#include "peers.hpp"
+
+const uint8_t EXTENDED_MESSAGE_ID = 20;
+const uint8_t EXTENDED_HANDSHAKE_ID = 0;
+
+// ids we ask peers to use when they send extension messages to us
+const uint8_t UT_METADATA_ID = 1;
+const uint8_t UT_PEX_ID = 2;
+
+// what a peer announced in its extended handshake
+struct ExtendedHandshake {
+    // extension name -> message id the peer wants us to use for it
+    std::map<std::string, uint8_t> extensions;
+    int64_t metadata_size = 0;
+    std::string client;
+    // reqq, how many outstanding requests the peer queues, 0 if it didn't say
+    int64_t request_queue_limit = 0;
+    // the peer's own addresses and listen port (ipv4, ipv6 and p), empty or 0 if it didn't say
+    std::string ipv4;
+    std::string ipv6;
+    uint16_t listen_port = 0;
+
+    // 0 means the peer does not support the extension
+    uint8_t id_for(const std::string& name) const {
+        auto it = extensions.find(name);
+        return it == extensions.end() ? 0 : it->second;
+    }
+};
+
+// Function to send an extension message, payload is everything after the extension id.
+// Returns the bytes put on the wire.
+inline size_t send_extended_message(socket_t sock, uint8_t extension_id, const std::string& payload) {
+    std::vector<uint8_t> message;
+    message.reserve(payload.size() + 1);
+    message.push_back(extension_id);
+    message.insert(message.end(), payload.begin(), payload.end());
+    send_peer_message(sock, EXTENDED_MESSAGE_ID, message);
+    return 5 + message.size();
+}
+
+// Function to send our extended handshake, metadata_size is 0 while we don't have the info dict
+inline size_t send_extended_handshake(socket_t sock, int64_t metadata_size = 0) {
+    json handshake = json::object();
+    handshake["m"] = {{"ut_metadata", UT_METADATA_ID}, {"ut_pex", UT_PEX_ID}};
+    handshake["v"] = "bittorrent-client-cpp";
+    if (metadata_size > 0) {
+        handshake["metadata_size"] = metadata_size;
+    }
+    return send_extended_message(sock, EXTENDED_HANDSHAKE_ID, bencode_decoded_value(handshake));
+}
+
+// Function to parse the peer's extended handshake (payload of message id 20 with extension id 0)
+inline ExtendedHandshake parse_extended_handshake(const MessageBuffer& payload) {
+    if (payload.empty() || payload[0] != EXTENDED_HANDSHAKE_ID) {
+        throw std::runtime_error("Not an extended handshake");
+    }
+    json decoded = decode_bencoded_value(std::string(payload.begin() + 1, payload.end()));
+    ExtendedHandshake handshake;
+    if (decoded.contains("m") && decoded["m"].is_object()) {
+        for (auto& [name, id] : decoded["m"].items()) {
+            // an id of 0 means the extension was disabled
+            if (id.is_number_integer() && id.get<int64_t>() > 0 && id.get<int64_t>() < 256) {
+                handshake.extensions[name] = static_cast<uint8_t>(id.get<int64_t>());
+            }
+        }
+    }
+    if (decoded.contains("metadata_size") && decoded["metadata_size"].is_number_integer()) {
+        handshake.metadata_size = decoded["metadata_size"].get<int64_t>();
+    }
+    if (decoded.contains("v") && decoded["v"].is_string()) {
+        handshake.client = decoded["v"].get<std::string>();
+    }
+    if (decoded.contains("reqq") && decoded["reqq"].is_number_integer()) {
+        handshake.request_queue_limit = std::max<int64_t>(0, decoded["reqq"].get<int64_t>());
+    }
+    char text[INET6_ADDRSTRLEN];
+    if (decoded.contains("ipv4") && decoded["ipv4"].is_string() && decoded["ipv4"].get<std::string>().size() == 4 &&
+        inet_ntop(AF_INET, decoded["ipv4"].get<std::string>().data(), text, sizeof(text))) {
+        handshake.ipv4 = text;
+    }
+    if (decoded.contains("ipv6") && decoded["ipv6"].is_string() && decoded["ipv6"].get<std::string>().size() == 16 &&
+        inet_ntop(AF_INET6, decoded["ipv6"].get<std::string>().data(), text, sizeof(text))) {
+        handshake.ipv6 = text;
+    }
+    if (decoded.contains("p") && decoded["p"].is_number_integer()) {
+        int64_t port = decoded["p"].get<int64_t>();
+        handshake.listen_port = port > 0 && port < 65536 ? static_cast<uint16_t>(port) : 0;
+    }
+    return handshake;
+}
+
+#endif
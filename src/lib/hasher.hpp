@@ -0,0 +1,281 @@
+#ifndef HASHER_HPP
+#define HASHER_HPP
+
+// this file contains piece verification off the network threads: a pool of hasher
+// threads fed through a lock-free queue, hashing each piece as its blocks arrive.
+// v1 pieces are checked with SHA-1, v2 ones against their merkle root
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <semaphore>
+#include <thread>
+#include <vector>
+#include "merkle.hpp"
+#include "metrics.hpp"
+#include "trace.hpp"
+#include "sha1.hpp"
+#include "utils.hpp"
+
+// Bounded multi-producer multi-consumer queue (Dmitry Vyukov's design).
+// Every cell carries a sequence number telling producers and consumers whose turn it is,
+// so pushes and pops only contend on one atomic counter each.
+template <typename T>
+class MpmcQueue {
+public:
+    // capacity is rounded up to a power of two
+    explicit MpmcQueue(size_t capacity) : cells(std::bit_ceil(std::max<size_t>(capacity, 2))), mask(cells.size() - 1) {
+        for (size_t i = 0; i < cells.size(); ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool try_push(T value) {
+        size_t position = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.value = std::move(value);
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                position = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool try_pop(T& value) {
+        size_t position = head.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = cells[position & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position + 1);
+            if (diff == 0) {
+                if (head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    value = std::move(cell.value);
+                    cell.sequence.store(position + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // empty
+            } else {
+                position = head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::vector<Cell> cells;
+    const size_t mask;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+// What a piece is checked against: the SHA-1 from pieces for v1 torrents, the
+// merkle root over merkle_leaves leaf hashes for v2 and hybrid ones
+struct PieceHash {
+    const uint8_t* expected;
+    size_t merkle_leaves = 0; // 0 for SHA-1
+};
+
+inline PieceHash expected_piece_hash(const Info& info, size_t piece_index) {
+    if (info.meta_version < 2) {
+        return {info.pieces.data() + piece_index * 20, 0};
+    }
+    const uint8_t* expected = info.piece_hashes_v2.data() + piece_index * 32;
+    const FileEntry& file = info.files[file_for_piece(info, piece_index)];
+    if (file.length <= info.plength) {
+        // a file of one piece has no piece layer, its blocks hash straight to the pieces root
+        size_t blocks = static_cast<size_t>((file.length + MERKLE_BLOCK_SIZE - 1) / MERKLE_BLOCK_SIZE);
+        return {expected, std::bit_ceil(blocks)};
+    }
+    return {expected, blocks_per_piece(info)};
+}
+
+// Function to verify a whole piece at once
+inline bool verify_piece(const PieceHash& hash, const uint8_t* data, size_t length) {
+    if (hash.merkle_leaves == 0) {
+        SHA1 sha1;
+        sha1.update(data, length);
+        std::vector<uint8_t> digest = hex_to_bytes(sha1.final());
+        return std::equal(digest.begin(), digest.end(), hash.expected);
+    }
+    Sha256Digest root = merkle_root(hash_blocks(data, length), hash.merkle_leaves);
+    return std::equal(root.begin(), root.end(), hash.expected);
+}
+
+class HashPool;
+
+// One piece being verified. The downloading thread reports how many leading bytes
+// of data are in place; whoever hashes (a pool thread, or the caller without a pool)
+// absorbs them and calls on_complete exactly once after finish().
+// Create it with std::make_shared, queued work keeps it alive.
+class PieceHashJob : public std::enable_shared_from_this<PieceHashJob> {
+public:
+    PieceHashJob(size_t piece_index, const uint8_t* piece_data, size_t piece_length,
+                 const PieceHash& expected_hash, HashPool* hash_pool = nullptr)
+        : piece(piece_index), data(piece_data), length(piece_length), merkle_leaves(expected_hash.merkle_leaves),
+          expected(expected_hash.expected, expected_hash.expected + (merkle_leaves ? 32 : 20)), pool(hash_pool) {
+        leaves.reserve(merkle_leaves);
+    }
+
+    // the first bytes of data are received and won't change again
+    void bytes_ready(size_t bytes);
+
+    // every byte is in, verify once the hash caught up
+    void finish();
+
+    const size_t piece;
+    // runs on the hashing thread with the verification result
+    std::function<void(bool ok)> on_complete;
+
+private:
+    friend class HashPool;
+
+    void advance() {
+        TRACE_SPAN_ARG("hash", piece);
+        std::unique_lock<std::mutex> lock(mutex);
+        size_t ready = std::min(ready_bytes.load(std::memory_order_acquire), length);
+        if (merkle_leaves && ready < length) {
+            // leaves are whole 16 KiB blocks, only the last one of the piece is shorter
+            ready -= ready % MERKLE_BLOCK_SIZE;
+        }
+        if (ready > hashed_bytes) {
+            if (merkle_leaves) {
+                std::vector<Sha256Digest> hashed = hash_blocks(data + hashed_bytes, ready - hashed_bytes);
+                leaves.insert(leaves.end(), hashed.begin(), hashed.end());
+            } else {
+                sha1.update(data + hashed_bytes, ready - hashed_bytes);
+            }
+            hashed_bytes = ready;
+        }
+        if (completed || !finished.load(std::memory_order_acquire) || hashed_bytes < length) {
+            return;
+        }
+        completed = true;
+        bool ok;
+        if (merkle_leaves) {
+            Sha256Digest root = merkle_root(std::move(leaves), merkle_leaves);
+            ok = std::equal(root.begin(), root.end(), expected.begin());
+        } else {
+            ok = hex_to_bytes(sha1.final()) == expected;
+        }
+        lock.unlock();
+        if (on_complete) {
+            on_complete(ok);
+        }
+    }
+
+    const uint8_t* data;
+    const size_t length;
+    const size_t merkle_leaves;
+    const std::vector<uint8_t> expected;
+    HashPool* pool;
+
+    std::atomic<size_t> ready_bytes{0};
+    std::atomic<bool> finished{false};
+
+    std::mutex mutex; // held while hashing
+    SHA1 sha1;
+    std::vector<Sha256Digest> leaves;
+    size_t hashed_bytes = 0;
+    bool completed = false;
+};
+
+// Hasher threads, one per core by default. Network threads hand over work and move on.
+class HashPool {
+public:
+    static size_t default_thread_count() { return std::max(1u, std::thread::hardware_concurrency()); }
+
+    explicit HashPool(size_t threads = default_thread_count())
+        : queue(QUEUE_CAPACITY) {
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this] { run(); });
+        }
+    }
+
+    // pending work is finished before the threads exit
+    ~HashPool() {
+        stopping.store(true, std::memory_order_release);
+        pending.release(static_cast<std::ptrdiff_t>(workers.size()));
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    HashPool(const HashPool&) = delete;
+    HashPool& operator=(const HashPool&) = delete;
+
+    void submit(std::shared_ptr<PieceHashJob> job) {
+        while (!queue.try_push(job)) {
+            // only when thousands of hash steps are queued, the hashers are about to free a slot
+            std::this_thread::yield();
+        }
+        client_metrics().hash_queue_depth.add(1);
+        pending.release();
+    }
+
+    size_t thread_count() const { return workers.size(); }
+
+private:
+    static constexpr size_t QUEUE_CAPACITY = 4096;
+
+    void run() {
+        TRACE_THREAD_NAME("hasher");
+        while (true) {
+            pending.acquire();
+            std::shared_ptr<PieceHashJob> job;
+            // a permit means an entry is queued, it may still be half written by its producer
+            while (!queue.try_pop(job)) {
+                if (stopping.load(std::memory_order_acquire)) {
+                    return;
+                }
+                std::this_thread::yield();
+            }
+            client_metrics().hash_queue_depth.add(-1);
+            job->advance();
+        }
+    }
+
+    MpmcQueue<std::shared_ptr<PieceHashJob>> queue;
+    std::counting_semaphore<> pending{0};
+    std::atomic<bool> stopping{false};
+    std::vector<std::thread> workers;
+};
+
+inline void PieceHashJob::bytes_ready(size_t bytes) {
+    if (bytes <= ready_bytes.load(std::memory_order_relaxed)) {
+        return;
+    }
+    ready_bytes.store(bytes, std::memory_order_release);
+    if (pool) {
+        pool->submit(shared_from_this());
+    } else {
+        advance();
+    }
+}
+
+inline void PieceHashJob::finish() {
+    finished.store(true, std::memory_order_release);
+    if (pool) {
+        pool->submit(shared_from_this());
+    } else {
+        advance();
+    }
+}
+
+#endif
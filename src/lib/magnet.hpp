@@ -0,0 +1,414 @@
+#ifndef MAGNET_HPP
+#define MAGNET_HPP
+
+// this file contains magnet link parsing and the metadata exchange (BEP 9) that turns
+// a magnet link into the info dictionary of a regular torrent
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "dht.hpp"
+#include "extension.hpp"
+#include "peers.hpp"
+
+const size_t METADATA_PIECE_SIZE = 16 * 1024;
+const int64_t MAX_METADATA_SIZE = 64 * 1024 * 1024;
+const size_t MAX_METADATA_PEERS = 8; // peers we fetch metadata from at the same time
+const int MAX_METADATA_ATTEMPTS = 4;  // assemblies that may fail the info hash before we give up
+
+// contents of a magnet:? URI
+struct MagnetLink {
+    std::vector<uint8_t> info_hash;
+    std::string name;                  // dn
+    std::vector<std::string> trackers; // tr
+    std::vector<PeerAddress> peers;    // x.pe
+};
+
+// Function to undo %XX and + escaping in a URI component
+inline std::string url_decode(const std::string& value) {
+    std::string out;
+    out.reserve(value.size());
+    for (size_t i = 0; i < value.size(); ++i) {
+        if (value[i] == '%' && i + 2 < value.size()) {
+            out.push_back(static_cast<char>(std::stoi(value.substr(i + 1, 2), nullptr, 16)));
+            i += 2;
+        } else if (value[i] == '+') {
+            out.push_back(' ');
+        } else {
+            out.push_back(value[i]);
+        }
+    }
+    return out;
+}
+
+// Function to decode a 32 character base32 info hash
+inline std::vector<uint8_t> base32_to_bytes(const std::string& value) {
+    std::vector<uint8_t> bytes;
+    uint32_t buffer = 0;
+    int bits = 0;
+    for (char c : value) {
+        int v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a';
+        else if (c >= '2' && c <= '7') v = c - '2' + 26;
+        else throw std::runtime_error("Invalid base32 character in info hash");
+        buffer = (buffer << 5) | static_cast<uint32_t>(v);
+        bits += 5;
+        if (bits >= 8) {
+            bits -= 8;
+            bytes.push_back(static_cast<uint8_t>(buffer >> bits));
+        }
+    }
+    return bytes;
+}
+
+// parse magnet:?xt=urn:btih:<hash>&dn=<name>&tr=<tracker>...
+inline MagnetLink parse_magnet_link(const std::string& uri) {
+    const std::string prefix = "magnet:?";
+    if (uri.compare(0, prefix.size(), prefix) != 0) {
+        throw std::runtime_error("Not a magnet link: " + uri);
+    }
+    MagnetLink magnet;
+    size_t pos = prefix.size();
+    while (pos < uri.size()) {
+        size_t end = uri.find('&', pos);
+        if (end == std::string::npos) {
+            end = uri.size();
+        }
+        std::string param = uri.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t eq = param.find('=');
+        if (eq == std::string::npos) {
+            continue;
+        }
+        std::string key = param.substr(0, eq);
+        std::string value = url_decode(param.substr(eq + 1));
+
+        if (key == "xt" && value.compare(0, 9, "urn:btih:") == 0) {
+            std::string hash = value.substr(9);
+            if (hash.size() == 40) {
+                magnet.info_hash = hex_to_bytes(hash);
+            } else if (hash.size() == 32) {
+                magnet.info_hash = base32_to_bytes(hash);
+            } else {
+                throw std::runtime_error("Invalid info hash in magnet link");
+            }
+        } else if (key == "dn") {
+            magnet.name = value;
+        } else if (key == "tr") {
+            magnet.trackers.push_back(value);
+        } else if (key == "x.pe") {
+            size_t colon = value.rfind(':');
+            if (colon != std::string::npos) {
+                magnet.peers.push_back({value.substr(0, colon), static_cast<uint16_t>(std::stoi(value.substr(colon + 1)))});
+            }
+        }
+    }
+    if (magnet.info_hash.size() != 20) {
+        throw std::runtime_error("Magnet link has no BitTorrent info hash");
+    }
+    return magnet;
+}
+
+// Collects the metadata pieces fetched by several peers at once.
+// Peers claim pieces nobody asked for yet; once those run out they also
+// ask for pieces that are still outstanding elsewhere so one slow peer can't stall us.
+// Each piece remembers the peer it came from: when the assembled metadata fails the info
+// hash, those peers (and the one whose size was used) aren't asked again, and after
+// MAX_METADATA_ATTEMPTS failed assemblies the fetch gives up.
+class MetadataAssembler {
+public:
+    explicit MetadataAssembler(const std::vector<uint8_t>& hash) : info_hash(hash) {}
+
+    // first peer to report a size decides it, false if the peer disagrees
+    bool set_size(const PeerAddress& peer, int64_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (size <= 0 || size > MAX_METADATA_SIZE) {
+            return false;
+        }
+        if (total_size == 0) {
+            total_size = static_cast<size_t>(size);
+            size_source = peer_key(peer);
+            size_t count = (total_size + METADATA_PIECE_SIZE - 1) / METADATA_PIECE_SIZE;
+            pieces.assign(count, std::string());
+            sources.assign(count, std::string());
+            state.assign(count, Missing);
+        }
+        return total_size == static_cast<size_t>(size);
+    }
+
+    // index of the next piece to request from peer, -1 when there's nothing left for it
+    int claim_piece(const PeerAddress& peer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failed || distrusted.count(peer_key(peer))) {
+            return -1;
+        }
+        for (size_t i = 0; i < state.size(); ++i) {
+            if (state[i] == Missing) {
+                state[i] = Requested;
+                return static_cast<int>(i);
+            }
+        }
+        for (size_t i = 0; i < state.size(); ++i) {
+            if (state[i] == Requested) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    // the peer rejected the request or went away
+    void release_piece(int index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index >= 0 && static_cast<size_t>(index) < state.size() && state[index] == Requested) {
+            state[index] = Missing;
+        }
+    }
+
+    void deliver_piece(const PeerAddress& peer, int index, std::string data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (index < 0 || static_cast<size_t>(index) >= state.size() || state[index] == Have) {
+            return;
+        }
+        size_t expected = std::min(METADATA_PIECE_SIZE, total_size - index * METADATA_PIECE_SIZE);
+        if (data.size() != expected) {
+            state[index] = Missing;
+            return;
+        }
+        pieces[index] = std::move(data);
+        sources[index] = peer_key(peer);
+        state[index] = Have;
+        if (std::all_of(state.begin(), state.end(), [](PieceState s) { return s == Have; })) {
+            verify();
+        }
+    }
+
+    bool complete() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return done;
+    }
+
+    // true once too many assemblies failed the info hash
+    bool gave_up() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return failed;
+    }
+
+    std::string metadata() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return assembled;
+    }
+
+private:
+    enum PieceState { Missing, Requested, Have };
+
+    // called with the lock held once every piece is in
+    void verify() {
+        std::string data;
+        data.reserve(total_size);
+        for (const std::string& piece : pieces) {
+            data += piece;
+        }
+        SHA1 sha1;
+        sha1.update(data);
+        if (hex_to_bytes(sha1.final()) == info_hash) {
+            assembled = std::move(data);
+            done = true;
+            return;
+        }
+        // some peer sent garbage, and there's no telling which, so none of them is asked again
+        distrusted.insert(sources.begin(), sources.end());
+        distrusted.insert(size_source);
+        if (++failed_attempts >= MAX_METADATA_ATTEMPTS) {
+            std::cerr << "Metadata does not match the info hash, giving up" << std::endl;
+            failed = true;
+            return;
+        }
+        std::cerr << "Metadata does not match the info hash, fetching again from other peers" << std::endl;
+        // the size may have been the lie, the next peer to report one decides it again
+        total_size = 0;
+        pieces.clear();
+        sources.clear();
+        state.clear();
+    }
+
+    std::vector<uint8_t> info_hash;
+    mutable std::mutex mutex;
+    size_t total_size = 0;
+    std::vector<std::string> pieces;
+    std::vector<PieceState> state;
+    std::vector<std::string> sources; // the peer each piece came from
+    std::string size_source;          // the peer whose size was used
+    std::set<std::string> distrusted; // peers behind an assembly that failed the hash
+    int failed_attempts = 0;
+    bool failed = false;
+    std::string assembled;
+    bool done = false;
+};
+
+// Function to fetch metadata pieces from one peer until the assembler is complete
+inline void fetch_metadata_from_peer(const PeerAddress& peer, const std::vector<uint8_t>& info_hash, MetadataAssembler& assembler) {
+    WSAInitializer wsa;
+    socket_t sock = connect_to_peer(peer.ip, peer.port);
+    set_socket_timeout(sock, 10);
+    HandshakeResult result = exchange_handshake(sock, info_hash);
+    if (!result.supports_extensions()) {
+        CLOSE_SOCKET(sock);
+        throw std::runtime_error("Peer does not support the extension protocol");
+    }
+    send_extended_handshake(sock);
+
+    int piece = -1;
+    try {
+        // wait for the peer's extended handshake, skipping bitfield/have and friends
+        ExtendedHandshake handshake;
+        while (true) {
+            PeerMessage msg = read_peer_message(sock);
+            if (msg.id == EXTENDED_MESSAGE_ID && !msg.payload.empty() && msg.payload[0] == EXTENDED_HANDSHAKE_ID) {
+                handshake = parse_extended_handshake(msg.payload);
+                break;
+            }
+        }
+        uint8_t peer_metadata_id = handshake.id_for("ut_metadata");
+        if (peer_metadata_id == 0) {
+            throw std::runtime_error("Peer can't serve metadata");
+        }
+
+        while (!assembler.complete()) {
+            // checked on every piece, a failed assembly starts over with a new size
+            if (!assembler.set_size(peer, handshake.metadata_size)) {
+                throw std::runtime_error("Peer can't serve metadata");
+            }
+            if ((piece = assembler.claim_piece(peer)) < 0) {
+                break;
+            }
+            json request = {{"msg_type", 0}, {"piece", piece}};
+            send_extended_message(sock, peer_metadata_id, bencode_decoded_value(request));
+
+            // answers come back with the id we put in our handshake
+            PeerMessage msg;
+            do {
+                msg = read_peer_message(sock);
+            } while (msg.id != EXTENDED_MESSAGE_ID || msg.payload.empty() || msg.payload[0] != UT_METADATA_ID);
+
+            // a bencoded dict followed by the raw piece data
+            std::string payload(msg.payload.begin() + 1, msg.payload.end());
+            auto it = payload.cbegin();
+            json header = decode_bencoded_value(it, payload.cend());
+            int64_t msg_type = header.at("msg_type").get<int64_t>();
+            if (msg_type != 1 || header.at("piece").get<int64_t>() != piece) {
+                throw std::runtime_error("Peer rejected metadata request");
+            }
+            assembler.deliver_piece(peer, piece, std::string(it, payload.cend()));
+            piece = -1;
+        }
+    } catch (...) {
+        assembler.release_piece(piece);
+        CLOSE_SOCKET(sock);
+        throw;
+    }
+    CLOSE_SOCKET(sock);
+}
+
+// Function to download the info dictionary from several peers in parallel
+inline std::string fetch_metadata(const MagnetLink& magnet, const std::vector<PeerAddress>& peers) {
+    MetadataAssembler assembler(magnet.info_hash);
+    std::atomic<size_t> next_peer{0};
+
+    auto worker = [&]() {
+        size_t index;
+        while (!assembler.complete() && !assembler.gave_up() && (index = next_peer++) < peers.size()) {
+            try {
+                fetch_metadata_from_peer(peers[index], magnet.info_hash, assembler);
+            } catch (const std::exception&) {
+                // try the next peer
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < std::min(MAX_METADATA_PEERS, peers.size()); ++i) {
+        workers.emplace_back(worker);
+    }
+    for (std::thread& t : workers) {
+        t.join();
+    }
+
+    if (assembler.gave_up()) {
+        throw std::runtime_error("Metadata from peers does not match the info hash");
+    }
+    if (!assembler.complete()) {
+        throw std::runtime_error("Failed to fetch metadata from any peer");
+    }
+    return assembler.metadata();
+}
+
+// Function to find peers for a magnet link: its trackers, its x.pe peers, then the DHT
+inline std::vector<PeerAddress> find_magnet_peers(const MagnetLink& magnet) {
+    std::vector<PeerAddress> peers = magnet.peers;
+    for (const std::string& tracker : magnet.trackers) {
+        try {
+            // the size is unknown until the metadata arrives, so report something left to download
+            std::vector<PeerAddress> found = request_tracker_peers(tracker, magnet.info_hash, 1);
+            peers.insert(peers.end(), found.begin(), found.end());
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+    if (peers.empty()) {
+        peers = dht_find_peers(magnet.info_hash);
+    }
+    if (peers.empty()) {
+        throw std::runtime_error("No peers found for magnet link");
+    }
+    return peers;
+}
+
+// a magnet link turned into a torrent, with the peers found on the way: its x.pe peers,
+// what every tracker answered, or the DHT's, so the download needn't look them up again
+struct ResolvedMagnet {
+    std::string torrent; // bencoded torrent file contents
+    std::vector<PeerAddress> peers;
+};
+
+// Function to turn a magnet link into bencoded torrent file contents and its peers
+inline ResolvedMagnet resolve_magnet_link(const std::string& uri) {
+    MagnetLink magnet = parse_magnet_link(uri);
+    ResolvedMagnet resolved;
+    resolved.peers = find_magnet_peers(magnet);
+    std::string metadata = fetch_metadata(magnet, resolved.peers);
+
+    // keys of a bencoded dict are sorted: announce, announce-list, info. Every tracker
+    // is kept, each its own tier (BEP 12), the first one is also the announce URL
+    auto bencode_string = [](const std::string& value) { return std::to_string(value.size()) + ":" + value; };
+    resolved.torrent = "d";
+    if (!magnet.trackers.empty()) {
+        resolved.torrent += "8:announce" + bencode_string(magnet.trackers.front());
+        resolved.torrent += "13:announce-listl";
+        for (const std::string& tracker : magnet.trackers) {
+            resolved.torrent += "l" + bencode_string(tracker) + "e";
+        }
+        resolved.torrent += "e";
+    }
+    resolved.torrent += "4:info" + metadata + "e";
+    return resolved;
+}
+
+// read a .torrent file, or fetch the metadata if given a magnet link
+inline ResolvedMagnet load_torrent_and_peers(const std::string& source) {
+    if (source.compare(0, 7, "magnet:") == 0) {
+        return resolve_magnet_link(source);
+    }
+    return {read_file(source), {}};
+}
+
+// the same when only the torrent is wanted
+inline std::string load_torrent(const std::string& source) {
+    return load_torrent_and_peers(source).torrent;
+}
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef MERKLE_HPP
+#define MERKLE_HPP
+
+// this file contains the BitTorrent v2 (BEP 52) merkle trees: every file is hashed as a
+// binary SHA-256 tree over 16 KiB blocks, and the pieces root in the torrent is its root
+
+#include <algorithm>
+#include <bit>
+#include <stdexcept>
+#include <vector>
+#include "sha256.hpp"
+#include "torrent.hpp"
+
+// size of a merkle leaf, the last block of a file may be shorter
+const size_t MERKLE_BLOCK_SIZE = 16 * 1024;
+
+inline Sha256Digest hash_pair(const Sha256Digest& left, const Sha256Digest& right) {
+    uint8_t pair[64];
+    memcpy(pair, left.data(), 32);
+    memcpy(pair + 32, right.data(), 32);
+    return SHA256::hash(pair, sizeof(pair));
+}
+
+// Root of a tree with leaf_count leaves (a power of two), the given leaves first and
+// pad after them. Leaves past the end of a file are zero hashes; one layer up the
+// padding is the hash of two pads and so on, so it is never hashed more than once a layer.
+inline Sha256Digest merkle_root(std::vector<Sha256Digest> layer, size_t leaf_count, Sha256Digest pad = {}) {
+    if (layer.size() > leaf_count || !std::has_single_bit(leaf_count)) {
+        throw std::runtime_error("Invalid merkle tree size");
+    }
+    if (layer.empty()) {
+        layer.push_back(pad);
+    }
+    for (size_t width = leaf_count; width > 1; width /= 2) {
+        if (layer.size() % 2) {
+            layer.push_back(pad);
+        }
+        for (size_t i = 0; i < layer.size() / 2; ++i) {
+            layer[i] = hash_pair(layer[2 * i], layer[2 * i + 1]);
+        }
+        layer.resize(layer.size() / 2);
+        pad = hash_pair(pad, pad);
+    }
+    return layer[0];
+}
+
+// leaf hashes of the 16 KiB blocks of data, the full blocks are hashed together
+inline std::vector<Sha256Digest> hash_blocks(const uint8_t* data, size_t length) {
+    size_t full_blocks = length / MERKLE_BLOCK_SIZE;
+    std::vector<Sha256Digest> leaves(full_blocks + (length % MERKLE_BLOCK_SIZE != 0));
+    std::vector<const uint8_t*> blocks(full_blocks);
+    for (size_t i = 0; i < full_blocks; ++i) {
+        blocks[i] = data + i * MERKLE_BLOCK_SIZE;
+    }
+    sha256_many(blocks.data(), full_blocks, MERKLE_BLOCK_SIZE, leaves.data());
+    if (length % MERKLE_BLOCK_SIZE) {
+        leaves.back() = SHA256::hash(data + full_blocks * MERKLE_BLOCK_SIZE, length % MERKLE_BLOCK_SIZE);
+    }
+    return leaves;
+}
+
+// leaves per piece in the tree of a file, plength is a power of two of at least 16 KiB
+inline size_t blocks_per_piece(const Info& info) {
+    return static_cast<size_t>(info.plength) / MERKLE_BLOCK_SIZE;
+}
+
+// Check a file's piece layer against its pieces root. The layer is padded with
+// the root of an all zero piece up to the next power of two.
+inline bool verify_piece_layer(const Info& info, const std::vector<uint8_t>& layer, const std::vector<uint8_t>& pieces_root) {
+    std::vector<Sha256Digest> nodes(layer.size() / 32);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        memcpy(nodes[i].data(), layer.data() + i * 32, 32);
+    }
+    Sha256Digest zero_piece = merkle_root({}, blocks_per_piece(info));
+    Sha256Digest root = merkle_root(nodes, std::bit_ceil(std::max<size_t>(nodes.size(), 1)), zero_piece);
+    return std::equal(root.begin(), root.end(), pieces_root.begin(), pieces_root.end());
+}
+
+#endif
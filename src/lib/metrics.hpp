@@ -0,0 +1,266 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+// this file contains the metrics registry: lock-free counters, gauges and histograms
+// updated from the download path, rendered in the Prometheus text exposition format
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// label name and value pairs of one series, e.g. {{"peer", "1.2.3.4:6881"}}
+using MetricLabels = std::vector<std::pair<std::string, std::string>>;
+
+// One series. Updates are single relaxed atomic operations, each metric sits on a cache
+// line of its own so threads updating different metrics don't slow each other down.
+class alignas(64) Metric {
+public:
+    virtual ~Metric() = default;
+    // append the sample lines of this series, labels is the rendered {...} part or empty
+    virtual void render(std::string& out, const std::string& name, const std::string& labels) const = 0;
+};
+
+// monotonically increasing count
+class Counter : public Metric {
+public:
+    void add(uint64_t amount = 1) { count.fetch_add(amount, std::memory_order_relaxed); }
+    uint64_t value() const { return count.load(std::memory_order_relaxed); }
+
+    void render(std::string& out, const std::string& name, const std::string& labels) const override {
+        out += name + labels + " " + std::to_string(value()) + "\n";
+    }
+
+private:
+    std::atomic<uint64_t> count{0};
+};
+
+// value that goes up and down, like a queue depth
+class Gauge : public Metric {
+public:
+    void add(int64_t amount) { current.fetch_add(amount, std::memory_order_relaxed); }
+    void set(int64_t value) { current.store(value, std::memory_order_relaxed); }
+    int64_t value() const { return current.load(std::memory_order_relaxed); }
+
+    void render(std::string& out, const std::string& name, const std::string& labels) const override {
+        out += name + labels + " " + std::to_string(value()) + "\n";
+    }
+
+private:
+    std::atomic<int64_t> current{0};
+};
+
+// Distribution over fixed bucket upper bounds. Observations land in one bucket,
+// the cumulative counts Prometheus expects are summed up when rendering.
+class Histogram : public Metric {
+public:
+    explicit Histogram(std::vector<double> upper_bounds)
+        : bounds(std::move(upper_bounds)), buckets(new std::atomic<uint64_t>[bounds.size() + 1]) {
+        for (size_t i = 0; i <= bounds.size(); ++i) {
+            buckets[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void observe(double value) {
+        size_t bucket = 0;
+        while (bucket < bounds.size() && value > bounds[bucket]) {
+            ++bucket;
+        }
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void render(std::string& out, const std::string& name, const std::string& labels) const override {
+        // le goes after the series' own labels
+        std::string prefix = labels.empty() ? "{" : labels.substr(0, labels.size() - 1) + ",";
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i <= bounds.size(); ++i) {
+            cumulative += buckets[i].load(std::memory_order_relaxed);
+            std::string le = i < bounds.size() ? format_bound(bounds[i]) : "+Inf";
+            out += name + "_bucket" + prefix + "le=\"" + le + "\"} " + std::to_string(cumulative) + "\n";
+        }
+        out += name + "_sum" + labels + " " + std::to_string(sum.load(std::memory_order_relaxed)) + "\n";
+        out += name + "_count" + labels + " " + std::to_string(cumulative) + "\n";
+    }
+
+private:
+    static std::string format_bound(double bound) {
+        std::string text = std::to_string(bound);
+        text.erase(text.find_last_not_of('0') + 1);
+        if (text.back() == '.') {
+            text.pop_back();
+        }
+        return text;
+    }
+
+    std::vector<double> bounds;
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets; // one past the last bound for +Inf
+    std::atomic<double> sum{0};
+};
+
+// Every metric of the process by name and labels. Looking a series up takes a lock,
+// so callers on hot paths look it up once and keep the reference, which stays valid
+// for the life of the registry or until every user of the series released it.
+class MetricsRegistry {
+public:
+    Counter& counter(const std::string& name, const std::string& help, const MetricLabels& labels = {}) {
+        return get<Counter>(name, help, "counter", labels, [] { return std::make_unique<Counter>(); });
+    }
+
+    Gauge& gauge(const std::string& name, const std::string& help, const MetricLabels& labels = {}) {
+        return get<Gauge>(name, help, "gauge", labels, [] { return std::make_unique<Gauge>(); });
+    }
+
+    Histogram& histogram(const std::string& name, const std::string& help, const std::vector<double>& upper_bounds,
+                         const MetricLabels& labels = {}) {
+        return get<Histogram>(name, help, "histogram", labels,
+                              [&] { return std::make_unique<Histogram>(upper_bounds); });
+    }
+
+    // Function to give back a series looked up for something short lived, like a peer.
+    // It goes away with its last user so the registry doesn't grow with every peer ever seen.
+    void release(const std::string& name, const MetricLabels& labels) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto family = families.find(name);
+        if (family == families.end()) {
+            return;
+        }
+        auto series = family->second.series.find(render_labels(labels));
+        if (series != family->second.series.end() && --series->second.users == 0) {
+            family->second.series.erase(series);
+        }
+    }
+
+    // Function to render every metric in the Prometheus text exposition format
+    std::string render() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string out;
+        for (const auto& [name, family] : families) {
+            out += "# HELP " + name + " " + family.help + "\n";
+            out += "# TYPE " + name + " " + family.type + "\n";
+            for (const auto& [labels, series] : family.series) {
+                series.metric->render(out, name, labels);
+            }
+        }
+        return out;
+    }
+
+private:
+    struct Series {
+        std::unique_ptr<Metric> metric;
+        size_t users = 0; // lookups not released yet
+    };
+
+    struct Family {
+        std::string help;
+        std::string type;
+        std::map<std::string, Series> series; // by rendered labels
+    };
+
+    static std::string render_labels(const MetricLabels& labels) {
+        if (labels.empty()) {
+            return "";
+        }
+        std::string out = "{";
+        for (const auto& [name, value] : labels) {
+            if (out.size() > 1) {
+                out += ",";
+            }
+            out += name + "=\"";
+            for (char c : value) {
+                if (c == '\\' || c == '"') {
+                    out += '\\';
+                    out += c;
+                } else if (c == '\n') {
+                    out += "\\n";
+                } else {
+                    out += c;
+                }
+            }
+            out += "\"";
+        }
+        return out + "}";
+    }
+
+    template <typename T, typename Make>
+    T& get(const std::string& name, const std::string& help, const std::string& type, const MetricLabels& labels,
+           Make make) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Family& family = families[name];
+        if (family.type.empty()) {
+            family.help = help;
+            family.type = type;
+        } else if (family.type != type) {
+            throw std::runtime_error("Metric " + name + " is already registered as a " + family.type);
+        }
+        Series& series = family.series[render_labels(labels)];
+        if (!series.metric) {
+            series.metric = make();
+        }
+        ++series.users;
+        return static_cast<T&>(*series.metric);
+    }
+
+    mutable std::mutex mutex;
+    std::map<std::string, Family> families;
+};
+
+// the registry every part of the client reports to
+inline MetricsRegistry& metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+// The client's own metrics, registered on first use. Per peer series are registered
+// by PeerConnection since their labels are only known once connected.
+struct ClientMetrics {
+    Counter& hash_failures = metrics().counter("bittorrent_hash_failures_total", "Pieces that failed hash verification");
+    Gauge& blocks_in_flight = metrics().gauge("bittorrent_blocks_in_flight", "Block requests sent and not answered yet");
+    Histogram& request_rtt = metrics().histogram("bittorrent_request_rtt_seconds",
+        "Time from sending a block request to receiving the block",
+        {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10});
+    Gauge& disk_queue_depth = metrics().gauge("bittorrent_disk_queue_depth", "Verified pieces being written to disk");
+    Gauge& hash_queue_depth = metrics().gauge("bittorrent_hash_queue_depth", "Hash steps queued for the hasher threads");
+    Counter& recv_calls = syscall_counter("recv");
+    Counter& send_calls = syscall_counter("send");
+    Counter& connect_calls = syscall_counter("connect");
+    Counter& pread_calls = syscall_counter("pread");
+    Counter& pwrite_calls = syscall_counter("pwritev");
+
+private:
+    static Counter& syscall_counter(const std::string& call) {
+        return metrics().counter("bittorrent_syscalls_total", "System calls made by the client", {{"call", call}});
+    }
+};
+
+inline ClientMetrics& client_metrics() {
+    static ClientMetrics client;
+    return client;
+}
+
+// A user's part of a gauge, set as often as needed and taken back out when the user
+// goes away, so the gauge stays right when the user leaves early through an exception
+class GaugeShare {
+public:
+    explicit GaugeShare(Gauge& gauge) : gauge(gauge) {}
+    ~GaugeShare() { gauge.add(-value); }
+
+    GaugeShare(const GaugeShare&) = delete;
+    GaugeShare& operator=(const GaugeShare&) = delete;
+
+    void set(int64_t new_value) {
+        gauge.add(new_value - value);
+        value = new_value;
+    }
+
+private:
+    Gauge& gauge;
+    int64_t value = 0;
+};
+
+#endif
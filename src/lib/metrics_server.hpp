@@ -0,0 +1,112 @@
+#ifndef METRICS_SERVER_HPP
+#define METRICS_SERVER_HPP
+
+// this file contains the metrics endpoint: a small HTTP server on a thread of its own
+// that answers GET /metrics with the registry in the Prometheus text format
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include "metrics.hpp"
+#include "peers.hpp"
+#include "reactor.hpp"
+
+class MetricsServer {
+public:
+    // listen on address, "port" or "host:port", the host defaults to 127.0.0.1
+    explicit MetricsServer(const std::string& address, MetricsRegistry& registry = metrics()) : registry(registry) {
+        std::string host = "127.0.0.1";
+        std::string port = address;
+        size_t colon = address.rfind(':');
+        if (colon != std::string::npos) {
+            host = address.substr(0, colon);
+            port = address.substr(colon + 1);
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(std::stoi(port)));
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+            throw std::runtime_error("Invalid metrics address: " + address);
+        }
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        if (listener == INVALID_SOCKET_VALUE) {
+            throw std::runtime_error("Failed to create socket");
+        }
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+        if (bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR_VALUE ||
+            listen(listener, 16) == SOCKET_ERROR_VALUE) {
+            CLOSE_SOCKET(listener);
+            throw std::runtime_error("Failed to listen for metrics on " + address);
+        }
+        worker = std::thread([this]() { run(); });
+    }
+
+    ~MetricsServer() {
+        stopping.store(true);
+        worker.join();
+        CLOSE_SOCKET(listener);
+    }
+
+    MetricsServer(const MetricsServer&) = delete;
+    MetricsServer& operator=(const MetricsServer&) = delete;
+
+    uint16_t port() const {
+        sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+        getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len);
+        return ntohs(addr.sin_port);
+    }
+
+private:
+    void run() {
+        while (!stopping.load()) {
+            // wake up now and then to notice we are being stopped
+            pollfd entry{listener, POLLIN, 0};
+            if (POLL_SOCKETS(&entry, 1, 200) <= 0) {
+                continue;
+            }
+            socket_t client = accept(listener, nullptr, nullptr);
+            if (client == INVALID_SOCKET_VALUE) {
+                continue;
+            }
+            set_socket_timeout(client, 2);
+            answer(client);
+            CLOSE_SOCKET(client);
+        }
+    }
+
+    // one request per connection, scrapers don't need more
+    void answer(socket_t client) {
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+            auto received = recv(client, buffer, sizeof(buffer), 0);
+            if (received <= 0) {
+                return;
+            }
+            request.append(buffer, static_cast<size_t>(received));
+        }
+        std::string status = "200 OK";
+        std::string body;
+        if (request.rfind("GET /metrics ", 0) == 0 || request.rfind("GET / ", 0) == 0) {
+            body = registry.render();
+        } else {
+            status = "404 Not Found";
+            body = "Not found, metrics are at /metrics\n";
+        }
+        std::string response = "HTTP/1.1 " + status + "\r\n"
+                               "Content-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                               "Connection: close\r\n\r\n" + body;
+        send_all(client, reinterpret_cast<const uint8_t*>(response.data()), response.size());
+    }
+
+    MetricsRegistry& registry;
+    socket_t listener;
+    std::atomic<bool> stopping{false};
+    std::thread worker;
+};
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef PEER_CACHE_HPP
+#define PEER_CACHE_HPP
+
+// this file contains the peer cache: what we learned about the peers of each torrent
+// (when we last dealt with them, how fast they delivered, failed connects, bans) kept in a
+// memory-mapped file so the next run, or a resume, starts with the peers that worked.
+// The file is a fixed table of records, each torrent's peers in a group of GROUP_SIZE
+// slots picked by its info hash, so looking a torrent up touches two pages and opening
+// the file reads nothing at all. Torrents whose hashes land in the same group share its
+// slots, so a session of many torrents wants a larger table than the default.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+    #include <winsock2.h>
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// one peer of one torrent as the cache remembers it
+struct CachedPeer {
+    std::string ip;
+    uint16_t port;
+    int64_t last_seen;        // unix seconds
+    int64_t throughput;       // bytes per second it delivered last time, 0 if unknown or it stalled
+    std::chrono::microseconds connect_time;
+    uint32_t failures;        // failed connects since the last one that worked
+    uint32_t successes;
+    bool banned;              // sent corrupt data for this torrent
+};
+
+class PeerCache {
+public:
+    static constexpr size_t GROUP_SIZE = 64;
+    // peers the table holds unless asked for another size, about 900 KB on disk
+    static constexpr size_t DEFAULT_CAPACITY = 128 * GROUP_SIZE;
+    // 2^20 groups of GROUP_SIZE is 7.5 GB of file, far beyond any sensible cache
+    static constexpr size_t MAX_CAPACITY = (size_t{1} << 20) * GROUP_SIZE;
+    // peers not heard of for this long are forgotten
+    static constexpr int64_t MAX_AGE_SECONDS = 30 * 24 * 3600;
+
+    // Opens the cache at path, creating it (and its directory) if needed, with room for
+    // capacity peers rounded up to whole groups. A file of another layout or size is started over.
+    explicit PeerCache(const std::string& path, size_t capacity = DEFAULT_CAPACITY)
+        : groups(std::max<size_t>((std::min(capacity, MAX_CAPACITY) + GROUP_SIZE - 1) / GROUP_SIZE, 1)),
+          file_size(sizeof(Header) + groups * GROUP_SIZE * sizeof(Record)) {
+        std::filesystem::path file(path);
+        if (file.has_parent_path()) {
+            std::filesystem::create_directories(file.parent_path());
+        }
+        map_file(path);
+        if (!current_layout(*header)) {
+            // a new file is all holes, clearing it would only fault in every page
+            Header blank{};
+            if (memcmp(header, &blank, sizeof(blank)) != 0) {
+                memset(static_cast<void*>(header), 0, file_size);
+            }
+            memcpy(header->magic, MAGIC, sizeof(header->magic));
+            header->version = VERSION;
+            header->groups = static_cast<uint32_t>(groups);
+            header->group_size = GROUP_SIZE;
+        }
+        records = reinterpret_cast<Record*>(header + 1);
+    }
+
+    ~PeerCache() {
+#ifdef _WIN32
+        UnmapViewOfFile(header);
+        CloseHandle(mapping);
+        CloseHandle(file_handle);
+#else
+        munmap(header, file_size);
+#endif
+    }
+
+    PeerCache(const PeerCache&) = delete;
+    PeerCache& operator=(const PeerCache&) = delete;
+
+    size_t capacity() const { return groups * GROUP_SIZE; }
+
+    // Function to list the remembered peers of a torrent
+    std::vector<CachedPeer> peers(const std::vector<uint8_t>& info_hash) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        int64_t now = unix_now();
+        std::vector<CachedPeer> found;
+        const Record* group = records + group_index(info_hash) * GROUP_SIZE;
+        for (size_t i = 0; i < GROUP_SIZE; ++i) {
+            const Record& record = group[i];
+            if (!in_use(record, now) || !same_torrent(record, info_hash)) {
+                continue;
+            }
+            found.push_back({std::string(record.ip, strnlen(record.ip, sizeof(record.ip))), record.port,
+                             record.last_seen, record.throughput, std::chrono::microseconds(record.connect_time_us),
+                             record.failures, record.successes, record.banned != 0});
+        }
+        return found;
+    }
+
+    // a connect to the peer went through after connect_time
+    void connected(const std::vector<uint8_t>& info_hash, const std::string& ip, uint16_t port,
+                   std::chrono::microseconds connect_time) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Record& record = find_or_add(info_hash, ip, port, true);
+        int64_t micros = connect_time.count();
+        record.connect_time_us = record.successes == 0 ? micros : (record.connect_time_us * 3 + micros) / 4;
+        ++record.successes;
+        record.failures = 0;
+    }
+
+    void failed(const std::vector<uint8_t>& info_hash, const std::string& ip, uint16_t port) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Record& record = find_or_add(info_hash, ip, port, false);
+        record.failures = std::min<uint32_t>(record.failures + 1, 1000);
+    }
+
+    // the rate the peer delivered at over its last connection, 0 when it stalled
+    void delivered(const std::vector<uint8_t>& info_hash, const std::string& ip, uint16_t port,
+                   int64_t bytes_per_second) {
+        std::lock_guard<std::mutex> lock(mutex);
+        find_or_add(info_hash, ip, port, true).throughput = bytes_per_second;
+    }
+
+    void banned(const std::vector<uint8_t>& info_hash, const std::string& ip, uint16_t port) {
+        std::lock_guard<std::mutex> lock(mutex);
+        find_or_add(info_hash, ip, port, false).banned = 1;
+    }
+
+private:
+    static constexpr char MAGIC[8] = {'B', 'T', 'P', 'E', 'E', 'R', 'S', '\0'};
+    static constexpr uint32_t VERSION = 1;
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t groups;
+        uint32_t group_size;
+        uint32_t reserved;
+    };
+
+    // the on-disk record, port 0 marks a free slot
+    struct Record {
+        uint8_t info_hash[20]; // the first 20 bytes for v2 hashes
+        char ip[46];           // text form, NUL padded
+        uint16_t port;
+        int64_t last_seen;
+        int64_t throughput;
+        int64_t connect_time_us;
+        uint32_t failures;
+        uint32_t successes;
+        uint8_t banned;
+        uint8_t reserved[7];
+    };
+    static_assert(sizeof(Header) == 24 && sizeof(Record) == 112, "the cache file layout must not change");
+
+    bool current_layout(const Header& found) const {
+        return memcmp(found.magic, MAGIC, sizeof(found.magic)) == 0 && found.version == VERSION &&
+               found.groups == groups && found.group_size == GROUP_SIZE;
+    }
+
+    static int64_t unix_now() {
+        return std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    size_t group_index(const std::vector<uint8_t>& info_hash) const {
+        // FNV-1a, info hashes are uniform already but may be short in a corrupt torrent
+        uint64_t hash = 14695981039346656037ull;
+        for (size_t i = 0; i < info_hash.size() && i < 20; ++i) {
+            hash = (hash ^ info_hash[i]) * 1099511628211ull;
+        }
+        return static_cast<size_t>(hash % groups);
+    }
+
+    static bool in_use(const Record& record, int64_t now) {
+        return record.port != 0 && now - record.last_seen < MAX_AGE_SECONDS;
+    }
+
+    static bool same_torrent(const Record& record, const std::vector<uint8_t>& info_hash) {
+        size_t length = std::min<size_t>(info_hash.size(), sizeof(record.info_hash));
+        return memcmp(record.info_hash, info_hash.data(), length) == 0;
+    }
+
+    // Function to find the peer's record, taking a free slot or the least recently seen
+    // one of the torrent's group for a new peer. A new record, or a known one when seen is
+    // set, is marked as seen now. Failures and bans don't count as contact, or a dead peer
+    // would be kept fresh by every run that fails to reach it and never expire.
+    Record& find_or_add(const std::vector<uint8_t>& info_hash, const std::string& ip, uint16_t port, bool seen) {
+        int64_t now = unix_now();
+        Record* group = records + group_index(info_hash) * GROUP_SIZE;
+        Record* victim = &group[0];
+        for (size_t i = 0; i < GROUP_SIZE; ++i) {
+            Record& record = group[i];
+            if (in_use(record, now) && record.port == port && same_torrent(record, info_hash) &&
+                strncmp(record.ip, ip.c_str(), sizeof(record.ip)) == 0) {
+                if (seen) {
+                    record.last_seen = now;
+                }
+                return record;
+            }
+            if (!in_use(record, now)) {
+                if (in_use(*victim, now)) {
+                    victim = &record;
+                }
+            } else if (in_use(*victim, now) && record.last_seen < victim->last_seen) {
+                victim = &record;
+            }
+        }
+        Record& record = *victim;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.info_hash, info_hash.data(), std::min<size_t>(info_hash.size(), sizeof(record.info_hash)));
+        ip.copy(record.ip, std::min(ip.size(), sizeof(record.ip) - 1));
+        record.port = port;
+        record.last_seen = now;
+        return record;
+    }
+
+    void map_file(const std::string& path) {
+#ifdef _WIN32
+        file_handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                                  nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_handle == INVALID_HANDLE_VALUE) {
+            throw std::runtime_error("Failed to open peer cache " + path);
+        }
+        mapping = CreateFileMappingA(file_handle, nullptr, PAGE_READWRITE, static_cast<DWORD>(uint64_t{file_size} >> 32),
+                                     static_cast<DWORD>(file_size), nullptr);
+        void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, file_size) : nullptr;
+        if (!view) {
+            if (mapping) {
+                CloseHandle(mapping);
+            }
+            CloseHandle(file_handle);
+            throw std::runtime_error("Failed to map peer cache " + path);
+        }
+#else
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open peer cache " + path);
+        }
+        // a file of another layout is emptied first, so starting it over doesn't fault in every page
+        Header found{};
+        if (pread(fd, &found, sizeof(found), 0) == static_cast<ssize_t>(sizeof(found)) && !current_layout(found) &&
+            ftruncate(fd, 0) != 0) {
+            close(fd);
+            throw std::runtime_error("Failed to reset peer cache " + path);
+        }
+        struct stat st{};
+        // sized once, the pages of groups never used stay holes
+        if (fstat(fd, &st) != 0 ||
+            (st.st_size != static_cast<off_t>(file_size) && ftruncate(fd, static_cast<off_t>(file_size)) != 0)) {
+            close(fd);
+            throw std::runtime_error("Failed to size peer cache " + path);
+        }
+        void* view = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (view == MAP_FAILED) {
+            throw std::runtime_error("Failed to map peer cache " + path);
+        }
+#endif
+        header = static_cast<Header*>(view);
+    }
+
+    const size_t groups;
+    const size_t file_size;
+    mutable std::mutex mutex;
+    Header* header = nullptr;
+    Record* records = nullptr;
+#ifdef _WIN32
+    HANDLE file_handle = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+// Function to get where the peer cache lives by default, empty if there is no home directory
+inline std::string default_peer_cache_path() {
+#ifdef _WIN32
+    const char* base = std::getenv("LOCALAPPDATA");
+    return base ? (std::filesystem::path(base) / "bittorrent" / "peers.cache").string() : "";
+#else
+    if (const char* cache_home = std::getenv("XDG_CACHE_HOME"); cache_home && *cache_home) {
+        return (std::filesystem::path(cache_home) / "bittorrent" / "peers.cache").string();
+    }
+    const char* home = std::getenv("HOME");
+    return home ? (std::filesystem::path(home) / ".cache" / "bittorrent" / "peers.cache").string() : "";
+#endif
+}
+
+// Function to open the cache at path, or run without one when it can't be opened or the
+// path is empty or "none". Losing the cache only costs a slower start.
+inline std::unique_ptr<PeerCache> open_peer_cache(const std::string& path,
+                                                  size_t capacity = PeerCache::DEFAULT_CAPACITY) {
+    if (path.empty() || path == "none") {
+        return nullptr;
+    }
+    try {
+        return std::make_unique<PeerCache>(path, capacity);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << ", peers won't be remembered" << std::endl;
+        return nullptr;
+    }
+}
+
+#endif
@@ -3,13 +3,23 @@
 
 // this file contains fns for peers request using curl and sockets
 
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <cstdint>
 #include <stdexcept>
 #include <curl/curl.h>
 #include <random>
+#include <cstring>
+#include <map>
+#include <tuple>
+#include <mutex>
 #include "utils.hpp"
+#include "slab.hpp"
+#include "metrics.hpp"
+#include "peer_cache.hpp"
+#include "trace.hpp"
 
 // Platform-independent socket headers
 #ifdef _WIN32
@@ -20,6 +30,7 @@
     #include <sys/socket.h>
     #include <netinet/in.h>
     #include <arpa/inet.h>
+    #include <netinet/tcp.h>
     #include <unistd.h>
 #endif
 
@@ -37,6 +48,34 @@
     #define CLOSE_SOCKET close
 #endif
 
+#ifdef _WIN32
+    #define POLL_SOCKETS WSAPoll
+    typedef int socklen_t;
+#else
+    #include <poll.h>
+    #include <fcntl.h>
+    #include <cerrno>
+    #define POLL_SOCKETS poll
+#endif
+
+// a peer that closed its end must fail the send, not raise SIGPIPE and end the process
+#ifdef MSG_NOSIGNAL
+    #define SEND_FLAGS MSG_NOSIGNAL
+#else
+    #define SEND_FLAGS 0
+#endif
+
+// Switch a socket to non-blocking mode, or back
+inline void set_non_blocking(socket_t sock, bool enabled = true) {
+#ifdef _WIN32
+    u_long mode = enabled ? 1 : 0;
+    ioctlsocket(sock, FIONBIO, &mode);
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, enabled ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+#endif
+}
+
 // Windows-specific socket initialization
 class WSAInitializer {
 public:
@@ -55,81 +94,158 @@ public:
     }
 };
 
+// Peer wire message IDs
+const uint8_t MSG_CHOKE = 0;
+const uint8_t MSG_UNCHOKE = 1;
+const uint8_t MSG_INTERESTED = 2;
+const uint8_t MSG_NOT_INTERESTED = 3;
+const uint8_t MSG_HAVE = 4;
+const uint8_t MSG_BITFIELD = 5;
+const uint8_t MSG_REQUEST = 6;
+const uint8_t MSG_PIECE = 7;
+const uint8_t MSG_CANCEL = 8;
+// Fast Extension (BEP 6)
+const uint8_t MSG_SUGGEST_PIECE = 13;
+const uint8_t MSG_HAVE_ALL = 14;
+const uint8_t MSG_HAVE_NONE = 15;
+const uint8_t MSG_REJECT_REQUEST = 16;
+const uint8_t MSG_ALLOWED_FAST = 17;
+// BitTorrent v2 (BEP 52)
+const uint8_t MSG_HASH_REQUEST = 21;
+const uint8_t MSG_HASHES = 22;
+const uint8_t MSG_HASH_REJECT = 23;
+// not on the wire, read_peer_message reports a zero length message with this id
+const uint8_t MSG_KEEP_ALIVE = 0xFF;
+
+// Function to make blocking reads on a socket give up after a while
+inline void set_socket_timeout(socket_t sock, int seconds) {
+#ifdef _WIN32
+    DWORD timeout = seconds * 1000;
+#else
+    timeval timeout{seconds, 0};
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+// Function to make blocking sends on a socket give up after a while, once the peer stopped reading
+inline void set_socket_send_timeout(socket_t sock, int seconds) {
+#ifdef _WIN32
+    DWORD timeout = seconds * 1000;
+#else
+    timeval timeout{seconds, 0};
+#endif
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
 // Function to read a peer message
 struct PeerMessage {
     uint32_t length;
     uint8_t id;
-    std::vector<uint8_t> payload;
+    MessageBuffer payload; // slab backed, receiving a block doesn't allocate once warm
 };
 
-PeerMessage read_peer_message(socket_t sock) {
+// Function to receive exactly len bytes, recv may return less than asked for
+inline bool recv_exact(socket_t sock, char* buffer, size_t len) {
+    size_t total_received = 0;
+    while (total_received < len) {
+        auto received = recv(sock, buffer + total_received, static_cast<int>(len - total_received), 0);
+        client_metrics().recv_calls.add();
+        if (received <= 0) {
+            return false;
+        }
+        total_received += received;
+    }
+    return true;
+}
+
+inline PeerMessage read_peer_message(socket_t sock) {
     PeerMessage msg;
     
     // Read message length (4 bytes)
     uint32_t length_buffer;
-    if (recv(sock, reinterpret_cast<char*>(&length_buffer), 4, 0) != 4) {
+    if (!recv_exact(sock, reinterpret_cast<char*>(&length_buffer), 4)) {
         throw std::runtime_error("Failed to read message length");
     }
     msg.length = ntohl(length_buffer); // Convert from network byte order
     
     // If length is 0, it's a keep-alive message
     if (msg.length == 0) {
-        msg.id = 0xFF; // Special ID for keep-alive
+        msg.id = MSG_KEEP_ALIVE; // Special ID for keep-alive
         return msg;
     }
     
     // Read message ID (1 byte)
-    if (recv(sock, reinterpret_cast<char*>(&msg.id), 1, 0) != 1) {
+    if (!recv_exact(sock, reinterpret_cast<char*>(&msg.id), 1)) {
         throw std::runtime_error("Failed to read message ID");
     }
     
     // Read payload
     size_t payload_length = msg.length - 1; // Subtract 1 for message ID
     msg.payload.resize(payload_length);
-    size_t total_received = 0;
-    while (total_received < payload_length) {
-        ssize_t received = recv(sock, reinterpret_cast<char*>(msg.payload.data() + total_received), 
-                              payload_length - total_received, 0);
-        if (received <= 0) {
-            throw std::runtime_error("Failed to read message payload");
-        }
-        total_received += received;
+    if (!recv_exact(sock, reinterpret_cast<char*>(msg.payload.data()), payload_length)) {
+        throw std::runtime_error("Failed to read message payload");
     }
     
     return msg;
 }
 
-// Function to send a peer message
-void send_peer_message(socket_t sock, uint8_t id, const std::vector<uint8_t>& payload = {}) {
-    // Calculate total message length (payload + 1 byte for id)
-    uint32_t length = htonl(payload.size() + 1); // Convert to network byte order
-    
-    // Send length prefix
-    if (send(sock, reinterpret_cast<char*>(&length), 4, 0) != 4) {
-        throw std::runtime_error("Failed to send message length");
+// Function to read a big endian uint32 out of a message payload (or any byte vector)
+template <typename Bytes>
+inline uint32_t read_uint32(const Bytes& payload, size_t offset) {
+    uint32_t value;
+    memcpy(&value, payload.data() + offset, 4);
+    return ntohl(value);
+}
+
+// Function to write a big endian uint32 into a buffer
+inline void write_uint32(uint8_t* buffer, uint32_t value) {
+    value = htonl(value);
+    memcpy(buffer, &value, 4);
+}
+
+// Function to send all of len bytes, send may write less than asked for
+inline bool send_all(socket_t sock, const uint8_t* data, size_t len) {
+    while (len > 0) {
+        auto sent = send(sock, reinterpret_cast<const char*>(data), static_cast<int>(len), SEND_FLAGS);
+        client_metrics().send_calls.add();
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
     }
-    
-    // Send message ID
-    if (send(sock, reinterpret_cast<char*>(&id), 1, 0) != 1) {
-        throw std::runtime_error("Failed to send message ID");
+    return true;
+}
+
+// Function to send a peer message.
+// The frame is assembled in a per-thread scratch buffer, which each connection's
+// thread reuses as its arena, and goes out in a single send.
+inline void send_peer_message(socket_t sock, uint8_t id, const uint8_t* payload, size_t payload_length) {
+    thread_local std::vector<uint8_t> frame;
+    frame.resize(5 + payload_length);
+    // Length prefix covers the id and the payload
+    write_uint32(frame.data(), static_cast<uint32_t>(payload_length + 1));
+    frame[4] = id;
+    if (payload_length > 0) {
+        memcpy(frame.data() + 5, payload, payload_length);
     }
-    
-    // Send payload if any
-    if (!payload.empty()) {
-        if (send(sock, reinterpret_cast<const char*>(payload.data()), payload.size(), 0) != payload.size()) {
-            throw std::runtime_error("Failed to send message payload");
-        }
+    if (!send_all(sock, frame.data(), frame.size())) {
+        throw std::runtime_error("Failed to send message");
     }
 }
 
+inline void send_peer_message(socket_t sock, uint8_t id, const std::vector<uint8_t>& payload = {}) {
+    send_peer_message(sock, id, payload.data(), payload.size());
+}
+
 // Callback function for CURL to write response data
-size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* userp) {
+inline size_t WriteCallback(void* contents, size_t size, size_t nmemb, std::string* userp) {
     userp->append((char*)contents, size * nmemb);
     return size * nmemb;
 }
 
 // Function to format peer IP address
-std::string format_ip_address(const std::string& peers, size_t offset) {
+inline std::string format_ip_address(const std::string& peers, size_t offset) {
     return std::to_string(static_cast<uint8_t>(peers[offset])) + "." +
            std::to_string(static_cast<uint8_t>(peers[offset + 1])) + "." +
            std::to_string(static_cast<uint8_t>(peers[offset + 2])) + "." +
@@ -137,15 +253,281 @@ std::string format_ip_address(const std::string& peers, size_t offset) {
 }
 
 // Function to get port number from peer data
-uint16_t get_peer_port(const std::string& peers, size_t offset) {
+inline uint16_t get_peer_port(const std::string& peers, size_t offset) {
     return (static_cast<uint16_t>(static_cast<uint8_t>(peers[offset])) << 8) |
            static_cast<uint16_t>(static_cast<uint8_t>(peers[offset + 1]));
 }
 
-// Request peers from the tracker
-void peers_request(const std::string& encoded_value) {
-    // parse file content
-    parse_torrent(encoded_value);
+// ip and port of a peer
+struct PeerAddress {
+    std::string ip;
+    uint16_t port;
+};
+
+// "ip:port", used to tell peers apart
+inline std::string peer_key(const PeerAddress& peer) {
+    return peer.ip + ":" + std::to_string(peer.port);
+}
+
+// where we learned about a peer
+enum class PeerSource { Tracker, Dht, Pex, Magnet, Cache };
+
+// Every peer we know of for a torrent. Trackers, the DHT, PEX and the peer cache add to
+// it, the connection manager takes the best candidates to connect to from it and reports
+// back how connecting went, which is what the ranking is made of. With a cache attached
+// that is remembered for the next run as well.
+class PeerPool {
+public:
+    // Function to add the peers remembered for the torrent, with their record, and keep
+    // the cache up to date from here on. The cache must outlive the pool.
+    void use_cache(PeerCache* peer_cache, const std::vector<uint8_t>& info_hash) {
+        std::lock_guard<std::mutex> lock(mutex);
+        cache = peer_cache;
+        cache_hash = info_hash;
+        if (!cache) {
+            return;
+        }
+        for (const CachedPeer& known : cache->peers(info_hash)) {
+            PeerAddress peer{known.ip, known.port};
+            std::string key = peer_key(peer);
+            if (!index.count(key)) {
+                index[key] = entries.size();
+                entries.push_back({peer, PeerSource::Cache});
+            }
+            Entry& entry = entries[index[key]];
+            entry.successes = static_cast<int>(known.successes);
+            entry.connect_time = known.connect_time;
+            entry.throughput = known.throughput;
+            entry.banned = entry.banned || known.banned;
+            // dead last time, but it may be back: one more try, after everyone else
+            entry.failures = std::min<int>(static_cast<int>(known.failures), MAX_FAILURES - 1);
+        }
+    }
+
+    // returns false if the peer was already known
+    bool add(const PeerAddress& peer, PeerSource source) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string key = peer_key(peer);
+        if (index.count(key)) {
+            return false;
+        }
+        index[key] = entries.size();
+        entries.push_back({peer, source});
+        return true;
+    }
+
+    void add(const std::vector<PeerAddress>& peers, PeerSource source) {
+        for (const PeerAddress& peer : peers) {
+            add(peer, source);
+        }
+    }
+
+    // Function to take up to count peers worth connecting to, best first: fewest failures,
+    // then peers we reached before, fastest delivery and then quickest connect first, then
+    // untried ones in the order we learned of them. They count as busy until
+    // mark_connected, mark_failed or release.
+    std::vector<PeerAddress> take_candidates(size_t count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        std::vector<Entry*> eligible;
+        for (Entry& entry : entries) {
+            if (!entry.connected && !entry.connecting && !entry.banned && entry.failures < MAX_FAILURES &&
+                now >= entry.set_aside_until) {
+                eligible.push_back(&entry);
+            }
+        }
+        auto rank = [](const Entry* entry) {
+            // untried peers sort after every peer that answered before
+            auto connect_time = entry->successes > 0 ? entry->connect_time : std::chrono::steady_clock::duration::max();
+            return std::make_tuple(entry->failures, entry->successes == 0, -entry->throughput, connect_time);
+        };
+        std::stable_sort(eligible.begin(), eligible.end(),
+                         [&](const Entry* a, const Entry* b) { return rank(a) < rank(b); });
+        std::vector<PeerAddress> candidates;
+        for (size_t i = 0; i < eligible.size() && i < count; ++i) {
+            eligible[i]->connecting = true;
+            candidates.push_back(eligible[i]->address);
+        }
+        return candidates;
+    }
+
+    // the peer's address in the other IP family, learned from its extended handshake
+    void add_alternate(const PeerAddress& peer, const PeerAddress& alternate) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(peer_key(peer));
+        if (it != index.end() && peer_key(alternate) != peer_key(peer) && !index.count(peer_key(alternate))) {
+            entries[it->second].alternate = alternate;
+        }
+    }
+
+    // the addresses to race when connecting to peer, the known one first
+    std::vector<PeerAddress> addresses(const PeerAddress& peer) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(peer_key(peer));
+        if (it == index.end() || entries[it->second].alternate.ip.empty()) {
+            return {peer};
+        }
+        return {peer, entries[it->second].alternate};
+    }
+
+    // a TCP connect went through after connect_time, counted towards the peer's rank
+    void connect_succeeded(const PeerAddress& peer, std::chrono::steady_clock::duration connect_time) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(peer_key(peer));
+        if (it != index.end()) {
+            Entry& entry = entries[it->second];
+            // smoothed, one slow connect shouldn't bury a good peer
+            entry.connect_time = entry.successes == 0 ? connect_time : (entry.connect_time * 3 + connect_time) / 4;
+            ++entry.successes;
+            entry.last_reached = std::chrono::steady_clock::now();
+            if (cache) {
+                cache->connected(cache_hash, peer.ip, peer.port,
+                                 std::chrono::duration_cast<std::chrono::microseconds>(connect_time));
+            }
+        }
+    }
+
+    // the rate the peer delivered at over a connection that ended, 0 if it stalled
+    void record_throughput(const PeerAddress& peer, int64_t bytes_per_second) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(peer_key(peer));
+        if (it != index.end()) {
+            entries[it->second].throughput = bytes_per_second;
+            if (cache) {
+                cache->delivered(cache_hash, peer.ip, peer.port, bytes_per_second);
+            }
+        }
+    }
+
+    void mark_connected(const PeerAddress& peer, bool connected) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(peer_key(peer));
+        if (it != index.end()) {
+            entries[it->second].connected = connected;
+            entries[it->second].connecting = false;
+            entries[it->second].last_reached = std::chrono::steady_clock::now();
+        }
+    }
+
+    void mark_failed(const PeerAddress& peer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(peer_key(peer));
+        if (it != index.end()) {
+            entries[it->second].connected = false;
+            entries[it->second].connecting = false;
+            ++entries[it->second].failures;
+            if (cache) {
+                cache->failed(cache_hash, peer.ip, peer.port);
+            }
+        }
+    }
+
+    // a peer that answered but has nothing we need yet, not a failure: it isn't picked
+    // again until SET_ASIDE has passed and it may have downloaded more
+    void set_aside(const PeerAddress& peer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(peer_key(peer));
+        if (it != index.end()) {
+            entries[it->second].set_aside_until = std::chrono::steady_clock::now() + SET_ASIDE;
+        }
+    }
+
+    // a candidate that was taken and not used, it can be picked again
+    void release(const PeerAddress& peer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(peer_key(peer));
+        if (it != index.end()) {
+            entries[it->second].connecting = false;
+        }
+    }
+
+    // never connect to the peer again, it stays known so trackers and PEX can't bring it back
+    void ban(const PeerAddress& peer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(peer_key(peer));
+        if (it == index.end()) {
+            index[peer_key(peer)] = entries.size();
+            entries.push_back({peer, PeerSource::Tracker});
+            entries.back().banned = true;
+        } else {
+            entries[it->second].banned = true;
+        }
+        if (cache) {
+            cache->banned(cache_hash, peer.ip, peer.port);
+        }
+    }
+
+    bool is_banned(const PeerAddress& peer) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(peer_key(peer));
+        return it != index.end() && entries[it->second].banned;
+    }
+
+    // Function to list the peers worth passing on over PEX: the connected ones and those we
+    // reached in the last RECENTLY_REACHED that haven't failed too often since. We hold one
+    // connection at a time, so the connected set alone is just the peer being told.
+    std::vector<PeerAddress> reachable_peers() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        std::vector<PeerAddress> reachable;
+        for (const Entry& entry : entries) {
+            bool recent = entry.last_reached != std::chrono::steady_clock::time_point{} &&
+                          now - entry.last_reached < RECENTLY_REACHED;
+            if (!entry.banned && (entry.connected || (recent && entry.failures < MAX_FAILURES))) {
+                reachable.push_back(entry.address);
+            }
+        }
+        return reachable;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return entries.size();
+    }
+
+private:
+    static constexpr int MAX_FAILURES = 3;
+    static constexpr std::chrono::minutes RECENTLY_REACHED{10};
+    static constexpr std::chrono::seconds SET_ASIDE{60};
+
+    struct Entry {
+        PeerAddress address;
+        PeerSource source;
+        bool connected = false;
+        bool connecting = false; // taken as a candidate, being connected to
+        int failures = 0;
+        bool banned = false;
+        int successes = 0;
+        std::chrono::steady_clock::duration connect_time{};
+        int64_t throughput = 0; // bytes per second over its last connection
+        std::chrono::steady_clock::time_point last_reached{}; // last connect or disconnect
+        PeerAddress alternate{"", 0}; // empty ip for none
+        std::chrono::steady_clock::time_point set_aside_until{}; // had nothing we need, not a candidate before
+    };
+
+    mutable std::mutex mutex;
+    PeerCache* cache = nullptr;
+    std::vector<uint8_t> cache_hash;
+    std::vector<Entry> entries;
+    std::map<std::string, size_t> index;
+};
+
+// Split a compact peer list (6 bytes per peer: 4 for IP, 2 for port)
+inline std::vector<PeerAddress> parse_compact_peers(const std::string& peers) {
+    const size_t PEER_SIZE = 6;
+    std::vector<PeerAddress> result;
+    result.reserve(peers.length() / PEER_SIZE);
+    for (size_t offset = 0; offset + PEER_SIZE <= peers.length(); offset += PEER_SIZE) {
+        result.push_back({format_ip_address(peers, offset), get_peer_port(peers, offset + 4)});
+    }
+    return result;
+}
+
+// Announce to the tracker and return the peers it hands out
+inline std::vector<PeerAddress> request_tracker_peers(const std::string& announce, const std::vector<uint8_t>& info_hash, int64_t left) {
+    if (announce.empty()) {
+        throw std::runtime_error("Torrent has no tracker URL");
+    }
     // init curl
     CURL* curl = curl_easy_init();
     if (!curl) {
@@ -153,11 +535,11 @@ void peers_request(const std::string& encoded_value) {
     }
 
     // Construct tracker URL with required parameters
-    std::string url = torr.announce;
+    std::string url = announce;
     url += "?info_hash=";
     
     // URL encode the binary info hash
-    for (uint8_t byte : torr.info.hash) {
+    for (uint8_t byte : info_hash) {
         char hex[4];
         snprintf(hex, sizeof(hex), "%%%02x", byte);
         url += hex;
@@ -167,7 +549,7 @@ void peers_request(const std::string& encoded_value) {
     url += "&port=6881"; 
     url += "&uploaded=0";
     url += "&downloaded=0";
-    url += "&left=" + std::to_string(torr.info.length);
+    url += "&left=" + std::to_string(left);
     url += "&compact=1";
 
     // Debug print the full URL
@@ -192,30 +574,35 @@ void peers_request(const std::string& encoded_value) {
     json decoded_response = decode_bencoded_value(response);
     
     if(decoded_response.contains("failure reason")){
-        std::cerr << "Tracker response: " << decoded_response["failure reason"].get<std::string>() << std::endl;
-        return;
+        throw std::runtime_error("Tracker response: " + decoded_response["failure reason"].get<std::string>());
     }
     // Get the peers data
-    std::string peers = decoded_response["peers"].get<std::string>();
-    
-    // Each peer is represented by 6 bytes (4 for IP, 2 for port)
-    const size_t PEER_SIZE = 6;
-    size_t num_peers = peers.length() / PEER_SIZE;
+    return parse_compact_peers(decoded_response["peers"].get<std::string>());
+}
+
+// Request peers from the tracker
+inline void peers_request(const std::string& encoded_value) {
+    // parse file content
+    Torrent torr = parse_torrent(encoded_value);
+
+    std::vector<PeerAddress> peers;
+    try {
+        peers = request_tracker_peers(torr.announce, torr.info.hash, torr.info.length);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return;
+    }
     
     // Print each peer's IP and port
-    for (size_t i = 0; i < num_peers; i++) {
-        size_t offset = i * PEER_SIZE;
-        std::string ip = format_ip_address(peers, offset);
-        uint16_t port = get_peer_port(peers, offset + 4);
-        
-        std::cout << ip << ":" << port << std::endl;
+    for (const PeerAddress& peer : peers) {
+        std::cout << peer.ip << ":" << peer.port << std::endl;
     }
 }
 
 
 
 // Function to generate random peer ID
-std::string generate_peer_id() {
+inline std::string generate_peer_id() {
     std::random_device rd;
     std::mt19937 gen(rd());
     std::uniform_int_distribution<> dis(0, 255);
@@ -228,32 +615,114 @@ std::string generate_peer_id() {
     return peer_id;
 }
 
-// Function to perform handshake with peer
-std::string perform_handshake(const std::string& peer_ip, int peer_port, const std::vector<uint8_t>& info_hash) {
-    // Initialize WinSock if on Windows
-    WSAInitializer wsa;
-    
-    // Create socket
-    socket_t sock = socket(AF_INET, SOCK_STREAM, 0);
+// Reserved handshake bits we advertise
+const size_t EXTENSION_RESERVED_BYTE = 5;
+const uint8_t EXTENSION_PROTOCOL_BIT = 0x10; // BEP 10 extension protocol
+const size_t FAST_RESERVED_BYTE = 7;
+const uint8_t FAST_EXTENSION_BIT = 0x04; // BEP 6 fast extension
+const size_t V2_RESERVED_BYTE = 7;
+const uint8_t V2_PROTOCOL_BIT = 0x10; // BEP 52 v2 protocol, hash request and hashes messages
+
+// What the peer told us in its handshake
+struct HandshakeResult {
+    std::string peer_id;
+    uint8_t reserved[8];
+
+    bool supports_extensions() const {
+        return (reserved[EXTENSION_RESERVED_BYTE] & EXTENSION_PROTOCOL_BIT) != 0;
+    }
+
+    bool supports_fast() const {
+        return (reserved[FAST_RESERVED_BYTE] & FAST_EXTENSION_BIT) != 0;
+    }
+
+    bool supports_v2() const {
+        return (reserved[V2_RESERVED_BYTE] & V2_PROTOCOL_BIT) != 0;
+    }
+};
+
+// how long a connect may take before the peer is given up on, far below the kernel's SYN timeout
+const std::chrono::milliseconds CONNECT_TIMEOUT{5000};
+
+// Function to fill addr with a numeric IPv4 or IPv6 address, returns its length or 0 if ip isn't one
+inline socklen_t peer_sockaddr(const std::string& ip, int port, sockaddr_storage& addr) {
+    addr = {};
+    auto* v4 = reinterpret_cast<sockaddr_in*>(&addr);
+    if (inet_pton(AF_INET, ip.c_str(), &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(static_cast<uint16_t>(port));
+        return sizeof(sockaddr_in);
+    }
+    auto* v6 = reinterpret_cast<sockaddr_in6*>(&addr);
+    if (inet_pton(AF_INET6, ip.c_str(), &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(static_cast<uint16_t>(port));
+        return sizeof(sockaddr_in6);
+    }
+    return 0;
+}
+
+// Function to start a non-blocking TCP connect, finish_connect tells once the socket is writable
+inline socket_t start_connect(const std::string& peer_ip, int peer_port) {
+    sockaddr_storage peer_addr;
+    socklen_t addr_length = peer_sockaddr(peer_ip, peer_port, peer_addr);
+    if (addr_length == 0) {
+        throw std::runtime_error("Invalid peer IP address");
+    }
+    socket_t sock = socket(peer_addr.ss_family, SOCK_STREAM, 0);
     if (sock == INVALID_SOCKET_VALUE) {
         throw std::runtime_error("Failed to create socket");
     }
+    set_non_blocking(sock);
+    client_metrics().connect_calls.add();
+    if (connect(sock, reinterpret_cast<sockaddr*>(&peer_addr), addr_length) == SOCKET_ERROR_VALUE) {
+#ifdef _WIN32
+        bool in_progress = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+        bool in_progress = errno == EINPROGRESS;
+#endif
+        if (!in_progress) {
+            CLOSE_SOCKET(sock);
+            throw std::runtime_error("Failed to connect to peer");
+        }
+    }
+    return sock;
+}
 
-    // Set up peer address
-    struct sockaddr_in peer_addr;
-    peer_addr.sin_family = AF_INET;
-    peer_addr.sin_port = htons(peer_port);
-    if (inet_pton(AF_INET, peer_ip.c_str(), &peer_addr.sin_addr) <= 0) {
-        CLOSE_SOCKET(sock);
-        throw std::runtime_error("Invalid peer IP address");
+// Function to check a connect that became writable; a connected socket is switched back to
+// blocking mode and returned true, a failed one is left for the caller to close
+inline bool finish_connect(socket_t sock) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &length) == SOCKET_ERROR_VALUE ||
+        error != 0) {
+        return false;
     }
+    set_non_blocking(sock, false);
+    // requests are small writes, without this Nagle holds each one back until the
+    // previous one is acked and a delayed ack stalls the whole pipeline
+    int no_delay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&no_delay), sizeof(no_delay));
+    return true;
+}
 
-    // Connect to peer
-    if (connect(sock, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) == SOCKET_ERROR_VALUE) {
+// Function to open a TCP connection to a peer, giving up after timeout
+inline socket_t connect_to_peer(const std::string& peer_ip, int peer_port,
+                                std::chrono::milliseconds timeout = CONNECT_TIMEOUT) {
+    TRACE_SPAN("connect");
+    socket_t sock = start_connect(peer_ip, peer_port);
+    pollfd entry{sock, POLLOUT, 0};
+    int ready = POLL_SOCKETS(&entry, 1, static_cast<int>(timeout.count()));
+    if (ready <= 0 || !finish_connect(sock)) {
         CLOSE_SOCKET(sock);
-        throw std::runtime_error("Failed to connect to peer");
+        throw std::runtime_error(ready == 0 ? "Timed out connecting to peer" : "Failed to connect to peer");
     }
+    return sock;
+}
 
+// Function to exchange handshakes on a connected socket, closes it on failure
+inline HandshakeResult exchange_handshake(socket_t sock, const std::vector<uint8_t>& info_hash) {
+    TRACE_SPAN("handshake");
     // Construct handshake message
     std::string handshake;
     handshake.reserve(68); // Total size of handshake message
@@ -266,6 +735,9 @@ std::string perform_handshake(const std::string& peer_ip, int peer_port, const s
 
     // 3. Reserved bytes (8 bytes)
     handshake.append(8, '\0');
+    handshake[20 + EXTENSION_RESERVED_BYTE] |= EXTENSION_PROTOCOL_BIT;
+    handshake[20 + FAST_RESERVED_BYTE] |= FAST_EXTENSION_BIT;
+    handshake[20 + V2_RESERVED_BYTE] |= V2_PROTOCOL_BIT;
 
     // 4. Info hash (20 bytes)
     handshake.append(info_hash.begin(), info_hash.end());
@@ -278,7 +750,7 @@ std::string perform_handshake(const std::string& peer_ip, int peer_port, const s
     #ifdef _WIN32
         if (send(sock, handshake.c_str(), static_cast<int>(handshake.length()), 0) != handshake.length()) {
     #else
-        if (send(sock, handshake.c_str(), handshake.length(), 0) != static_cast<ssize_t>(handshake.length())) {
+        if (send(sock, handshake.c_str(), handshake.length(), SEND_FLAGS) != static_cast<ssize_t>(handshake.length())) {
     #endif
         CLOSE_SOCKET(sock);
         throw std::runtime_error("Failed to send handshake");
@@ -286,26 +758,37 @@ std::string perform_handshake(const std::string& peer_ip, int peer_port, const s
 
     // Receive response
     char response[68];
-    #ifdef _WIN32
-        int received = recv(sock, response, sizeof(response), 0);
-    #else
-        ssize_t received = recv(sock, response, sizeof(response), 0);
-    #endif
-
-    if (received != 68) {
+    if (!recv_exact(sock, response, sizeof(response))) {
         CLOSE_SOCKET(sock);
         throw std::runtime_error("Failed to receive complete handshake response");
     }
+    if (memcmp(response + 28, info_hash.data(), 20) != 0) {
+        CLOSE_SOCKET(sock);
+        throw std::runtime_error("Peer answered with a different info hash");
+    }
+
+    HandshakeResult result;
+    memcpy(result.reserved, response + 20, 8);
+    // Extract peer ID from response (last 20 bytes)
+    result.peer_id = std::string(response + 48, 20);
+    return result;
+}
 
+// Function to perform handshake with peer
+inline std::string perform_handshake(const std::string& peer_ip, int peer_port, const std::vector<uint8_t>& info_hash) {
+    // Initialize WinSock if on Windows
+    WSAInitializer wsa;
+    
+    socket_t sock = connect_to_peer(peer_ip, peer_port);
+    HandshakeResult result = exchange_handshake(sock, info_hash);
     CLOSE_SOCKET(sock);
 
-    // Extract peer ID from response (last 20 bytes)
-    return std::string(response + 48, 20);
+    return result.peer_id;
 }
 
-void handle_handshake(const std::string& encoded_value, const std::string& peer_ip_port) {
+inline void handle_handshake(const std::string& encoded_value, const std::string& peer_ip_port) {
     // Parse torrent file
-    parse_torrent(encoded_value);
+    Torrent torr = parse_torrent(encoded_value);
 
     // Split peer_ip_port into IP and port
     size_t colon_pos = peer_ip_port.find(':');
@@ -0,0 +1,139 @@
+#ifndef PEX_HPP
+#define PEX_HPP
+
+// this file contains Peer Exchange (BEP 11): connected peers tell each other about
+// the peers they are connected to through ut_pex extension messages
+
+#include <chrono>
+#include <set>
+#include <string>
+#include <vector>
+#include "decode.hpp"
+#include "peers.hpp"
+
+// peers added and dropped since the last message
+struct PexMessage {
+    std::vector<PeerAddress> added;
+    std::vector<PeerAddress> dropped;
+};
+
+// Function to pack a peer into 6 (IPv4) or 18 (IPv6) bytes, empty if the address is invalid
+inline std::string compact_peer(const PeerAddress& peer) {
+    std::string out;
+    uint8_t addr[16];
+    if (inet_pton(AF_INET, peer.ip.c_str(), addr) == 1) {
+        out.assign(reinterpret_cast<char*>(addr), 4);
+    } else if (inet_pton(AF_INET6, peer.ip.c_str(), addr) == 1) {
+        out.assign(reinterpret_cast<char*>(addr), 16);
+    } else {
+        return out;
+    }
+    out.push_back(static_cast<char>(peer.port >> 8));
+    out.push_back(static_cast<char>(peer.port & 0xFF));
+    return out;
+}
+
+// Function to split a compact IPv6 peer list (18 bytes per peer)
+inline std::vector<PeerAddress> parse_compact_peers6(const std::string& peers) {
+    const size_t PEER_SIZE = 18;
+    std::vector<PeerAddress> result;
+    for (size_t offset = 0; offset + PEER_SIZE <= peers.length(); offset += PEER_SIZE) {
+        char ip[INET6_ADDRSTRLEN];
+        inet_ntop(AF_INET6, peers.data() + offset, ip, sizeof(ip));
+        result.push_back({ip, get_peer_port(peers, offset + 16)});
+    }
+    return result;
+}
+
+// Function to build the bencoded payload of a ut_pex message
+inline std::string encode_pex_message(const PexMessage& message) {
+    std::string added, added6, dropped, dropped6;
+    for (const PeerAddress& peer : message.added) {
+        std::string compact = compact_peer(peer);
+        (compact.size() == 6 ? added : added6) += compact;
+    }
+    for (const PeerAddress& peer : message.dropped) {
+        std::string compact = compact_peer(peer);
+        (compact.size() == 6 ? dropped : dropped6) += compact;
+    }
+    json dict = json::object();
+    dict["added"] = added;
+    // one flag byte per added IPv4 peer, we don't know anything about them
+    dict["added.f"] = std::string(added.size() / 6, '\0');
+    dict["dropped"] = dropped;
+    if (!added6.empty()) {
+        dict["added6"] = added6;
+        dict["added6.f"] = std::string(added6.size() / 18, '\0');
+    }
+    if (!dropped6.empty()) {
+        dict["dropped6"] = dropped6;
+    }
+    return bencode_decoded_value(dict);
+}
+
+// Function to parse the payload of a ut_pex message
+inline PexMessage parse_pex_message(const std::string& payload) {
+    json dict = decode_bencoded_value(payload);
+    PexMessage message;
+    auto field = [&](const char* key) {
+        return dict.contains(key) && dict[key].is_string() ? dict[key].get<std::string>() : std::string();
+    };
+    message.added = parse_compact_peers(field("added"));
+    std::vector<PeerAddress> added6 = parse_compact_peers6(field("added6"));
+    message.added.insert(message.added.end(), added6.begin(), added6.end());
+    message.dropped = parse_compact_peers(field("dropped"));
+    std::vector<PeerAddress> dropped6 = parse_compact_peers6(field("dropped6"));
+    message.dropped.insert(message.dropped.end(), dropped6.begin(), dropped6.end());
+    return message;
+}
+
+// What we last told one peer. Every minute the peers we can currently reach are
+// diffed against it and the changes go out as one ut_pex message.
+class PexState {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr Clock::duration INTERVAL = std::chrono::seconds(60);
+    static constexpr size_t MAX_PEERS_PER_MESSAGE = 50; // per list, as BEP 11 asks
+
+    // a minute passed since the last message, cheap enough to ask on every peer message
+    bool due(Clock::time_point now) const {
+        return last_sent == Clock::time_point{} || now - last_sent >= INTERVAL;
+    }
+
+    // returns true and fills message if a message is due
+    bool next_message(const std::vector<PeerAddress>& reachable, const PeerAddress& recipient,
+                      Clock::time_point now, PexMessage& message) {
+        if (!due(now)) {
+            return false;
+        }
+        std::set<std::string> current;
+        message = PexMessage();
+        for (const PeerAddress& peer : reachable) {
+            std::string key = peer_key(peer);
+            if (key == peer_key(recipient)) {
+                continue;
+            }
+            current.insert(key);
+            if (!advertised.count(key) && message.added.size() < MAX_PEERS_PER_MESSAGE) {
+                message.added.push_back(peer);
+                advertised[key] = peer;
+            }
+        }
+        for (auto it = advertised.begin(); it != advertised.end();) {
+            if (!current.count(it->first) && message.dropped.size() < MAX_PEERS_PER_MESSAGE) {
+                message.dropped.push_back(it->second);
+                it = advertised.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        last_sent = now;
+        return !message.added.empty() || !message.dropped.empty();
+    }
+
+private:
+    std::map<std::string, PeerAddress> advertised;
+    Clock::time_point last_sent{};
+};
+
+#endif
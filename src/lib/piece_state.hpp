@@ -0,0 +1,277 @@
+#ifndef PIECE_STATE_HPP
+#define PIECE_STATE_HPP
+
+// this file contains the per torrent piece state: which pieces we have, want and
+// requested, how many peers have each one, and the piece picker scanning it
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Fixed size bitset over 64-bit words. Scans go a word at a time so runs of
+// pieces we already have (or the peer lacks) are skipped 64 at once.
+class Bitset {
+public:
+    static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+    Bitset() = default;
+    explicit Bitset(size_t bit_count, bool value = false)
+        : words((bit_count + 63) / 64, value ? ~uint64_t(0) : 0), bits(bit_count) {
+        clear_tail();
+    }
+
+    // bitfield message layout, the high bit of the first byte is bit 0
+    static Bitset from_bytes(const uint8_t* data, size_t length) {
+        Bitset set(length * 8);
+        for (size_t i = 0; i < length; ++i) {
+            for (int b = 0; b < 8; ++b) {
+                if (data[i] & (0x80 >> b)) {
+                    set.set(i * 8 + b);
+                }
+            }
+        }
+        return set;
+    }
+
+    size_t size() const { return bits; }
+
+    // grow to hold at least bit_count bits, new bits are clear
+    void resize(size_t bit_count) {
+        words.resize((bit_count + 63) / 64, 0);
+        bits = bit_count;
+        clear_tail();
+    }
+
+    bool test(size_t i) const { return i < bits && (words[i / 64] >> (i % 64)) & 1; }
+    void set(size_t i) { words[i / 64] |= uint64_t(1) << (i % 64); }
+    void reset(size_t i) { words[i / 64] &= ~(uint64_t(1) << (i % 64)); }
+
+    void set_all() {
+        std::fill(words.begin(), words.end(), ~uint64_t(0));
+        clear_tail();
+    }
+
+    void reset_all() { std::fill(words.begin(), words.end(), 0); }
+
+    size_t count() const {
+        size_t total = 0;
+        for (uint64_t word : words) {
+            total += std::popcount(word);
+        }
+        return total;
+    }
+
+    bool all() const { return count() == bits; }
+
+    // first clear bit at or after from, npos if there is none
+    size_t find_first_clear(size_t from = 0) const {
+        for (size_t w = from / 64; w < words.size(); ++w) {
+            uint64_t word = ~words[w];
+            if (w == from / 64) {
+                word &= ~uint64_t(0) << (from % 64);
+            }
+            if (word) {
+                size_t i = w * 64 + std::countr_zero(word);
+                return i < bits ? i : npos;
+            }
+        }
+        return npos;
+    }
+
+    const std::vector<uint64_t>& data() const { return words; }
+
+    // word w or 0 past the end, lets bitsets of different sizes be combined
+    uint64_t word(size_t w) const { return w < words.size() ? words[w] : 0; }
+
+private:
+    // bits past the end stay clear so count and all work on whole words
+    void clear_tail() {
+        if (bits % 64 && !words.empty()) {
+            words.back() &= (uint64_t(1) << (bits % 64)) - 1;
+        }
+    }
+
+    std::vector<uint64_t> words;
+    size_t bits = 0;
+};
+
+// Scheduling state of one torrent, kept as parallel arrays indexed by piece:
+// bitsets for have/wanted/requested and a 16-bit availability count per piece.
+// The pieces we still need are also kept sorted by availability, one bucket per count,
+// so the picker starts at the rarest pieces instead of scanning them all, and a peer
+// announcing or dropping a piece moves it to the next bucket in O(1).
+// Per piece that is three bits, a 16-bit count and two 32-bit bucket indices, about 10 bytes:
+// a million pieces (a 16 GB torrent of 16 KiB pieces) take 10 MB, typical torrents well under 1 MB.
+class PieceState {
+public:
+    static constexpr size_t NONE = Bitset::npos;
+
+    explicit PieceState(size_t piece_count)
+        : have(piece_count), wanted(piece_count, true), requested(piece_count), availability(piece_count, 0),
+          by_availability(piece_count), position(piece_count), bucket_start{0, static_cast<uint32_t>(piece_count)} {
+        for (size_t i = 0; i < piece_count; ++i) {
+            by_availability[i] = static_cast<uint32_t>(i);
+            position[i] = static_cast<uint32_t>(i);
+        }
+    }
+
+    size_t piece_count() const { return have.size(); }
+
+    bool has_piece(size_t piece) const { return have.test(piece); }
+    bool wants_piece(size_t piece) const { return wanted.test(piece); }
+    bool is_requested(size_t piece) const { return requested.test(piece); }
+
+    void set_wanted(size_t piece, bool value) {
+        bool was_needed = is_needed(piece);
+        value ? wanted.set(piece) : wanted.reset(piece);
+        update_needed(piece, was_needed);
+    }
+
+    void mark_have(size_t piece) {
+        bool was_needed = is_needed(piece);
+        have.set(piece);
+        requested.reset(piece);
+        update_needed(piece, was_needed);
+    }
+    void mark_requested(size_t piece) { requested.set(piece); }
+    void clear_requested(size_t piece) { requested.reset(piece); }
+
+    // wanted pieces we don't have yet
+    size_t missing_count() const {
+        size_t missing = 0;
+        for (size_t w = 0; w < wanted.data().size(); ++w) {
+            missing += std::popcount(wanted.word(w) & ~have.word(w));
+        }
+        return missing;
+    }
+
+    bool complete() const { return missing_count() == 0; }
+
+    // Pick the rarest piece we want, don't have and haven't requested that the peer has.
+    // peer_has_all stands in for peers that sent have_all (or no bitfield at all).
+    // Pieces in excluded are left for other peers.
+    size_t pick_piece(const Bitset& peer_pieces, bool peer_has_all, const Bitset* excluded = nullptr) const {
+        // rarest bucket first, the first piece the peer can give us wins
+        for (size_t count = 0; count + 1 < bucket_start.size(); ++count) {
+            for (uint32_t i = bucket_start[count]; i < bucket_start[count + 1]; ++i) {
+                size_t piece = by_availability[i];
+                if (requested.test(piece) || (!peer_has_all && !peer_pieces.test(piece)) ||
+                    (excluded && excluded->test(piece))) {
+                    continue;
+                }
+                return piece;
+            }
+        }
+        return NONE;
+    }
+
+    // availability bookkeeping, called as peers announce and drop pieces
+    void add_availability(size_t piece) {
+        if (piece < availability.size() && availability[piece] < std::numeric_limits<uint16_t>::max()) {
+            set_availability(piece, availability[piece] + 1);
+        }
+    }
+
+    void remove_availability(size_t piece) {
+        if (piece < availability.size() && availability[piece] > 0) {
+            set_availability(piece, availability[piece] - 1);
+        }
+    }
+
+    void add_availability(const Bitset& pieces) { for_each_set(pieces, [this](size_t p) { add_availability(p); }); }
+    void remove_availability(const Bitset& pieces) { for_each_set(pieces, [this](size_t p) { remove_availability(p); }); }
+
+    // seeds have everything, counting them separately keeps have_all O(1)
+    void add_seed() { ++seeds; }
+    void remove_seed() { seeds -= seeds > 0; }
+
+    // peers known to have the piece
+    uint32_t piece_availability(size_t piece) const { return availability[piece] + seeds; }
+
+private:
+    bool is_needed(size_t piece) const { return wanted.test(piece) && !have.test(piece); }
+
+    // keep the buckets in step after a piece's needed state may have changed
+    void update_needed(size_t piece, bool was_needed) {
+        bool needed = is_needed(piece);
+        if (was_needed && !needed) {
+            remove_needed(piece);
+        } else if (!was_needed && needed) {
+            insert_needed(piece);
+        }
+    }
+
+    void set_availability(size_t piece, uint16_t count) {
+        if (is_needed(piece)) {
+            // callers step by one, each step crosses one bucket boundary
+            for (uint16_t current = availability[piece]; current < count; ++current) {
+                grow_buckets(current + 1);
+                move_to(piece, --bucket_start[current + 1]);
+            }
+            for (uint16_t current = availability[piece]; current > count; --current) {
+                move_to(piece, bucket_start[current]++);
+            }
+        }
+        availability[piece] = count;
+    }
+
+    // Function to add a piece we now need to the bucket of its count: it goes in at the end,
+    // then sinks one bucket at a time by trading places with the first piece of each
+    void insert_needed(size_t piece) {
+        uint16_t count = availability[piece];
+        grow_buckets(count);
+        position[piece] = static_cast<uint32_t>(by_availability.size());
+        by_availability.push_back(static_cast<uint32_t>(piece));
+        ++bucket_start.back();
+        for (size_t bucket = bucket_start.size() - 2; bucket > count; --bucket) {
+            move_to(piece, bucket_start[bucket]++);
+        }
+    }
+
+    // Function to take a piece we no longer need out, raising it to the end first
+    void remove_needed(size_t piece) {
+        for (size_t bucket = availability[piece] + 1; bucket < bucket_start.size(); ++bucket) {
+            move_to(piece, --bucket_start[bucket]);
+        }
+        by_availability.pop_back();
+    }
+
+    // swap piece into slot, whichever piece was there takes its old slot
+    void move_to(size_t piece, uint32_t slot) {
+        uint32_t other = by_availability[slot];
+        uint32_t from = position[piece];
+        by_availability[from] = other;
+        position[other] = from;
+        by_availability[slot] = static_cast<uint32_t>(piece);
+        position[piece] = slot;
+    }
+
+    // empty buckets up to count, at the end of the list
+    void grow_buckets(size_t count) {
+        while (bucket_start.size() < count + 2) {
+            bucket_start.push_back(bucket_start.back());
+        }
+    }
+
+    template <typename F>
+    static void for_each_set(const Bitset& pieces, F f) {
+        for (size_t w = 0; w < pieces.data().size(); ++w) {
+            for (uint64_t word = pieces.data()[w]; word; word &= word - 1) {
+                f(w * 64 + std::countr_zero(word));
+            }
+        }
+    }
+
+    Bitset have;
+    Bitset wanted;
+    Bitset requested;
+    std::vector<uint16_t> availability;
+    std::vector<uint32_t> by_availability; // needed pieces, rarest first
+    std::vector<uint32_t> position;        // slot of each needed piece in by_availability
+    std::vector<uint32_t> bucket_start;    // first slot per count, the last entry is the end
+    uint32_t seeds = 0;
+};
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef RATE_LIMIT_HPP
+#define RATE_LIMIT_HPP
+
+// this file contains bandwidth limiting with token buckets. A transfer has to get through
+// the bucket of its torrent, of its peer class (LAN or WAN) and the global one; downloads
+// are limited where block requests are scheduled, so we never ask for more than we may receive
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "peers.hpp"
+
+enum class Direction { Download = 0, Upload = 1 };
+
+// peers on the local network usually aren't what the link caps are about
+enum class PeerClass { Lan = 0, Wan = 1 };
+
+// Function to tell LAN peers (loopback, private and link-local addresses) from the rest
+inline PeerClass classify_peer(const std::string& ip) {
+    uint8_t v4[4];
+    if (inet_pton(AF_INET, ip.c_str(), v4) == 1) {
+        bool lan = v4[0] == 127 || v4[0] == 10 || (v4[0] == 172 && (v4[1] & 0xF0) == 16) ||
+                   (v4[0] == 192 && v4[1] == 168) || (v4[0] == 169 && v4[1] == 254);
+        return lan ? PeerClass::Lan : PeerClass::Wan;
+    }
+    uint8_t v6[16];
+    if (inet_pton(AF_INET6, ip.c_str(), v6) == 1) {
+        static const uint8_t loopback[16] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1};
+        bool lan = memcmp(v6, loopback, 16) == 0 || (v6[0] & 0xFE) == 0xFC || (v6[0] == 0xFE && (v6[1] & 0xC0) == 0x80);
+        return lan ? PeerClass::Lan : PeerClass::Wan;
+    }
+    return PeerClass::Wan;
+}
+
+// limits of one level, bytes per second, 0 is unlimited
+struct RateLimits {
+    int64_t download = 0;
+    int64_t upload = 0;
+};
+
+// Token bucket counted in whole bytes. Tokens are added lazily from the time passed when the
+// bucket is used, with the sub-byte remainder carried over, so it stays exact at any rate
+// up to about 64 Gbit/s and refilling never needs a timer or a syscall (steady_clock is vDSO).
+// Not thread safe, RateLimiter locks around it.
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    void set_rate(int64_t bytes_per_second) {
+        rate = std::clamp<int64_t>(bytes_per_second, 0, MAX_RATE);
+        // a tenth of a second of traffic, and always room for a few blocks
+        burst = std::max<int64_t>(rate / 10, 128 * 1024);
+        // start full so the first requests go out right away
+        tokens = burst;
+        fraction = 0;
+        last = Clock::now();
+    }
+
+    bool unlimited() const { return rate == 0; }
+
+    // how long until bytes can be taken, zero if they can be now
+    Clock::duration wait_time(int64_t bytes, Clock::time_point now) {
+        if (unlimited()) {
+            return Clock::duration::zero();
+        }
+        refill(now);
+        // more than a burst at once is let through on a full bucket and paid back as debt
+        int64_t needed = std::min(bytes, burst);
+        if (tokens >= needed) {
+            return Clock::duration::zero();
+        }
+        return std::chrono::nanoseconds((needed - tokens) * NS_PER_SECOND / rate + 1);
+    }
+
+    void consume(int64_t bytes) {
+        if (!unlimited()) {
+            tokens -= bytes;
+        }
+    }
+
+private:
+    static constexpr int64_t NS_PER_SECOND = 1000000000;
+    static constexpr int64_t MAX_RATE = 8000000000; // keeps rest * rate within int64
+
+    void refill(Clock::time_point now) {
+        int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+        if (elapsed <= 0) {
+            return;
+        }
+        last = now;
+        int64_t seconds = elapsed / NS_PER_SECOND;
+        if (tokens >= burst || seconds > burst / rate) {
+            tokens = burst;
+            fraction = 0;
+            return;
+        }
+        // fraction is the part of a byte earned but not granted yet, in byte nanoseconds
+        int64_t scaled = (elapsed % NS_PER_SECOND) * rate + fraction;
+        tokens = std::min(burst, tokens + seconds * rate + scaled / NS_PER_SECOND);
+        fraction = scaled % NS_PER_SECOND;
+    }
+
+    int64_t rate = 0;
+    int64_t burst = 0;
+    int64_t tokens = 0;
+    int64_t fraction = 0;
+    Clock::time_point last = Clock::now();
+};
+
+// a download and an upload bucket, one level of the hierarchy
+class RateLimitBuckets {
+public:
+    explicit RateLimitBuckets(const RateLimits& limits = {}) { set_limits(limits); }
+
+    void set_limits(const RateLimits& limits) {
+        buckets[static_cast<int>(Direction::Download)].set_rate(limits.download);
+        buckets[static_cast<int>(Direction::Upload)].set_rate(limits.upload);
+    }
+
+    TokenBucket& operator[](Direction direction) { return buckets[static_cast<int>(direction)]; }
+
+private:
+    TokenBucket buckets[2];
+};
+
+// The shared levels, global and per peer class, plus the torrent level passed in by the caller.
+// One uncontended lock per request decision, nothing runs in the background.
+class RateLimiter {
+public:
+    using Clock = TokenBucket::Clock;
+
+    void set_global(const RateLimits& limits) {
+        std::lock_guard<std::mutex> lock(mutex);
+        global.set_limits(limits);
+    }
+
+    void set_class(PeerClass peer_class, const RateLimits& limits) {
+        std::lock_guard<std::mutex> lock(mutex);
+        classes[static_cast<int>(peer_class)].set_limits(limits);
+    }
+
+    // Take bytes from every level if they all have them. Otherwise nothing is taken and
+    // the time until the slowest level would let them through is returned.
+    Clock::duration try_acquire(Direction direction, int64_t bytes, PeerClass peer_class, RateLimitBuckets* torrent) {
+        std::lock_guard<std::mutex> lock(mutex);
+        TokenBucket* levels[3] = {torrent ? &(*torrent)[direction] : nullptr,
+                                  &classes[static_cast<int>(peer_class)][direction], &global[direction]};
+        auto now = Clock::now();
+        Clock::duration wait = Clock::duration::zero();
+        for (TokenBucket* level : levels) {
+            if (level) {
+                wait = std::max(wait, level->wait_time(bytes, now));
+            }
+        }
+        if (wait == Clock::duration::zero()) {
+            for (TokenBucket* level : levels) {
+                if (level) {
+                    level->consume(bytes);
+                }
+            }
+        }
+        return wait;
+    }
+
+    // take bytes, sleeping until every level has them
+    void acquire(Direction direction, int64_t bytes, PeerClass peer_class, RateLimitBuckets* torrent) {
+        Clock::duration wait;
+        while ((wait = try_acquire(direction, bytes, peer_class, torrent)) != Clock::duration::zero()) {
+            std::this_thread::sleep_for(wait);
+        }
+    }
+
+private:
+    std::mutex mutex;
+    RateLimitBuckets global;
+    RateLimitBuckets classes[2];
+};
+
+// the limiter every torrent in the process shares
+inline RateLimiter& rate_limiter() {
+    static RateLimiter limiter;
+    return limiter;
+}
+
+// Function to parse a rate like 500K or 10M (bytes per second, powers of 1024)
+inline int64_t parse_rate(const std::string& text) {
+    size_t used = 0;
+    int64_t value = std::stoll(text, &used);
+    std::string suffix = text.substr(used);
+    if (suffix == "K" || suffix == "k") {
+        value <<= 10;
+    } else if (suffix == "M" || suffix == "m") {
+        value <<= 20;
+    } else if (suffix == "G" || suffix == "g") {
+        value <<= 30;
+    } else if (!suffix.empty()) {
+        throw std::runtime_error("Invalid rate: " + text);
+    }
+    if (value < 0) {
+        throw std::runtime_error("Invalid rate: " + text);
+    }
+    return value;
+}
+
+#endif
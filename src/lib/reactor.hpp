@@ -0,0 +1,181 @@
+#ifndef REACTOR_HPP
+#define REACTOR_HPP
+
+// this file contains a small poll() based event loop with timers, and a UDP socket
+// wrapper to run datagram protocols (DHT) on it
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "peers.hpp"
+
+// Single threaded event loop.
+// Sockets register a callback that runs when they become readable,
+// timers run once after a delay. Everything runs on the thread calling run_*.
+class Reactor {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+
+    void add_reader(socket_t sock, Callback on_readable) {
+        readers[sock] = std::move(on_readable);
+    }
+
+    void remove_reader(socket_t sock) {
+        readers.erase(sock);
+    }
+
+    // run cb once after delay, returns an id that can be passed to cancel()
+    uint64_t call_later(Clock::duration delay, Callback cb) {
+        uint64_t id = ++next_timer_id;
+        timers.push({Clock::now() + delay, id});
+        timer_callbacks[id] = std::move(cb);
+        return id;
+    }
+
+    void cancel(uint64_t timer_id) {
+        timer_callbacks.erase(timer_id);
+    }
+
+    // wait for at most max_wait, then dispatch ready sockets and due timers
+    void run_once(Clock::duration max_wait) {
+        Clock::time_point now = Clock::now();
+        Clock::duration wait = max_wait;
+        if (!timers.empty()) {
+            wait = std::min(wait, std::max(Clock::duration::zero(), timers.top().deadline - now));
+        }
+        int timeout_ms = static_cast<int>(std::chrono::ceil<std::chrono::milliseconds>(wait).count());
+
+        std::vector<pollfd> fds;
+        fds.reserve(readers.size());
+        for (const auto& [sock, cb] : readers) {
+            pollfd pfd{};
+            pfd.fd = sock;
+            pfd.events = POLLIN;
+            fds.push_back(pfd);
+        }
+
+        int ready = fds.empty() ? 0 : POLL_SOCKETS(fds.data(), static_cast<unsigned long>(fds.size()), timeout_ms);
+        if (fds.empty() && timeout_ms > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+        }
+        if (ready > 0) {
+            for (const pollfd& pfd : fds) {
+                if (pfd.revents == 0) {
+                    continue;
+                }
+                // the callback may have been removed by an earlier one in this round
+                auto it = readers.find(pfd.fd);
+                if (it != readers.end()) {
+                    Callback cb = it->second;
+                    cb();
+                }
+            }
+        }
+        run_due_timers();
+    }
+
+    // run until stop() is called, done() returns true or the timeout expires
+    void run_until(const std::function<bool()>& done, Clock::duration timeout) {
+        stopped = false;
+        Clock::time_point deadline = Clock::now() + timeout;
+        while (!stopped && !done() && Clock::now() < deadline) {
+            run_once(std::min<Clock::duration>(deadline - Clock::now(), std::chrono::milliseconds(100)));
+        }
+    }
+
+    void stop() { stopped = true; }
+
+private:
+    struct Timer {
+        Clock::time_point deadline;
+        uint64_t id;
+        bool operator>(const Timer& other) const { return deadline > other.deadline; }
+    };
+
+    void run_due_timers() {
+        Clock::time_point now = Clock::now();
+        while (!timers.empty() && timers.top().deadline <= now) {
+            uint64_t id = timers.top().id;
+            timers.pop();
+            auto it = timer_callbacks.find(id);
+            if (it == timer_callbacks.end()) {
+                continue; // cancelled
+            }
+            Callback cb = std::move(it->second);
+            timer_callbacks.erase(it);
+            cb();
+        }
+    }
+
+    std::map<socket_t, Callback> readers;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+    std::map<uint64_t, Callback> timer_callbacks;
+    uint64_t next_timer_id = 0;
+    bool stopped = false;
+};
+
+// Non-blocking IPv4 UDP socket
+class UdpSocket {
+public:
+    // bind to the given port, 0 picks an ephemeral one
+    explicit UdpSocket(uint16_t port = 0) {
+        sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock == INVALID_SOCKET_VALUE) {
+            throw std::runtime_error("Failed to create UDP socket");
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == SOCKET_ERROR_VALUE) {
+            CLOSE_SOCKET(sock);
+            throw std::runtime_error("Failed to bind UDP port " + std::to_string(port));
+        }
+        set_non_blocking(sock);
+    }
+
+    ~UdpSocket() {
+        CLOSE_SOCKET(sock);
+    }
+
+    UdpSocket(const UdpSocket&) = delete;
+    UdpSocket& operator=(const UdpSocket&) = delete;
+
+    socket_t handle() const { return sock; }
+
+    uint16_t local_port() const {
+        sockaddr_in addr{};
+        socklen_t len = sizeof(addr);
+        getsockname(sock, reinterpret_cast<sockaddr*>(&addr), &len);
+        return ntohs(addr.sin_port);
+    }
+
+    void send_to(const std::string& data, const sockaddr_in& to) {
+        // datagrams are fire and forget, a full send buffer just drops the packet
+        sendto(sock, data.data(), static_cast<int>(data.size()), 0,
+               reinterpret_cast<const sockaddr*>(&to), sizeof(to));
+    }
+
+    // returns false when no datagram is waiting
+    bool receive_from(std::string& data, sockaddr_in& from) {
+        char buffer[4096];
+        socklen_t from_len = sizeof(from);
+        auto received = recvfrom(sock, buffer, sizeof(buffer), 0, reinterpret_cast<sockaddr*>(&from), &from_len);
+        if (received <= 0) {
+            return false;
+        }
+        data.assign(buffer, static_cast<size_t>(received));
+        return true;
+    }
+
+private:
+    socket_t sock;
+};
+
+#endif
@@ -0,0 +1,414 @@
+#ifndef SESSION_HPP
+#define SESSION_HPP
+
+// this file contains the session: many torrents downloaded by one process. Torrents wait
+// in a queue and a fixed number of worker threads take turns downloading them, all sharing
+// one set of hasher threads, the rate limiter and the file handle cache. Each worker runs
+// the blocking download loop of one torrent, so only active_downloads torrents make
+// progress at a time and the rest only wait their turn
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "download.hpp"
+#include "magnet.hpp"
+#include "rate_limit.hpp"
+
+using TorrentId = uint64_t;
+
+enum class TorrentState { Queued, FetchingMetadata, Downloading, Paused, Complete, Failed };
+
+inline const char* torrent_state_name(TorrentState state) {
+    switch (state) {
+        case TorrentState::Queued: return "queued";
+        case TorrentState::FetchingMetadata: return "fetching";
+        case TorrentState::Downloading: return "downloading";
+        case TorrentState::Paused: return "paused";
+        case TorrentState::Complete: return "complete";
+        case TorrentState::Failed: return "failed";
+    }
+    return "unknown";
+}
+
+// a torrent as status() saw it
+struct TorrentStatus {
+    TorrentId id;
+    std::string name;
+    std::string info_hash; // hex
+    std::string output_path;
+    TorrentState state;
+    int64_t downloaded; // bytes of wanted pieces verified
+    int64_t wanted;
+    std::string error; // why it failed
+};
+
+// Function to download only the files with the given indices, those the info command prints
+inline void select_files(StorageOptions& options, size_t file_count, const std::vector<size_t>& indices) {
+    options.wanted_files.assign(file_count, false);
+    for (size_t index : indices) {
+        if (index >= file_count) {
+            throw std::runtime_error("No file with index " + std::to_string(index));
+        }
+        options.wanted_files[index] = true;
+    }
+}
+
+struct SessionSettings {
+    // torrents downloading at the same time, each holds a worker thread and one peer connection
+    size_t active_downloads = 4;
+    // 0 for one hasher per core
+    size_t hash_threads = 0;
+    // for all torrents together, 0 is unlimited
+    RateLimits global_limits;
+    // peers remembered across runs, shared by all torrents; empty or "none" for no cache
+    std::string peer_cache_path = default_peer_cache_path();
+    // peers the cache holds for all torrents together, raise it for sessions of many torrents
+    size_t peer_cache_size = PeerCache::DEFAULT_CAPACITY;
+};
+
+class Session {
+public:
+    explicit Session(const SessionSettings& session_settings = {})
+        : settings(session_settings),
+          hash_pool(settings.hash_threads ? settings.hash_threads : std::max(1u, std::thread::hardware_concurrency())),
+          peer_cache(open_peer_cache(settings.peer_cache_path, settings.peer_cache_size)),
+          snapshot(std::make_shared<const Snapshot>()) {
+        rate_limiter().set_global(settings.global_limits);
+        for (size_t i = 0; i < std::max<size_t>(settings.active_downloads, 1); ++i) {
+            workers.emplace_back([this] { run_worker(); });
+        }
+    }
+
+    // torrents being downloaded stop after their current piece
+    ~Session() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            for (auto& [id, entry] : torrents) {
+                entry->stop.store(true);
+            }
+        }
+        changed.notify_all();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+    }
+
+    Session(const Session&) = delete;
+    Session& operator=(const Session&) = delete;
+
+    // Function to queue a torrent for download, output_path "default" names it after the torrent
+    // peers are ones already known for it, such as those found while resolving a magnet link
+    TorrentId add(const std::string& encoded_value, const std::string& output_path,
+                  const StorageOptions& options = {}, const RateLimits& limits = {},
+                  const std::vector<PeerAddress>& peers = {}) {
+        auto entry = std::make_shared<Entry>();
+        entry->torrent = parse_torrent(encoded_value);
+        entry->peers = peers;
+        entry->output_path = output_path == "default" ? get_default_output_path(entry->torrent.info) : output_path;
+        entry->options = options;
+        entry->limits = limits;
+        return enqueue(entry);
+    }
+
+    // Function to queue a magnet link. It returns straight away, a worker fetches the
+    // metadata when the torrent's turn comes and it shows as fetching until then.
+    // files picks the files to download once their count is known, all of them if unset.
+    TorrentId add_magnet(const std::string& uri, const std::string& output_path, const StorageOptions& options = {},
+                         const RateLimits& limits = {}, const std::optional<std::vector<size_t>>& files = {}) {
+        MagnetLink magnet = parse_magnet_link(uri);
+        auto entry = std::make_shared<Entry>();
+        entry->magnet = uri;
+        entry->files = files;
+        // what status() shows until the metadata is in
+        entry->torrent.info.hash = magnet.info_hash;
+        entry->torrent.info.name = magnet.name;
+        entry->output_path = output_path == "default" ? "" : output_path;
+        entry->options = options;
+        entry->limits = limits;
+        return enqueue(entry);
+    }
+
+    // Function to stop downloading a torrent until resumed, pieces verified so far stay on disk
+    void pause(TorrentId id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Entry& entry = find(id);
+        if (entry.state == TorrentState::Queued) {
+            std::erase(queue, id);
+            entry.state = TorrentState::Paused;
+            publish();
+        } else if (on_worker(entry)) {
+            // the worker sets Paused once the download has returned
+            entry.stop.store(true);
+        }
+    }
+
+    // Function to queue a paused or failed torrent again
+    void resume(TorrentId id) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Entry& entry = find(id);
+            if (on_worker(entry)) {
+                // not stopped yet, let it keep going
+                entry.stop.store(false);
+                return;
+            }
+            if (entry.state != TorrentState::Paused && entry.state != TorrentState::Failed) {
+                return;
+            }
+            entry.state = TorrentState::Queued;
+            entry.error.clear();
+            queue.push_back(id);
+            publish();
+        }
+        changed.notify_all();
+    }
+
+    // Function to drop a torrent from the session, its files are left alone
+    void remove(TorrentId id) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            Entry& entry = find(id);
+            if (on_worker(entry)) {
+                // the worker drops it once the download has returned
+                entry.removed = true;
+                entry.stop.store(true);
+                publish();
+                return;
+            }
+            std::erase(queue, id);
+            torrents.erase(id);
+            publish();
+        }
+        changed.notify_all();
+    }
+
+    // Function to get the status of every torrent, in the order they were added. Never waits
+    // for the session mutex, so polling it can't hold up workers adding or finishing torrents.
+    std::vector<TorrentStatus> status() const {
+        std::shared_ptr<const Snapshot> current = snapshot.load(std::memory_order_acquire);
+        std::vector<TorrentStatus> torrents_status;
+        torrents_status.reserve(current->size());
+        for (const auto& [published, entry] : *current) {
+            TorrentStatus status = published;
+            status.downloaded = entry->progress.downloaded.load(std::memory_order_relaxed);
+            status.wanted = entry->progress.wanted.load(std::memory_order_relaxed);
+            torrents_status.push_back(std::move(status));
+        }
+        return torrents_status;
+    }
+
+    // Function to block until no torrent is queued or downloading
+    void wait_idle() {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return idle(); });
+    }
+
+    // the same giving up after timeout, true if the session is idle
+    template <typename Rep, typename Period>
+    bool wait_idle_for(const std::chrono::duration<Rep, Period>& timeout) {
+        std::unique_lock<std::mutex> lock(mutex);
+        return changed.wait_for(lock, timeout, [this] { return idle(); });
+    }
+
+private:
+    struct Entry {
+        TorrentId id = 0;
+        Torrent torrent;
+        std::string output_path;
+        StorageOptions options;
+        RateLimits limits;
+        TorrentState state = TorrentState::Queued;
+        std::string error;
+        DownloadProgress progress;
+        std::atomic<bool> stop{false};
+        bool removed = false;
+        std::string magnet;                       // until its metadata is fetched
+        std::optional<std::vector<size_t>> files; // file indices to select once the metadata is in
+        std::vector<PeerAddress> peers;           // known before the download, handed to it
+    };
+
+    static std::string hex_string(const std::vector<uint8_t>& bytes) {
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (uint8_t byte : bytes) {
+            hex += digits[byte >> 4];
+            hex += digits[byte & 0x0F];
+        }
+        return hex;
+    }
+
+    bool idle() const { return queue.empty() && active == 0; }
+
+    // a worker has the torrent, it stops and changes state when the worker is done with it
+    static bool on_worker(const Entry& entry) {
+        return entry.state == TorrentState::FetchingMetadata || entry.state == TorrentState::Downloading;
+    }
+
+    // Function to add an entry to the queue unless it clashes with a torrent already in the session
+    TorrentId enqueue(const std::shared_ptr<Entry>& entry) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            check_unique(entry->torrent.info.hash, entry->output_path, nullptr);
+            entry->id = next_id++;
+            torrents[entry->id] = entry;
+            queue.push_back(entry->id);
+            publish();
+        }
+        changed.notify_all();
+        return entry->id;
+    }
+
+    // Function to refuse a torrent already in the session or saved to the same place as
+    // another one than self, mutex held. An empty output path isn't known yet.
+    void check_unique(const std::vector<uint8_t>& info_hash, const std::string& output_path, const Entry* self) const {
+        for (const auto& [id, other] : torrents) {
+            if (other->removed || other.get() == self) {
+                continue;
+            }
+            if (other->torrent.info.hash == info_hash) {
+                throw std::runtime_error("Torrent is already in the session");
+            }
+            if (!output_path.empty() && other->output_path == output_path) {
+                throw std::runtime_error("Another torrent is being saved to " + output_path);
+            }
+        }
+    }
+
+    // Function to turn a magnet entry into a torrent, on its worker without the mutex held.
+    // Only the worker touches an entry that is fetching. publish() copies its fields into the
+    // status snapshot with the mutex held, so they're changed below under the mutex; status()
+    // never sees the entry itself, only the snapshot swapped in behind the atomic's spin lock.
+    void fetch_metadata(Entry& entry) {
+        ResolvedMagnet resolved = resolve_magnet_link(entry.magnet);
+        Torrent torrent = parse_torrent(resolved.torrent);
+        StorageOptions options = entry.options;
+        if (entry.files) {
+            select_files(options, torrent.info.files.size(), *entry.files);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        std::string output_path = entry.output_path.empty() ? get_default_output_path(torrent.info) : entry.output_path;
+        // a default output path is only known now
+        check_unique(torrent.info.hash, output_path, &entry);
+        entry.torrent = std::move(torrent);
+        entry.output_path = output_path;
+        entry.options = options;
+        entry.peers = std::move(resolved.peers);
+        entry.magnet.clear();
+        entry.state = TorrentState::Downloading;
+        publish();
+    }
+
+    // Function to republish what status() reads, called with the mutex held after every
+    // add, remove and state change. Byte counts aren't copied, status() reads them live.
+    void publish() {
+        auto next = std::make_shared<Snapshot>();
+        next->reserve(torrents.size());
+        for (const auto& [id, entry] : torrents) {
+            if (entry->removed) {
+                continue;
+            }
+            next->push_back({{id, entry->torrent.info.name, hex_string(entry->torrent.info.hash), entry->output_path,
+                              entry->state, 0, 0, entry->error},
+                             entry});
+        }
+        snapshot.store(std::move(next), std::memory_order_release);
+    }
+
+    Entry& find(TorrentId id) {
+        auto it = torrents.find(id);
+        if (it == torrents.end() || it->second->removed) {
+            throw std::runtime_error("No torrent with id " + std::to_string(id));
+        }
+        return *it->second;
+    }
+
+    // take queued torrents one at a time until the session goes away
+    void run_worker() {
+        while (true) {
+            std::shared_ptr<Entry> entry;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (stopping) {
+                    return;
+                }
+                entry = torrents.at(queue.front());
+                queue.pop_front();
+                entry->state = entry->magnet.empty() ? TorrentState::Downloading : TorrentState::FetchingMetadata;
+                entry->stop.store(false);
+                ++active;
+                publish();
+            }
+
+            DownloadContext context;
+            context.hash_pool = &hash_pool;
+            context.stop = &entry->stop;
+            context.progress = &entry->progress;
+            context.show_progress = false;
+            context.peer_cache = peer_cache.get();
+            TorrentState outcome = TorrentState::Complete;
+            std::string error;
+            try {
+                if (!entry->magnet.empty()) {
+                    fetch_metadata(*entry);
+                }
+                context.peers = entry->peers;
+                if (entry->stop.load() ||
+                    !download_torrent(entry->torrent, entry->output_path, entry->options, entry->limits, context)) {
+                    outcome = TorrentState::Paused;
+                }
+            } catch (const std::exception& e) {
+                outcome = TorrentState::Failed;
+                error = e.what();
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                --active;
+                entry->state = outcome;
+                entry->error = error;
+                if (entry->removed) {
+                    torrents.erase(entry->id);
+                } else if (outcome == TorrentState::Paused && !entry->stop.load() && !stopping) {
+                    // resumed while it was stopping
+                    entry->state = TorrentState::Queued;
+                    queue.push_back(entry->id);
+                }
+                publish();
+            }
+            changed.notify_all();
+        }
+    }
+
+    const SessionSettings settings;
+    HashPool hash_pool;
+    std::unique_ptr<PeerCache> peer_cache;
+
+    // Torrent statuses as of the last change, each with the entry its byte counts are read from.
+    // libstdc++ guards atomic<shared_ptr> with a spin lock in the atomic itself, so this is not
+    // lock free: status() can spin for the few instructions of a pointer swap in publish(),
+    // but it never waits behind the session mutex or a worker holding it.
+    using Snapshot = std::vector<std::pair<TorrentStatus, std::shared_ptr<const Entry>>>;
+    std::atomic<std::shared_ptr<const Snapshot>> snapshot;
+
+    mutable std::mutex mutex;
+    std::condition_variable changed;
+    std::map<TorrentId, std::shared_ptr<Entry>> torrents;
+    std::deque<TorrentId> queue; // ids waiting for a worker, oldest first
+    size_t active = 0;           // torrents being downloaded
+    TorrentId next_id = 1;
+    bool stopping = false;
+    std::vector<std::thread> workers; // last, so they start once everything above exists
+};
+
+#endif
@@ -23,6 +23,7 @@
 #define SHA1_HPP
 
 
+#include <algorithm>
 #include <cstdint>
 #include <fstream>
 #include <iomanip>
@@ -36,6 +37,7 @@ class SHA1
 public:
     SHA1();
     void update(const std::string &s);
+    void update(const uint8_t *data, size_t length);
     void update(std::istream &is);
     std::string final();
     static std::string from_file(const std::string &filename);
@@ -249,8 +251,45 @@ inline SHA1::SHA1()
 
 inline void SHA1::update(const std::string &s)
 {
-    std::istringstream is(s);
-    update(is);
+    update(reinterpret_cast<const uint8_t *>(s.data()), s.size());
+}
+
+
+/*
+ * Hash straight from memory, only a partial trailing block is copied into the buffer.
+ */
+
+inline void SHA1::update(const uint8_t *data, size_t length)
+{
+    uint32_t block[BLOCK_INTS];
+    if (!buffer.empty())
+    {
+        size_t take = std::min(length, BLOCK_BYTES - buffer.size());
+        buffer.append(reinterpret_cast<const char *>(data), take);
+        data += take;
+        length -= take;
+        if (buffer.size() != BLOCK_BYTES)
+        {
+            return;
+        }
+        buffer_to_block(buffer, block);
+        transform(digest, block, transforms);
+        buffer.clear();
+    }
+    while (length >= BLOCK_BYTES)
+    {
+        for (size_t i = 0; i < BLOCK_INTS; i++)
+        {
+            block[i] = (uint32_t)data[4*i+3]
+                       | (uint32_t)data[4*i+2]<<8
+                       | (uint32_t)data[4*i+1]<<16
+                       | (uint32_t)data[4*i+0]<<24;
+        }
+        transform(digest, block, transforms);
+        data += BLOCK_BYTES;
+        length -= BLOCK_BYTES;
+    }
+    buffer.append(reinterpret_cast<const char *>(data), length);
 }
 
 
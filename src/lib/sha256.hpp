@@ -0,0 +1,324 @@
+#ifndef SHA256_HPP
+#define SHA256_HPP
+
+// this file contains SHA-256 as used by BitTorrent v2. On x86 the compression function
+// runs on the SHA extensions (SHA-NI) when the CPU has them; without them equal sized
+// messages such as merkle leaves are hashed eight at a time with AVX2. Everything else
+// uses the portable code.
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    #define SHA256_X86 1
+    #include <cpuid.h>
+    #include <immintrin.h>
+#endif
+
+using Sha256Digest = std::array<uint8_t, 32>;
+
+namespace sha256_detail {
+
+constexpr size_t BLOCK_BYTES = 64;
+
+alignas(16) constexpr uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+constexpr uint32_t INITIAL_STATE[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+inline uint32_t rotr(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+inline uint32_t load_be32(const uint8_t* p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+inline void store_be32(uint8_t* p, uint32_t value) {
+    p[0] = static_cast<uint8_t>(value >> 24);
+    p[1] = static_cast<uint8_t>(value >> 16);
+    p[2] = static_cast<uint8_t>(value >> 8);
+    p[3] = static_cast<uint8_t>(value);
+}
+
+// run block_count 64 byte blocks through the compression function
+inline void compress_portable(uint32_t state[8], const uint8_t* data, size_t block_count) {
+    for (; block_count > 0; --block_count, data += BLOCK_BYTES) {
+        uint32_t w[64];
+        for (int t = 0; t < 16; ++t) {
+            w[t] = load_be32(data + 4 * t);
+        }
+        for (int t = 16; t < 64; ++t) {
+            uint32_t s0 = rotr(w[t - 15], 7) ^ rotr(w[t - 15], 18) ^ (w[t - 15] >> 3);
+            uint32_t s1 = rotr(w[t - 2], 17) ^ rotr(w[t - 2], 19) ^ (w[t - 2] >> 10);
+            w[t] = w[t - 16] + s0 + w[t - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int t = 0; t < 64; ++t) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[t] + w[t];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#ifdef SHA256_X86
+// Same as compress_portable on the SHA extensions. The state lives in two registers
+// in the ABEF/CDGH order sha256rnds2 wants; each iteration does four rounds.
+__attribute__((target("sha,sse4.1")))
+inline void compress_shani(uint32_t state[8], const uint8_t* data, size_t block_count) {
+    const __m128i BYTE_SWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i dcba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+    __m128i hgfe = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4));
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; block_count > 0; --block_count, data += BLOCK_BYTES) {
+        const __m128i abef_saved = abef;
+        const __m128i cdgh_saved = cdgh;
+        // message schedule, four words per register, msg[i % 4] holds words 4i..4i+3
+        __m128i msg[4];
+        for (int i = 0; i < 4; ++i) {
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i)), BYTE_SWAP);
+        }
+        for (int i = 0; i < 16; ++i) {
+            if (i >= 4) {
+                __m128i next = _mm_sha256msg1_epu32(msg[i % 4], msg[(i + 1) % 4]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(msg[(i + 3) % 4], msg[(i + 2) % 4], 4));
+                msg[i % 4] = _mm_sha256msg2_epu32(next, msg[(i + 3) % 4]);
+            }
+            __m128i words = _mm_add_epi32(msg[i % 4], _mm_load_si128(reinterpret_cast<const __m128i*>(K + 4 * i)));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, words);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(words, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abef_saved);
+        cdgh = _mm_add_epi32(cdgh, cdgh_saved);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+__attribute__((target("avx2")))
+inline __m256i rotr_x8(__m256i value, int bits) {
+    return _mm256_or_si256(_mm256_srli_epi32(value, bits), _mm256_slli_epi32(value, 32 - bits));
+}
+
+// Eight independent messages side by side, lane i of every register belongs to message i.
+// Each of data[0..7] points at block_count blocks, states[i] is the state of message i.
+__attribute__((target("avx2")))
+inline void compress_avx2_x8(uint32_t states[8][8], const uint8_t* const data[8], size_t block_count) {
+    __m256i s[8];
+    for (int j = 0; j < 8; ++j) {
+        s[j] = _mm256_setr_epi32(states[0][j], states[1][j], states[2][j], states[3][j],
+                                 states[4][j], states[5][j], states[6][j], states[7][j]);
+    }
+    for (size_t block = 0; block < block_count; ++block) {
+        const size_t offset = block * BLOCK_BYTES;
+        __m256i w[16];
+        for (int t = 0; t < 16; ++t) {
+            w[t] = _mm256_setr_epi32(
+                load_be32(data[0] + offset + 4 * t), load_be32(data[1] + offset + 4 * t),
+                load_be32(data[2] + offset + 4 * t), load_be32(data[3] + offset + 4 * t),
+                load_be32(data[4] + offset + 4 * t), load_be32(data[5] + offset + 4 * t),
+                load_be32(data[6] + offset + 4 * t), load_be32(data[7] + offset + 4 * t));
+        }
+        __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+        for (int t = 0; t < 64; ++t) {
+            // the schedule is kept as a rolling window of the last 16 words
+            if (t >= 16) {
+                __m256i w15 = w[(t - 15) % 16];
+                __m256i w2 = w[(t - 2) % 16];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr_x8(w15, 7), rotr_x8(w15, 18)), _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr_x8(w2, 17), rotr_x8(w2, 19)), _mm256_srli_epi32(w2, 10));
+                w[t % 16] = _mm256_add_epi32(_mm256_add_epi32(w[t % 16], s0), _mm256_add_epi32(w[(t - 7) % 16], s1));
+            }
+            __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(rotr_x8(e, 6), rotr_x8(e, 11)), rotr_x8(e, 25));
+            __m256i choose = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+            __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, sigma1),
+                                          _mm256_add_epi32(_mm256_add_epi32(choose, _mm256_set1_epi32(static_cast<int>(K[t]))), w[t % 16]));
+            __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(rotr_x8(a, 2), rotr_x8(a, 13)), rotr_x8(a, 22));
+            __m256i majority = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(a, b), _mm256_and_si256(a, c)), _mm256_and_si256(b, c));
+            __m256i t2 = _mm256_add_epi32(sigma0, majority);
+            h = g; g = f; f = e; e = _mm256_add_epi32(d, t1);
+            d = c; c = b; b = a; a = _mm256_add_epi32(t1, t2);
+        }
+        s[0] = _mm256_add_epi32(s[0], a); s[1] = _mm256_add_epi32(s[1], b);
+        s[2] = _mm256_add_epi32(s[2], c); s[3] = _mm256_add_epi32(s[3], d);
+        s[4] = _mm256_add_epi32(s[4], e); s[5] = _mm256_add_epi32(s[5], f);
+        s[6] = _mm256_add_epi32(s[6], g); s[7] = _mm256_add_epi32(s[7], h);
+    }
+    for (int j = 0; j < 8; ++j) {
+        alignas(32) uint32_t lanes[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), s[j]);
+        for (int i = 0; i < 8; ++i) {
+            states[i][j] = lanes[i];
+        }
+    }
+}
+
+inline bool cpu_has_sha_ni() {
+    unsigned int eax, ebx, ecx, edx;
+    // leaf 7 EBX bit 29 is SHA, SSE4.1 (leaf 1 ECX bit 19) is needed for the blend
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) || !(ebx & (1u << 29))) {
+        return false;
+    }
+    return __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 19));
+}
+
+inline bool cpu_has_avx2() {
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+using CompressFunction = void (*)(uint32_t*, const uint8_t*, size_t);
+
+// the fastest single stream compression function this CPU runs, picked once
+inline CompressFunction compress_function() {
+#ifdef SHA256_X86
+    static const CompressFunction selected = cpu_has_sha_ni() ? compress_shani : compress_portable;
+    return selected;
+#else
+    return compress_portable;
+#endif
+}
+
+// the padding blocks after the last whole block of a message: the tail, 0x80, zeros
+// and the bit length; returns how many blocks (1 or 2) it filled
+inline size_t final_blocks(const uint8_t* tail, size_t tail_length, uint64_t message_length, uint8_t out[2 * BLOCK_BYTES]) {
+    size_t blocks = tail_length + 9 > BLOCK_BYTES ? 2 : 1;
+    memset(out, 0, blocks * BLOCK_BYTES);
+    memcpy(out, tail, tail_length);
+    out[tail_length] = 0x80;
+    uint64_t bits = message_length * 8;
+    for (int i = 0; i < 8; ++i) {
+        out[blocks * BLOCK_BYTES - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+    }
+    return blocks;
+}
+
+} // namespace sha256_detail
+
+// Incremental SHA-256, feed it with update and read the digest with final
+class SHA256 {
+public:
+    SHA256() { reset(); }
+
+    void reset() {
+        memcpy(state, sha256_detail::INITIAL_STATE, sizeof(state));
+        buffered = 0;
+        total = 0;
+    }
+
+    void update(const uint8_t* data, size_t length) {
+        using sha256_detail::BLOCK_BYTES;
+        total += length;
+        if (buffered > 0) {
+            size_t take = std::min(length, BLOCK_BYTES - buffered);
+            memcpy(buffer + buffered, data, take);
+            buffered += take;
+            data += take;
+            length -= take;
+            if (buffered < BLOCK_BYTES) {
+                return;
+            }
+            sha256_detail::compress_function()(state, buffer, 1);
+            buffered = 0;
+        }
+        // whole blocks straight from the caller's memory
+        size_t blocks = length / BLOCK_BYTES;
+        if (blocks > 0) {
+            sha256_detail::compress_function()(state, data, blocks);
+        }
+        buffered = length % BLOCK_BYTES;
+        memcpy(buffer, data + blocks * BLOCK_BYTES, buffered);
+    }
+
+    void update(const std::string& s) {
+        update(reinterpret_cast<const uint8_t*>(s.data()), s.size());
+    }
+
+    Sha256Digest final() {
+        uint8_t padding[2 * sha256_detail::BLOCK_BYTES];
+        size_t blocks = sha256_detail::final_blocks(buffer, buffered, total, padding);
+        sha256_detail::compress_function()(state, padding, blocks);
+        Sha256Digest digest;
+        for (int i = 0; i < 8; ++i) {
+            sha256_detail::store_be32(digest.data() + 4 * i, state[i]);
+        }
+        reset();
+        return digest;
+    }
+
+    static Sha256Digest hash(const uint8_t* data, size_t length) {
+        SHA256 sha256;
+        sha256.update(data, length);
+        return sha256.final();
+    }
+
+private:
+    uint32_t state[8];
+    uint8_t buffer[sha256_detail::BLOCK_BYTES];
+    size_t buffered;
+    uint64_t total;
+};
+
+// Hash count messages of the same length, out[i] = SHA-256(messages[i]).
+// This is the merkle leaf case; without SHA-NI eight messages go through AVX2 at once.
+inline void sha256_many(const uint8_t* const* messages, size_t count, size_t length, Sha256Digest* out) {
+    size_t done = 0;
+#ifdef SHA256_X86
+    using sha256_detail::INITIAL_STATE;
+    // sha1.hpp has a BLOCK_BYTES of its own, so no using namespace here
+    const size_t block_bytes = sha256_detail::BLOCK_BYTES;
+    static const bool use_avx2 = !sha256_detail::cpu_has_sha_ni() && sha256_detail::cpu_has_avx2();
+    if (use_avx2) {
+        const size_t whole_blocks = length / block_bytes;
+        for (; done + 8 <= count; done += 8) {
+            uint32_t states[8][8];
+            uint8_t padding[8][2 * sha256_detail::BLOCK_BYTES];
+            const uint8_t* padding_data[8];
+            size_t padding_blocks = 0;
+            for (int i = 0; i < 8; ++i) {
+                memcpy(states[i], INITIAL_STATE, sizeof(INITIAL_STATE));
+                padding_blocks = sha256_detail::final_blocks(messages[done + i] + whole_blocks * block_bytes,
+                                                             length % block_bytes, length, padding[i]);
+                padding_data[i] = padding[i];
+            }
+            sha256_detail::compress_avx2_x8(states, messages + done, whole_blocks);
+            sha256_detail::compress_avx2_x8(states, padding_data, padding_blocks);
+            for (int i = 0; i < 8; ++i) {
+                for (int j = 0; j < 8; ++j) {
+                    sha256_detail::store_be32(out[done + i].data() + 4 * j, states[i][j]);
+                }
+            }
+        }
+    }
+#endif
+    for (; done < count; ++done) {
+        out[done] = SHA256::hash(messages[done], length);
+    }
+}
+
+#endif
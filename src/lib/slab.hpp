@@ -0,0 +1,106 @@
+#ifndef SLAB_HPP
+#define SLAB_HPP
+
+// this file contains the slab allocator behind peer message buffers: fixed size
+// slabs recycled through per-thread free lists so receiving a block doesn't hit the heap
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+class SlabCache {
+public:
+    // control messages (have, request, reject, ...) and everything else small
+    static constexpr size_t SMALL_SLAB = 256;
+    // a piece message: index, begin and a 16 KiB block, with room for extension message headers
+    static constexpr size_t BLOCK_SLAB = 16 * 1024 + 128;
+    // slabs kept per thread and size class, anything beyond goes back to the heap
+    static constexpr size_t MAX_CACHED = 64;
+
+    static void* allocate(size_t size) {
+        FreeList* list = list_for(size);
+        if (list && !list->slabs.empty()) {
+            void* slab = list->slabs.back();
+            list->slabs.pop_back();
+            return slab;
+        }
+        ++stats().heap_allocations;
+        return ::operator new(slab_size(size));
+    }
+
+    static void deallocate(void* slab, size_t size) {
+        FreeList* list = list_for(size);
+        if (list && list->slabs.size() < MAX_CACHED) {
+            list->slabs.push_back(slab);
+            return;
+        }
+        ::operator delete(slab);
+    }
+
+    // times this thread had to go to the heap, flat once the free lists are warm
+    static size_t heap_allocations() { return stats().heap_allocations; }
+
+private:
+    struct FreeList {
+        FreeList() { slabs.reserve(MAX_CACHED); }
+        ~FreeList() {
+            for (void* slab : slabs) {
+                ::operator delete(slab);
+            }
+            lists_destroyed() = true;
+        }
+        std::vector<void*> slabs;
+    };
+
+    struct Stats {
+        size_t heap_allocations = 0;
+    };
+
+    static size_t slab_size(size_t size) {
+        if (size <= SMALL_SLAB) return SMALL_SLAB;
+        if (size <= BLOCK_SLAB) return BLOCK_SLAB;
+        return size;
+    }
+
+    // nullptr for sizes that aren't slab sized, or once the thread is shutting down
+    static FreeList* list_for(size_t size) {
+        if (size > BLOCK_SLAB || lists_destroyed()) {
+            return nullptr;
+        }
+        thread_local FreeList lists[2];
+        return &lists[size <= SMALL_SLAB ? 0 : 1];
+    }
+
+    // trivially destructible, so still readable while other thread locals are torn down
+    static bool& lists_destroyed() {
+        thread_local bool destroyed = false;
+        return destroyed;
+    }
+
+    static Stats& stats() {
+        thread_local Stats counters;
+        return counters;
+    }
+};
+
+// std allocator handing out SlabCache slabs, for containers that hold message payloads
+template <typename T>
+struct SlabAllocator {
+    using value_type = T;
+
+    SlabAllocator() = default;
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U>&) {}
+
+    T* allocate(size_t n) { return static_cast<T*>(SlabCache::allocate(n * sizeof(T))); }
+    void deallocate(T* p, size_t n) { SlabCache::deallocate(p, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const SlabAllocator<U>&) const { return true; }
+};
+
+// payload of a peer message
+using MessageBuffer = std::vector<uint8_t, SlabAllocator<uint8_t>>;
+
+#endif
@@ -0,0 +1,597 @@
+#ifndef STORAGE_HPP
+#define STORAGE_HPP
+
+// this file contains the storage layer: mapping piece data onto the files of a torrent
+// and reading/writing it with positional I/O
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "metrics.hpp"
+#include "torrent.hpp"
+#include "trace.hpp"
+#include "utils.hpp"
+
+#ifdef _WIN32
+    #include <io.h>
+    #include <fcntl.h>
+    #include <sys/stat.h>
+#else
+    #include <fcntl.h>
+    #include <sys/resource.h>
+    #include <sys/stat.h>
+    #include <sys/uio.h>
+    #include <unistd.h>
+#endif
+
+// a contiguous range of one file that part of a piece maps to
+struct FileSpan {
+    size_t file_index;
+    int64_t file_offset;   // where in the file
+    int64_t length;
+    int64_t buffer_offset; // where in the piece buffer
+};
+
+// Function to write len bytes at offset through an iovec, no copying into a staging buffer
+inline void write_at(int fd, const uint8_t* data, size_t len, int64_t offset) {
+    while (len > 0) {
+#ifdef _WIN32
+        _lseeki64(fd, offset, SEEK_SET);
+        int written = _write(fd, data, static_cast<unsigned int>(len));
+#else
+        iovec iov{const_cast<uint8_t*>(data), len};
+        ssize_t written = pwritev(fd, &iov, 1, offset);
+        client_metrics().pwrite_calls.add();
+#endif
+        if (written <= 0) {
+            throw std::runtime_error("Failed to write piece to file");
+        }
+        data += written;
+        len -= written;
+        offset += written;
+    }
+}
+
+// Function to read len bytes at offset, returns false on a short read
+inline bool read_at(int fd, uint8_t* data, size_t len, int64_t offset) {
+    while (len > 0) {
+#ifdef _WIN32
+        _lseeki64(fd, offset, SEEK_SET);
+        int got = _read(fd, data, static_cast<unsigned int>(len));
+#else
+        ssize_t got = pread(fd, data, len, offset);
+        client_metrics().pread_calls.add();
+#endif
+        if (got <= 0) {
+            return false;
+        }
+        data += got;
+        len -= got;
+        offset += got;
+    }
+    return true;
+}
+
+// how the files of a torrent get their disk space
+enum class AllocationMode {
+    Sparse, // only set the file size, blocks are allocated as pieces arrive
+    Full    // reserve every block up front so the file ends up in a few contiguous extents
+};
+
+// per torrent storage settings
+struct StorageOptions {
+    AllocationMode allocation = AllocationMode::Full;
+    // write piece data with O_DIRECT so it bypasses the page cache
+    bool direct_io = false;
+    // files to download, empty means all of them
+    std::vector<bool> wanted_files;
+};
+
+// Function to grow a file to length, never shrinking it or touching existing data
+inline void allocate_file(int fd, int64_t length, AllocationMode mode) {
+#ifdef _WIN32
+    if (_filelengthi64(fd) < length && _chsize_s(fd, length) != 0) {
+        throw std::runtime_error("Failed to allocate file");
+    }
+#else
+    struct stat st{};
+    if (fstat(fd, &st) != 0) {
+        throw std::runtime_error("Failed to stat file");
+    }
+#ifdef __linux__
+    // fallocate also fills in holes left by an earlier sparse allocation
+    if (mode == AllocationMode::Full && length > 0 && fallocate(fd, 0, 0, length) == 0) {
+        return;
+    }
+    // not supported by this filesystem, fall back to a sparse file
+#else
+    (void)mode;
+#endif
+    if (st.st_size < length && ftruncate(fd, length) != 0) {
+        throw std::runtime_error("Failed to allocate file");
+    }
+#endif
+}
+
+// Function to give the blocks of a byte range back to the filesystem, the file size is unchanged
+inline void punch_hole(int fd, int64_t offset, int64_t length) {
+#ifdef __linux__
+    if (length > 0) {
+        // best effort, on filesystems without hole punching the data simply stays
+        (void)fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+    }
+#else
+    (void)fd;
+    (void)offset;
+    (void)length;
+#endif
+}
+
+// O_DIRECT needs buffer addresses, file offsets and lengths in multiples of this
+const size_t DIRECT_IO_ALIGNMENT = 4096;
+
+// Fixed set of page aligned piece buffers, allocated on first use and recycled after.
+// acquire blocks while all of them are out, so memory use never grows past
+// max_buffers * buffer_size however long we run.
+class AlignedBufferPool {
+public:
+    struct Releaser {
+        AlignedBufferPool* pool;
+        void operator()(uint8_t* buffer) const { pool->release(buffer); }
+    };
+    using Buffer = std::unique_ptr<uint8_t[], Releaser>;
+
+    AlignedBufferPool(size_t buffer_size, size_t max_buffers)
+        : size((buffer_size + DIRECT_IO_ALIGNMENT - 1) / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT),
+          max_count(std::max<size_t>(max_buffers, 1)) {}
+
+    // every buffer must have been returned by now
+    ~AlignedBufferPool() {
+        for (uint8_t* buffer : free_buffers) {
+            free_aligned(buffer);
+        }
+    }
+
+    AlignedBufferPool(const AlignedBufferPool&) = delete;
+    AlignedBufferPool& operator=(const AlignedBufferPool&) = delete;
+
+    Buffer acquire() {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [this] { return !free_buffers.empty() || allocated < max_count; });
+        uint8_t* buffer;
+        if (!free_buffers.empty()) {
+            buffer = free_buffers.back();
+            free_buffers.pop_back();
+        } else {
+#ifdef _WIN32
+            buffer = static_cast<uint8_t*>(_aligned_malloc(size, DIRECT_IO_ALIGNMENT));
+#else
+            buffer = static_cast<uint8_t*>(std::aligned_alloc(DIRECT_IO_ALIGNMENT, size));
+#endif
+            if (!buffer) {
+                throw std::bad_alloc();
+            }
+            ++allocated;
+        }
+        return Buffer(buffer, Releaser{this});
+    }
+
+    size_t buffer_size() const { return size; }
+
+    // Function to wait until every buffer handed out has come back, the pool can go after that
+    void wait_all_returned() {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [this] { return free_buffers.size() == allocated; });
+    }
+
+private:
+    void release(uint8_t* buffer) {
+        // notified under the lock, once the last buffer is back the pool may be destroyed
+        std::lock_guard<std::mutex> lock(mutex);
+        free_buffers.push_back(buffer);
+        available.notify_all();
+    }
+
+    static void free_aligned(uint8_t* buffer) {
+#ifdef _WIN32
+        _aligned_free(buffer);
+#else
+        std::free(buffer);
+#endif
+    }
+
+    const size_t size;
+    const size_t max_count;
+    size_t allocated = 0;
+    std::vector<uint8_t*> free_buffers;
+    std::mutex mutex;
+    std::condition_variable available;
+};
+
+// how a cached file is opened, a read-only handle is reopened read/write when needed.
+// Direct handles are write handles opened with O_DIRECT, cached next to the buffered one.
+enum class FileMode { Read, ReadWrite, Direct };
+
+// an open file descriptor, closed when the last user lets go of it
+class FileHandle {
+public:
+    FileHandle(int descriptor, FileMode open_mode) : fd(descriptor), mode(open_mode) {}
+    ~FileHandle() { ::close(fd); }
+
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+
+    const int fd;
+    const FileMode mode;
+};
+
+// Function to guess a sensible number of files to keep open from the process fd limit
+inline size_t default_open_file_limit() {
+#ifndef _WIN32
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        // leave the other half for sockets
+        return std::clamp<size_t>(limit.rlim_cur / 2, 16, 4096);
+    }
+#endif
+    return 256;
+}
+
+// LRU cache of open files shared by every torrent in the process.
+// Files are opened lazily on first use and closed when the cache is over its limit
+// or a handle sat unused for longer than the idle timeout. Callers hold a
+// shared_ptr while doing I/O so an eviction never closes a descriptor in use.
+class FileHandleCache {
+public:
+    explicit FileHandleCache(size_t capacity = default_open_file_limit(),
+                             std::chrono::seconds idle = std::chrono::seconds(120))
+        : max_open(std::max<size_t>(capacity, 1)), idle_timeout(idle) {}
+
+    FileHandleCache(const FileHandleCache&) = delete;
+    FileHandleCache& operator=(const FileHandleCache&) = delete;
+
+    // handle for path, opened (or upgraded to read/write) if needed; ReadWrite creates missing files
+    std::shared_ptr<FileHandle> get(const std::string& path, FileMode mode) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        evict_idle(now);
+
+        // the buffered and the direct handle of a file are separate entries
+        std::string key = mode == FileMode::Direct ? path + '\0' : path;
+        auto it = open_files.find(key);
+        if (it != open_files.end()) {
+            if (mode == FileMode::ReadWrite && it->second.handle->mode == FileMode::Read) {
+                it->second.handle = open_file(path, mode);
+            }
+            it->second.last_used = now;
+            lru.splice(lru.end(), lru, it->second.position);
+            return it->second.handle;
+        }
+
+        std::shared_ptr<FileHandle> handle = open_file(path, mode);
+        while (open_files.size() >= max_open) {
+            evict_oldest();
+        }
+        lru.push_back(key);
+        open_files[key] = {handle, std::prev(lru.end()), now};
+        return handle;
+    }
+
+    // drop a file from the cache, e.g. before it is deleted or renamed
+    void close(const std::string& path) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const std::string& key : {path, path + '\0'}) {
+            auto it = open_files.find(key);
+            if (it != open_files.end()) {
+                lru.erase(it->second.position);
+                open_files.erase(it);
+            }
+        }
+    }
+
+    void set_capacity(size_t capacity) {
+        std::lock_guard<std::mutex> lock(mutex);
+        max_open = std::max<size_t>(capacity, 1);
+        while (open_files.size() > max_open) {
+            evict_oldest();
+        }
+    }
+
+    void set_idle_timeout(std::chrono::seconds idle) {
+        std::lock_guard<std::mutex> lock(mutex);
+        idle_timeout = idle;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return open_files.size();
+    }
+
+private:
+    struct OpenFile {
+        std::shared_ptr<FileHandle> handle;
+        std::list<std::string>::iterator position;
+        std::chrono::steady_clock::time_point last_used;
+    };
+
+    static std::shared_ptr<FileHandle> open_file(const std::string& path, FileMode mode) {
+        if (mode == FileMode::Direct) {
+#ifdef O_DIRECT
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | O_DIRECT, 0644);
+            if (fd < 0) {
+                throw std::runtime_error("Failed to open file for direct I/O: " + path);
+            }
+            return std::make_shared<FileHandle>(fd, mode);
+#else
+            throw std::runtime_error("Direct I/O is not supported on this platform");
+#endif
+        }
+#ifdef _WIN32
+        int fd = mode == FileMode::Read
+            ? _open(path.c_str(), _O_RDONLY | _O_BINARY)
+            : _open(path.c_str(), _O_RDWR | _O_CREAT | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        int fd = mode == FileMode::Read
+            ? ::open(path.c_str(), O_RDONLY | O_CLOEXEC)
+            : ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+#endif
+        if (fd < 0) {
+            throw std::runtime_error("Failed to open file: " + path);
+        }
+        return std::make_shared<FileHandle>(fd, mode);
+    }
+
+    // called with the lock held, the lru list is ordered by last use so only its front needs checking
+    void evict_idle(std::chrono::steady_clock::time_point now) {
+        while (!lru.empty() && now - open_files[lru.front()].last_used > idle_timeout) {
+            evict_oldest();
+        }
+    }
+
+    void evict_oldest() {
+        open_files.erase(lru.front());
+        lru.pop_front();
+    }
+
+    mutable std::mutex mutex;
+    size_t max_open;
+    std::chrono::seconds idle_timeout;
+    std::list<std::string> lru; // least recently used first
+    std::unordered_map<std::string, OpenFile> open_files;
+};
+
+// the cache every FileStorage uses unless given its own
+inline FileHandleCache& shared_file_cache() {
+    static FileHandleCache cache;
+    return cache;
+}
+
+// Maps the piece space of a torrent onto its files.
+// File start offsets are precomputed so the files a byte range touches are found
+// with a binary search, and a piece is written straight from its buffer into
+// every file it covers.
+class FileStorage {
+public:
+    // single file torrents are stored at output_path, multi-file ones below the directory output_path
+    FileStorage(const Info& torrent_info, const std::string& output_path,
+                const StorageOptions& storage_options = {}, FileHandleCache& cache = shared_file_cache())
+        : info(torrent_info), options(storage_options), handles(cache) {
+        if (!options.wanted_files.empty() && options.wanted_files.size() != info.files.size()) {
+            throw std::runtime_error("File selection does not match the number of files in the torrent");
+        }
+        file_starts.reserve(info.files.size());
+        for (const FileEntry& file : info.files) {
+            file_starts.push_back(file.offset);
+            if (info.multi_file) {
+                std::filesystem::path path(output_path);
+                for (const std::string& component : file.path) {
+                    path /= component;
+                }
+                paths.push_back(path.string());
+            } else {
+                paths.push_back(output_path);
+            }
+        }
+        // a piece is needed if any of the files it touches is
+        wanted_pieces.assign(piece_count(info), options.wanted_files.empty());
+        if (!options.wanted_files.empty()) {
+            for (size_t i = 0; i < wanted_pieces.size(); ++i) {
+                for (const FileSpan& span : map_block(i, 0, piece_size(info, i))) {
+                    if (options.wanted_files[span.file_index] && !info.files[span.file_index].pad) {
+                        wanted_pieces[i] = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    bool wants_file(size_t file_index) const {
+        return options.wanted_files.empty() || options.wanted_files[file_index];
+    }
+
+    bool wants_piece(size_t piece_index) const { return wanted_pieces[piece_index]; }
+
+    // bytes in the pieces we want
+    int64_t wanted_length() const {
+        int64_t total = 0;
+        for (size_t i = 0; i < wanted_pieces.size(); ++i) {
+            if (wanted_pieces[i]) {
+                total += piece_size(info, i);
+            }
+        }
+        return total;
+    }
+
+    // Find the file spans covering [offset, offset + length) of a piece
+    std::vector<FileSpan> map_block(size_t piece_index, int64_t offset, int64_t length) const {
+        std::vector<FileSpan> spans;
+        int64_t position = static_cast<int64_t>(piece_index) * info.plength + offset;
+        int64_t end = std::min(position + length, info.length);
+        // last file starting at or before position
+        size_t file = std::upper_bound(file_starts.begin(), file_starts.end(), position) - file_starts.begin() - 1;
+        int64_t buffer_offset = 0;
+        while (position < end && file < info.files.size()) {
+            const FileEntry& entry = info.files[file];
+            int64_t in_file = position - entry.offset;
+            int64_t span = std::min(entry.length - in_file, end - position);
+            if (span > 0) {
+                spans.push_back({file, in_file, span, buffer_offset});
+                position += span;
+                buffer_offset += span;
+            }
+            ++file;
+        }
+        return spans;
+    }
+
+    // Create missing directories and allocate wanted files with the configured mode.
+    // Existing data is kept so an interrupted download can resume. Files we don't want
+    // aren't created, and if they exist their blocks are released except for the
+    // pieces they share with wanted files.
+    void create_files() {
+        for (size_t i = 0; i < paths.size(); ++i) {
+            if (info.files[i].pad) {
+                continue; // padding only exists in the piece space
+            }
+            std::filesystem::path path(paths[i]);
+            if (path.has_parent_path()) {
+                std::filesystem::create_directories(path.parent_path());
+            }
+            if (wants_file(i)) {
+                std::shared_ptr<FileHandle> file = handles.get(paths[i], FileMode::ReadWrite);
+                allocate_file(file->fd, info.files[i].length, options.allocation);
+            } else {
+                std::error_code ec;
+                if (std::filesystem::exists(path, ec)) {
+                    release_unwanted_file(i);
+                }
+            }
+        }
+    }
+
+    // Write a whole piece, fanning out into one positional write per file it covers.
+    // The bytes of a piece shared with a file we don't want are dropped rather than
+    // creating that file, so such a piece is fetched again after a restart.
+    void write_piece(size_t piece_index, const uint8_t* data, size_t length) {
+        TRACE_SPAN_ARG("disk write", piece_index);
+        GaugeShare writing(client_metrics().disk_queue_depth);
+        writing.set(1);
+        for (const FileSpan& span : map_block(piece_index, 0, static_cast<int64_t>(length))) {
+            if (info.files[span.file_index].pad || !wants_file(span.file_index)) {
+                continue;
+            }
+            if (options.direct_io && direct_supported) {
+                write_span_direct(span, data + span.buffer_offset);
+            } else {
+                write_buffered(span.file_index, data + span.buffer_offset, span.length, span.file_offset);
+            }
+        }
+    }
+
+    // Read a whole piece, false if any file is missing or too short
+    bool read_piece(size_t piece_index, uint8_t* data, size_t length) {
+        TRACE_SPAN_ARG("disk read", piece_index);
+        for (const FileSpan& span : map_block(piece_index, 0, static_cast<int64_t>(length))) {
+            if (info.files[span.file_index].pad) {
+                memset(data + span.buffer_offset, 0, static_cast<size_t>(span.length));
+                continue;
+            }
+            std::shared_ptr<FileHandle> file;
+            try {
+                file = handles.get(paths[span.file_index], FileMode::Read);
+            } catch (const std::exception&) {
+                return false;
+            }
+            if (!read_at(file->fd, data + span.buffer_offset, span.length, span.file_offset)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const std::string& file_path(size_t file_index) const { return paths[file_index]; }
+
+private:
+    void write_buffered(size_t file_index, const uint8_t* data, int64_t length, int64_t offset) {
+        if (length > 0) {
+            std::shared_ptr<FileHandle> file = handles.get(paths[file_index], FileMode::ReadWrite);
+            write_at(file->fd, data, length, offset);
+        }
+    }
+
+    // The aligned middle of a span goes out with O_DIRECT, the unaligned head and tail
+    // (file boundaries, the short last piece) through the page cache
+    void write_span_direct(const FileSpan& span, const uint8_t* data) {
+        const int64_t alignment = static_cast<int64_t>(DIRECT_IO_ALIGNMENT);
+        int64_t misalignment = static_cast<int64_t>(reinterpret_cast<uintptr_t>(data) % DIRECT_IO_ALIGNMENT);
+        if (misalignment != span.file_offset % alignment) {
+            // memory and file can't both be aligned without a copy
+            write_buffered(span.file_index, data, span.length, span.file_offset);
+            return;
+        }
+        int64_t head = std::min(span.length, (alignment - misalignment) % alignment);
+        int64_t body = (span.length - head) / alignment * alignment;
+        write_buffered(span.file_index, data, head, span.file_offset);
+        if (body > 0) {
+            std::shared_ptr<FileHandle> file;
+            try {
+                file = handles.get(paths[span.file_index], FileMode::Direct);
+            } catch (const std::exception& e) {
+                // e.g. a filesystem that refuses O_DIRECT, stay buffered from now on
+                std::cerr << e.what() << ", falling back to buffered writes" << std::endl;
+                direct_supported = false;
+            }
+            if (file) {
+                write_at(file->fd, data + head, body, span.file_offset + head);
+            } else {
+                write_buffered(span.file_index, data + head, body, span.file_offset + head);
+            }
+        }
+        write_buffered(span.file_index, data + head + body, span.length - head - body, span.file_offset + head + body);
+    }
+
+    // punch out the part of an unwanted file that no wanted piece overlaps
+    void release_unwanted_file(size_t file_index) {
+        const FileEntry& entry = info.files[file_index];
+        if (entry.length == 0) {
+            return;
+        }
+        int64_t start = entry.offset;
+        int64_t end = entry.offset + entry.length;
+        size_t first_piece = static_cast<size_t>(start / info.plength);
+        size_t last_piece = static_cast<size_t>((end - 1) / info.plength);
+        if (wanted_pieces[first_piece]) {
+            start = static_cast<int64_t>(first_piece + 1) * info.plength;
+        }
+        if (wanted_pieces[last_piece]) {
+            end = static_cast<int64_t>(last_piece) * info.plength;
+        }
+        if (start < end) {
+            std::shared_ptr<FileHandle> file = handles.get(paths[file_index], FileMode::ReadWrite);
+            punch_hole(file->fd, start - entry.offset, end - start);
+        }
+    }
+
+    const Info& info;
+    StorageOptions options;
+    std::atomic<bool> direct_supported{true}; // pieces may be written from several hasher threads
+    std::vector<bool> wanted_pieces;
+    std::vector<int64_t> file_starts;
+    std::vector<std::string> paths;
+    FileHandleCache& handles;
+};
+
+#endif
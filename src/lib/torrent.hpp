@@ -8,6 +8,25 @@
 #include <vector>
 #include <cstdint>
 
+// one file of the torrent
+struct FileEntry {
+    // length - The length of the file, in bytes.
+    int64_t length;
+
+    // path - A list of UTF-8 encoded strings corresponding to subdirectory names, the last of which is the actual file name.
+    // For multi-file torrents this is relative to the directory called name.
+    std::vector<std::string> path;
+
+    // where the file starts when all files are laid end to end, pieces span this concatenation
+    int64_t offset;
+
+    // padding up to the next piece boundary (BEP 47 attr "p"), zeros that are never stored
+    bool pad = false;
+
+    // pieces root - v2 only, root of the file's merkle tree, empty for empty files
+    std::vector<uint8_t> pieces_root{};
+};
+
 // info dictionary
 struct Info {
     
@@ -24,15 +43,31 @@ struct Info {
     // since it's not utf-8 i need datatype other than char/string
     std::vector<uint8_t> pieces;
 
-    // let's just do single file case only
-    //length - The length of the file, in bytes.
+    //length - The length of the file, in bytes. For multi-file torrents the sum of all file lengths.
     int64_t length;
 
+    // files - For multi-file torrents the list of files in the order their data appears in the pieces.
+    // Single file torrents get one entry named after name, so code can always walk files.
+    std::vector<FileEntry> files;
+
+    // true if the torrent had a files list, output then goes into a directory
+    bool multi_file = false;
+
     // path - A list of UTF-8 encoded strings corresponding to subdirectory names, the last of which is the actual file name (a zero length list is an error case).
     std::vector<std::string> path;
 
-    // hash of info
+    // hash of info, truncated SHA-256 for v2 only torrents since the wire protocol carries 20 bytes
     std::vector<uint8_t> hash;
+
+    // meta version - 2 for v2 (BEP 52) and hybrid torrents, pieces are then verified with the merkle trees
+    int meta_version = 1;
+
+    // v2: full SHA-256 of info
+    std::vector<uint8_t> hash_v2;
+
+    // v2: expected hash of every piece, 32 bytes each, taken from the piece layers
+    // (or the pieces root of a file that fits in one piece)
+    std::vector<uint8_t> piece_hashes_v2;
 };
 
 struct Torrent{
@@ -41,9 +76,13 @@ struct Torrent{
     //The URL of the tracker.
     std::string announce;
 
+    //announce-list (BEP 12)
+    //Every tracker URL, announce first, tiers flattened in order.
+    std::vector<std::string> trackers;
+
     //info
     //This maps to a dictionary, with keys described in struct Info.
     Info info;
-} torr;
+};
 
 #endif 
\ No newline at end of file
@@ -0,0 +1,210 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+// this file contains hot path tracing: scoped spans recorded into per-thread ring buffers
+// and written out as a Chrome trace_event JSON file (chrome://tracing, ui.perfetto.dev).
+// Spans only exist when built with BITTORRENT_TRACING, otherwise the macros expand to nothing.
+//
+//   TRACE_SPAN("hash");                       // from here to the end of the scope
+//   TRACE_SPAN_ARG("piece", piece_index);     // the same with a number shown next to it
+//   TRACE_ASYNC("block", id, start_ns);       // a span from start_ns to now, may overlap others
+//   TRACE_THREAD_NAME("hasher");              // label the calling thread's track
+
+#include <stdexcept>
+#include <string>
+
+#ifdef BITTORRENT_TRACING
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+inline int64_t trace_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// one finished span, name points to a string literal
+struct TraceEvent {
+    const char* name;
+    int64_t start_ns;
+    int64_t duration_ns;
+    int64_t arg;     // shown as args.value, -1 for none
+    uint64_t async_id; // 0 for spans nested on the thread's track
+};
+
+// Events of one thread. Only the owning thread writes; when full the oldest events are
+// overwritten, so a long download keeps its last TRACE_RING_SIZE events per thread.
+class TraceRing {
+public:
+    static constexpr size_t TRACE_RING_SIZE = 1 << 16;
+
+    TraceRing(int thread_id, std::string thread_name)
+        : tid(thread_id), name(std::move(thread_name)), events(TRACE_RING_SIZE) {}
+
+    void push(const TraceEvent& event) {
+        size_t at = head.load(std::memory_order_relaxed);
+        events[at % TRACE_RING_SIZE] = event;
+        head.store(at + 1, std::memory_order_release);
+    }
+
+    const int tid;
+    std::string name;
+
+private:
+    friend class Tracer;
+    std::vector<TraceEvent> events;
+    std::atomic<size_t> head{0};
+};
+
+// Owns every thread's ring. Rings stay around after their thread exits so the hasher
+// threads of a finished download still show up in the file.
+class Tracer {
+public:
+    static Tracer& instance() {
+        static Tracer tracer;
+        return tracer;
+    }
+
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+    void enable(bool value) { on.store(value, std::memory_order_relaxed); }
+
+    // the calling thread's ring, created on its first event
+    TraceRing& ring() {
+        thread_local TraceRing* mine = nullptr;
+        if (!mine) {
+            std::lock_guard<std::mutex> lock(mutex);
+            int tid = static_cast<int>(rings.size()) + 1;
+            rings.push_back(std::make_unique<TraceRing>(tid, "thread " + std::to_string(tid)));
+            mine = rings.back().get();
+        }
+        return *mine;
+    }
+
+    // Function to write every recorded event as Chrome trace_event JSON. Meant to run once
+    // threads are done; events recorded while it runs may come out torn.
+    void write(const std::string& path) {
+        std::ofstream out(path);
+        if (!out) {
+            throw std::runtime_error("Failed to create trace file " + path);
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        out << std::fixed << std::setprecision(3); // microseconds with ns resolution
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        bool first = true;
+        auto separator = [&]() -> std::ostream& {
+            out << (first ? "" : ",\n");
+            first = false;
+            return out;
+        };
+        for (const auto& ring : rings) {
+            separator() << "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" << ring->tid
+                        << ",\"args\":{\"name\":\"" << ring->name << "\"}}";
+            size_t head = ring->head.load(std::memory_order_acquire);
+            size_t begin = head > TraceRing::TRACE_RING_SIZE ? head - TraceRing::TRACE_RING_SIZE : 0;
+            for (size_t i = begin; i < head; ++i) {
+                const TraceEvent& event = ring->events[i % TraceRing::TRACE_RING_SIZE];
+                std::string args = event.arg >= 0 ? ",\"args\":{\"value\":" + std::to_string(event.arg) + "}" : "";
+                if (event.async_id == 0) {
+                    separator() << "{\"ph\":\"X\",\"name\":\"" << event.name << "\",\"pid\":1,\"tid\":" << ring->tid
+                                << ",\"ts\":" << event.start_ns / 1000.0 << ",\"dur\":" << event.duration_ns / 1000.0
+                                << args << "}";
+                } else {
+                    // overlapping spans like pipelined block requests get a track of their own per name
+                    separator() << "{\"ph\":\"b\",\"cat\":\"" << event.name << "\",\"name\":\"" << event.name
+                                << "\",\"id\":" << event.async_id << ",\"pid\":1,\"tid\":" << ring->tid
+                                << ",\"ts\":" << event.start_ns / 1000.0 << args << "}";
+                    separator() << "{\"ph\":\"e\",\"cat\":\"" << event.name << "\",\"name\":\"" << event.name
+                                << "\",\"id\":" << event.async_id << ",\"pid\":1,\"tid\":" << ring->tid
+                                << ",\"ts\":" << (event.start_ns + event.duration_ns) / 1000.0 << "}";
+                }
+            }
+        }
+        out << "\n]}\n";
+    }
+
+private:
+    std::atomic<bool> on{false};
+    std::mutex mutex;
+    std::vector<std::unique_ptr<TraceRing>> rings;
+};
+
+// Records the time from its construction to the end of the scope, if tracing was on at the start
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, int64_t arg = -1)
+        : name(name), arg(arg), start_ns(Tracer::instance().enabled() ? trace_now_ns() : 0) {}
+
+    ~TraceSpan() {
+        if (start_ns) {
+            Tracer::instance().ring().push({name, start_ns, trace_now_ns() - start_ns, arg, 0});
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name;
+    int64_t arg;
+    int64_t start_ns;
+};
+
+inline void trace_async(const char* name, uint64_t id, int64_t start_ns, int64_t arg = -1) {
+    if (Tracer::instance().enabled()) {
+        Tracer::instance().ring().push({name, start_ns, trace_now_ns() - start_ns, arg, id});
+    }
+}
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SPAN(name) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name)
+#define TRACE_SPAN_ARG(name, arg) TraceSpan TRACE_CONCAT(trace_span_, __LINE__)(name, static_cast<int64_t>(arg))
+#define TRACE_ASYNC(name, id, start_ns) trace_async(name, static_cast<uint64_t>(id), start_ns)
+#define TRACE_THREAD_NAME(thread_name) (Tracer::instance().ring().name = (thread_name))
+
+// Records from construction until destruction, then writes the file
+class TraceRecording {
+public:
+    explicit TraceRecording(const std::string& path) : path(path) {
+        Tracer::instance().enable(true);
+    }
+
+    ~TraceRecording() {
+        Tracer::instance().enable(false);
+        try {
+            Tracer::instance().write(path);
+        } catch (const std::exception&) {
+            // nothing to be done about a trace that can't be written while unwinding
+        }
+    }
+
+    TraceRecording(const TraceRecording&) = delete;
+    TraceRecording& operator=(const TraceRecording&) = delete;
+
+private:
+    std::string path;
+};
+
+#else
+
+#define TRACE_SPAN(name) ((void)0)
+#define TRACE_SPAN_ARG(name, arg) ((void)0)
+#define TRACE_ASYNC(name, id, start_ns) ((void)0)
+#define TRACE_THREAD_NAME(thread_name) ((void)0)
+
+class TraceRecording {
+public:
+    explicit TraceRecording(const std::string&) {
+        throw std::runtime_error("Built without tracing, configure with -DBITTORRENT_TRACING=ON");
+    }
+};
+
+#endif
+
+#endif
@@ -3,22 +3,24 @@
 
 // this file contains helper fns 
 
+#include <algorithm>
 #include "decode.hpp"
+#include "merkle.hpp"
 #include "sha1.hpp"
 #include "torrent.hpp"
 
-// convert bytes to hex and divides it into 20 bytes each
-std::vector<std::string> bytes_to_hex(const std::vector<uint8_t>& pieces) {
+// convert bytes to hex and divides it into hash_size bytes each (20 for SHA-1, 32 for SHA-256)
+inline std::vector<std::string> bytes_to_hex(const std::vector<uint8_t>& pieces, size_t hash_size = 20) {
     static const char* hex_chars = "0123456789abcdef";
     size_t size = pieces.size();
 
-    if (size % 20 != 0) {
+    if (size % hash_size != 0) {
         throw std::runtime_error("Invalid pieces length");
     }
 
-    std::vector<std::string> hex(size / 20); // 20 bytes per piece
+    std::vector<std::string> hex(size / hash_size);
     for (size_t i = 0; i < size; ++i) {
-        size_t index = i / 20;
+        size_t index = i / hash_size;
         uint8_t byte = pieces[i];
         hex[index] += hex_chars[byte >> 4];    
         hex[index] += hex_chars[byte & 0x0F]; 
@@ -26,13 +28,99 @@ std::vector<std::string> bytes_to_hex(const std::vector<uint8_t>& pieces) {
     return hex;
 }
 
-// parse torrent from string and calculate Tracker URL,Length and info hash
-void parse_torrent(const std::string& encoded_value) {
+// convert a hex string (as returned by SHA1::final) back to raw bytes
+inline std::vector<uint8_t> hex_to_bytes(const std::string& hex) {
+    std::vector<uint8_t> bytes;
+    bytes.reserve(hex.length() / 2);
+    for (size_t i = 0; i + 1 < hex.length(); i += 2) {
+        bytes.push_back(static_cast<uint8_t>(std::stoi(hex.substr(i, 2), nullptr, 16)));
+    }
+    return bytes;
+}
+
+// reject path components that could escape the download directory
+inline void check_path_component(const std::string& component) {
+    if (component.empty() || component == "." || component == ".." ||
+        component.find_first_of("/\\") != std::string::npos) {
+        throw std::runtime_error("Invalid file path in torrent: " + component);
+    }
+}
+
+// Walk a v2 file tree in order. Directories are dicts keyed by name, the key ""
+// holds the length and pieces root of the file the path leads to.
+inline void collect_file_tree(const json& node, std::vector<std::string>& path, std::vector<FileEntry>& files) {
+    for (const auto& [key, value] : node.items()) {
+        if (key.empty()) {
+            FileEntry entry;
+            entry.length = value["length"].get<int64_t>();
+            entry.path = path;
+            entry.offset = 0;
+            if (entry.length > 0) {
+                std::string root = value["pieces root"].get<std::string>();
+                entry.pieces_root.assign(root.begin(), root.end());
+            }
+            if (entry.path.empty() || entry.length < 0 || (entry.length > 0 && entry.pieces_root.size() != 32)) {
+                throw std::runtime_error("Invalid file entry in torrent");
+            }
+            files.push_back(entry);
+            continue;
+        }
+        check_path_component(key);
+        path.push_back(key);
+        collect_file_tree(value, path, files);
+        path.pop_back();
+    }
+}
+
+// Collect the v2 piece hashes from the piece layers into info.piece_hashes_v2.
+// False if a file's layer is missing, e.g. when the info dict came from a magnet link.
+inline bool collect_piece_layers(const json& decoded_value, Info& info) {
+    info.piece_hashes_v2.clear();
+    for (const FileEntry& file : info.files) {
+        if (file.pad || file.length == 0) {
+            continue;
+        }
+        if (file.offset % info.plength != 0) {
+            throw std::runtime_error("v2 file does not start on a piece boundary");
+        }
+        if (file.length <= info.plength) {
+            info.piece_hashes_v2.insert(info.piece_hashes_v2.end(), file.pieces_root.begin(), file.pieces_root.end());
+            continue;
+        }
+        std::string root(file.pieces_root.begin(), file.pieces_root.end());
+        if (!decoded_value.contains("piece layers") || !decoded_value["piece layers"].contains(root)) {
+            return false;
+        }
+        std::string layer_str = decoded_value["piece layers"][root].get<std::string>();
+        std::vector<uint8_t> layer(layer_str.begin(), layer_str.end());
+        size_t pieces_in_file = static_cast<size_t>((file.length + info.plength - 1) / info.plength);
+        if (layer.size() != pieces_in_file * 32 || !verify_piece_layer(info, layer, file.pieces_root)) {
+            throw std::runtime_error("Piece layer does not match the pieces root of a file");
+        }
+        info.piece_hashes_v2.insert(info.piece_hashes_v2.end(), layer.begin(), layer.end());
+    }
+    return true;
+}
+
+// parse torrent from string and calculate Tracker URL,Length and info hash.
+// v1, v2 (BEP 52) and hybrid torrents carrying both are understood.
+inline Torrent parse_torrent(const std::string& encoded_value) {
+    Torrent torr;
     json decoded_value = decode_bencoded_value(encoded_value);
-    std::string info_bencoded = bencode_decoded_value(decoded_value["info"]);
+    const json& info = decoded_value["info"];
+    std::string info_bencoded = bencode_decoded_value(info);
 
-    // Get the raw pieces string from JSON
-    std::string pieces_str = decoded_value["info"]["pieces"].get<std::string>();
+    torr.info.meta_version = info.contains("meta version") ? info["meta version"].get<int>() : 1;
+    if (torr.info.meta_version != 1 && torr.info.meta_version != 2) {
+        throw std::runtime_error("Unsupported torrent meta version " + std::to_string(torr.info.meta_version));
+    }
+    bool has_v1 = info.contains("pieces");
+    if (!has_v1 && torr.info.meta_version < 2) {
+        throw std::runtime_error("Torrent has no pieces");
+    }
+
+    // Get the raw pieces string from JSON, v2 only torrents have none
+    std::string pieces_str = has_v1 ? info["pieces"].get<std::string>() : "";
     
     // Convert the raw string to vector<uint8_t> for pieces
     std::vector<uint8_t> pieces_data;
@@ -41,42 +129,183 @@ void parse_torrent(const std::string& encoded_value) {
         pieces_data.push_back((uint8_t)(c));
     }
 
-     // Calculate info hash
-    SHA1 sha1;
-    sha1.update(info_bencoded);
-    std::string hex_hash = sha1.final();
-    
-    // Convert hex string to binary data
+    // Calculate info hash, the SHA-1 one is what hybrid torrents use on the wire
     std::vector<uint8_t> binary_hash;
-    binary_hash.reserve(20);
-    
-    for (size_t i = 0; i < hex_hash.length(); i += 2) {
-        std::string byte = hex_hash.substr(i, 2);
-        binary_hash.push_back(static_cast<uint8_t>(std::stoi(byte, nullptr, 16)));
+    torr.info.hash_v2.clear();
+    if (torr.info.meta_version == 2) {
+        Sha256Digest digest = SHA256::hash(reinterpret_cast<const uint8_t*>(info_bencoded.data()), info_bencoded.size());
+        torr.info.hash_v2.assign(digest.begin(), digest.end());
+        binary_hash.assign(digest.begin(), digest.begin() + 20);
+    }
+    if (has_v1) {
+        SHA1 sha1;
+        sha1.update(info_bencoded);
+        binary_hash = hex_to_bytes(sha1.final());
     }
 
     // Populate contents of torr
     torr.announce = decoded_value.contains("announce") ? decoded_value["announce"].get<std::string>() : "";
-    torr.info.name = decoded_value["info"].contains("name") ? decoded_value["info"]["name"].get<std::string>() : "";
-    torr.info.plength = decoded_value["info"].contains("piece length") ? decoded_value["info"]["piece length"].get<int64_t>() : 0;
-    torr.info.length = decoded_value["info"].contains("length") ? decoded_value["info"]["length"].get<int64_t>() : 0;
+    if (!torr.announce.empty()) {
+        torr.trackers.push_back(torr.announce);
+    }
+    if (decoded_value.contains("announce-list") && decoded_value["announce-list"].is_array()) {
+        for (const json& tier : decoded_value["announce-list"]) {
+            if (!tier.is_array()) {
+                continue;
+            }
+            for (const json& tracker : tier) {
+                if (tracker.is_string() &&
+                    std::find(torr.trackers.begin(), torr.trackers.end(), tracker.get<std::string>()) == torr.trackers.end()) {
+                    torr.trackers.push_back(tracker.get<std::string>());
+                }
+            }
+        }
+    }
+    torr.info.name = info.contains("name") ? info["name"].get<std::string>() : "";
+    torr.info.plength = info.contains("piece length") ? info["piece length"].get<int64_t>() : 0;
+    torr.info.length = info.contains("length") ? info["length"].get<int64_t>() : 0;
     torr.info.pieces = pieces_data;
     torr.info.hash = binary_hash;
     // If path exists, use it, otherwise use name 
-    if (decoded_value["info"].contains("path")) {
-        torr.info.path = decoded_value["info"]["path"].get<std::vector<std::string>>();
+    if (info.contains("path")) {
+        torr.info.path = info["path"].get<std::vector<std::string>>();
     } else {
         torr.info.path = {torr.info.name};
     }
-    
+    // the name (or path) becomes the file or directory written under the download directory
+    for (const std::string& component : torr.info.path) {
+        check_path_component(component);
+    }
+    if (info.contains("files")) {
+        check_path_component(torr.info.name);
+    }
+
+    // Lay the files out end to end, a single file torrent is one file named after name
+    torr.info.files.clear();
+    torr.info.multi_file = info.contains("files");
+    if (torr.info.multi_file) {
+        int64_t offset = 0;
+        for (const auto& file : info["files"]) {
+            FileEntry entry;
+            entry.length = file["length"].get<int64_t>();
+            entry.path = file["path"].get<std::vector<std::string>>();
+            entry.offset = offset;
+            entry.pad = file.contains("attr") && file["attr"].get<std::string>().find('p') != std::string::npos;
+            for (const std::string& component : entry.path) {
+                check_path_component(component);
+            }
+            if (entry.path.empty() || entry.length < 0) {
+                throw std::runtime_error("Invalid file entry in torrent");
+            }
+            offset += entry.length;
+            torr.info.files.push_back(entry);
+        }
+        torr.info.length = offset;
+    } else if (has_v1) {
+        torr.info.files.push_back({.length = torr.info.length, .path = torr.info.path, .offset = 0});
+    }
+
+    if (torr.info.meta_version < 2) {
+        return torr;
+    }
+
+    // v2 files come from the file tree, each one starting on a piece boundary
+    if (torr.info.plength < static_cast<int64_t>(MERKLE_BLOCK_SIZE) || !std::has_single_bit(static_cast<uint64_t>(torr.info.plength))) {
+        throw std::runtime_error("v2 piece length must be a power of two of at least 16 KiB");
+    }
+    std::vector<FileEntry> tree_files;
+    std::vector<std::string> path;
+    collect_file_tree(info["file tree"], path, tree_files);
+    if (has_v1) {
+        // hybrid: the v1 file list is the same files with pad files in between
+        size_t next = 0;
+        for (FileEntry& file : torr.info.files) {
+            if (file.pad) {
+                continue;
+            }
+            if (next >= tree_files.size() || tree_files[next].length != file.length) {
+                throw std::runtime_error("Hybrid torrent v1 and v2 file lists differ");
+            }
+            file.pieces_root = tree_files[next++].pieces_root;
+        }
+        if (next != tree_files.size()) {
+            throw std::runtime_error("Hybrid torrent v1 and v2 file lists differ");
+        }
+    } else {
+        // v2 only: the padding a hybrid torrent spells out is implied, add it the same way
+        int64_t offset = 0;
+        for (size_t i = 0; i < tree_files.size(); ++i) {
+            FileEntry& file = tree_files[i];
+            file.offset = offset;
+            offset += file.length;
+            torr.info.files.push_back(file);
+            int64_t padding = (torr.info.plength - offset % torr.info.plength) % torr.info.plength;
+            if (padding > 0 && i + 1 < tree_files.size()) {
+                FileEntry pad{padding, {".pad", std::to_string(padding)}, offset, true, {}};
+                torr.info.files.push_back(pad);
+                offset += padding;
+            }
+        }
+        torr.info.length = offset;
+        torr.info.multi_file = !(tree_files.size() == 1 && tree_files[0].path == std::vector<std::string>{torr.info.name});
+        if (!torr.info.multi_file) {
+            torr.info.path = tree_files[0].path;
+        }
+    }
+
+    if (!collect_piece_layers(decoded_value, torr.info)) {
+        if (!has_v1) {
+            throw std::runtime_error("Torrent is missing the piece layers of its files");
+        }
+        // a hybrid torrent without piece layers (fetched from a magnet link) still verifies as v1
+        torr.info.meta_version = 1;
+        torr.info.piece_hashes_v2.clear();
+        return torr;
+    }
+    if (has_v1 && torr.info.piece_hashes_v2.size() / 32 != torr.info.pieces.size() / 20) {
+        throw std::runtime_error("Hybrid torrent v1 and v2 pieces differ");
+    }
+    return torr;
 }
 
+// The file a piece starts in; v2 pieces never cross files
+inline size_t file_for_piece(const Info& info, size_t piece_index) {
+    int64_t start = static_cast<int64_t>(piece_index) * info.plength;
+    auto after = std::upper_bound(info.files.begin(), info.files.end(), start,
+                                  [](int64_t position, const FileEntry& file) { return position < file.offset; });
+    size_t file = static_cast<size_t>(after - info.files.begin()) - 1;
+    // empty files share their offset with a neighbour, step back to the one holding start
+    while (file > 0 && info.files[file].length == 0) {
+        --file;
+    }
+    return file;
+}
+
+// number of pieces in the torrent
+inline size_t piece_count(const Info& info) {
+    if (info.meta_version >= 2) {
+        return info.piece_hashes_v2.size() / 32;
+    }
+    return info.pieces.size() / 20;
+}
 
-void info_torrent(const std::string& encoded_value) {
+// size of a piece, the last one may be shorter
+inline int64_t piece_size(const Info& info, size_t piece_index) {
+    int64_t start = static_cast<int64_t>(piece_index) * info.plength;
+    if (info.meta_version >= 2) {
+        // v2 pieces end with their file, the padding up to the next piece isn't transferred
+        const FileEntry& file = info.files[file_for_piece(info, piece_index)];
+        return std::min(info.plength, file.offset + file.length - start);
+    }
+    return std::min(info.plength, info.length - start);
+}
+
+inline void info_torrent(const std::string& encoded_value) {
     // parse content
-    parse_torrent(encoded_value);
-    // get hex pieces
-    std::vector<std::string> hex = bytes_to_hex(torr.info.pieces);
+    Torrent torr = parse_torrent(encoded_value);
+    // get hex pieces, the merkle piece hashes for v2 torrents
+    std::vector<std::string> hex = torr.info.meta_version >= 2 ? bytes_to_hex(torr.info.piece_hashes_v2, 32)
+                                                                : bytes_to_hex(torr.info.pieces);
 
     // Print the torrent information
     std::cout << "Tracker URL: " << torr.announce << std::endl;
@@ -86,8 +315,32 @@ void info_torrent(const std::string& encoded_value) {
         printf("%02x", byte);
     }
     std::cout << std::endl;
+    if (!torr.info.hash_v2.empty()) {
+        std::cout << "Info Hash v2: ";
+        for (uint8_t byte : torr.info.hash_v2) {
+            printf("%02x", byte);
+        }
+        std::cout << std::endl;
+    }
+    if (torr.info.meta_version >= 2) {
+        std::cout << "Meta Version: 2" << (torr.info.pieces.empty() ? "" : " (hybrid)") << std::endl;
+    }
     std::cout << "Name: " << torr.info.name << std::endl;
     std::cout << "Piece Length: " << torr.info.plength << std::endl;
+    if (torr.info.multi_file) {
+        std::cout << "Files: \n";
+        for (size_t i = 0; i < torr.info.files.size(); ++i) {
+            const FileEntry& file = torr.info.files[i];
+            if (file.pad) {
+                continue;
+            }
+            std::string path;
+            for (const std::string& component : file.path) {
+                path += (path.empty() ? "" : "/") + component;
+            }
+            std::cout << i << ": " << file.length << " " << path << " \n";
+        }
+    }
     // std::cout << "Path: ";
     // for (const auto& path : torr.info.path) {
     //     std::cout << path << "/";
@@ -100,7 +353,7 @@ void info_torrent(const std::string& encoded_value) {
 }
 
 // read content of torrent file and return it as string
-std::string read_file(const std::string& torrent_file) {
+inline std::string read_file(const std::string& torrent_file) {
     std::ifstream file(torrent_file, std::ios::binary);
     std::stringstream buffer;
     if (file) {
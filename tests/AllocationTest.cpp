@@ -0,0 +1,92 @@
+// this is the entry point of the allocation test: two connections trade block requests and
+// 16 KiB blocks over a socket pair, and once the slab free lists and frame buffers are warm
+// not a single operator new may run per block on the read and send path
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <sys/socket.h>
+#include <thread>
+#include "check.hpp"
+#include "lib/connection.hpp"
+
+// every heap allocation of the process goes through these and is counted
+static std::atomic<size_t> allocations{0};
+
+void* operator new(size_t size) {
+    ++allocations;
+    if (void* p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](size_t size) { return operator new(size); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    ++allocations;
+    return std::malloc(size ? size : 1);
+}
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept { return operator new(size, tag); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+
+constexpr uint32_t BLOCK = 16 * 1024;
+
+// Function to ask for one block and serve it, the way the download and upload loops do
+bool trade_block(PeerConnection& downloader, PeerConnection& uploader, uint32_t index, const uint8_t* piece) {
+    uint8_t request[12];
+    write_uint32(request, index);
+    write_uint32(request + 4, 0);
+    write_uint32(request + 8, BLOCK);
+    auto sent = std::chrono::steady_clock::now();
+    downloader.send_message(MSG_REQUEST, request, sizeof(request));
+
+    PeerMessage asked = uploader.read_message();
+    if (asked.id != MSG_REQUEST || asked.payload.size() != 12) {
+        return false;
+    }
+    uploader.send_message(MSG_PIECE, piece, 8 + BLOCK);
+
+    PeerMessage block = downloader.read_message();
+    if (block.id != MSG_PIECE || block.payload.size() != 8 + BLOCK) {
+        return false;
+    }
+    downloader.block_received(BLOCK, std::chrono::steady_clock::now() - sent);
+    return true;
+}
+
+int main() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        std::cerr << "socketpair failed" << std::endl;
+        return 1;
+    }
+    std::vector<uint8_t> info_hash(20, 0xab);
+    // both ends send their handshake before reading the other's, so they have to run at once
+    std::unique_ptr<PeerConnection> uploader;
+    std::thread accept([&] { uploader = std::make_unique<PeerConnection>(fds[1], PeerAddress{"127.0.0.2", 6881}, info_hash); });
+    PeerConnection downloader(fds[0], PeerAddress{"127.0.0.1", 6881}, info_hash);
+    accept.join();
+
+    std::vector<uint8_t> piece(8 + BLOCK, 0x5a);
+    // the first rounds fill the free lists, the per-thread frame and the metric series
+    for (uint32_t i = 0; i < 64; ++i) {
+        CHECK(trade_block(downloader, *uploader, i, piece.data()));
+    }
+
+    constexpr uint32_t BLOCKS = 1024;
+    size_t before = allocations.load();
+    bool traded = true;
+    for (uint32_t i = 0; i < BLOCKS; ++i) {
+        traded = trade_block(downloader, *uploader, i, piece.data()) && traded;
+    }
+    size_t during = allocations.load() - before;
+    CHECK(traded);
+    CHECK(during == 0);
+    if (during != 0) {
+        std::cerr << during << " allocations over " << BLOCKS << " blocks" << std::endl;
+    }
+    return check_result();
+}
@@ -0,0 +1,178 @@
+// this is the entry point of the choker test: unchoke slots, the optimistic unchoke and
+// its rotation, driven with a fixed seed and made-up clock so every run is the same
+
+
+#include <chrono>
+#include <map>
+#include <set>
+#include "check.hpp"
+#include "lib/choker.hpp"
+
+using Clock = Choker::Clock;
+
+// peers unchoked after applying decisions to the choke state seen so far
+void apply_decisions(std::map<uint64_t, bool>& choked, const std::vector<ChokeDecision>& decisions) {
+    for (const ChokeDecision& decision : decisions) {
+        choked[decision.peer] = decision.choke;
+    }
+}
+
+std::set<uint64_t> unchoked(const std::map<uint64_t, bool>& choked) {
+    std::set<uint64_t> peers;
+    for (const auto& [peer, is_choked] : choked) {
+        if (!is_choked) {
+            peers.insert(peer);
+        }
+    }
+    return peers;
+}
+
+// Five interested peers giving us 1..5 MB per round, three slots: the two fastest of the
+// peers that aren't optimistic get the regular slots, the optimistic one the third
+void test_regular_slots() {
+    Choker choker(3, 1);
+    Clock::time_point start{std::chrono::hours(1)};
+    std::map<uint64_t, bool> choked;
+    for (uint64_t id = 1; id <= 5; ++id) {
+        choker.add_peer(id, start - std::chrono::minutes(5));
+        choker.set_interested(id, true);
+        choked[id] = true;
+    }
+    apply_decisions(choked, choker.tick(start)); // starts the rate meters
+    for (uint64_t id = 1; id <= 5; ++id) {
+        choker.on_downloaded(id, id * 1000000);
+    }
+    Clock::time_point now = start + Choker::REGULAR_INTERVAL;
+    apply_decisions(choked, choker.tick(now));
+
+    CHECK(choker.optimistic().has_value());
+    uint64_t optimistic = choker.optimistic().value_or(0);
+    std::set<uint64_t> expected{optimistic};
+    for (uint64_t id = 5; id >= 1 && expected.size() < 3; --id) {
+        expected.insert(id);
+    }
+    CHECK(unchoked(choked) == expected);
+    for (uint64_t id = 1; id <= 5; ++id) {
+        CHECK(choker.is_choked(id) == (expected.count(id) == 0));
+    }
+
+    // nothing is due before the next round, and an unchanged round sends nothing
+    CHECK(choker.tick(now + std::chrono::seconds(5)).empty());
+    for (uint64_t id = 1; id <= 5; ++id) {
+        choker.on_downloaded(id, id * 1000000);
+    }
+    CHECK(choker.tick(now + Choker::REGULAR_INTERVAL).empty());
+}
+
+// An uninterested peer faster than the last downloader is unchoked without using up a slot
+void test_uninterested_peers_keep_slots() {
+    Choker choker(2, 1);
+    Clock::time_point start{std::chrono::hours(1)};
+    for (uint64_t id = 1; id <= 3; ++id) {
+        choker.add_peer(id, start - std::chrono::minutes(5));
+    }
+    choker.set_interested(1, true);
+    choker.set_interested(2, true);
+    choker.tick(start);
+    choker.on_downloaded(3, 9000000); // fastest, not interested
+    choker.on_downloaded(2, 2000000);
+    choker.on_downloaded(1, 1000000);
+    choker.tick(start + Choker::REGULAR_INTERVAL);
+
+    // peer 1 or 2 is optimistic, the other one gets the one regular slot
+    CHECK(choker.optimistic().has_value());
+    CHECK(!choker.is_choked(1));
+    CHECK(!choker.is_choked(2));
+    CHECK(!choker.is_choked(3));
+}
+
+// The optimistic slot moves to another choked interested peer every 30 s, not sooner
+void test_optimistic_rotation() {
+    Choker choker(2, 7);
+    Clock::time_point start{std::chrono::hours(1)};
+    for (uint64_t id = 1; id <= 6; ++id) {
+        choker.add_peer(id, start - std::chrono::minutes(5));
+        choker.set_interested(id, true);
+    }
+    choker.tick(start);
+    std::optional<uint64_t> first = choker.optimistic();
+    CHECK(first.has_value());
+    CHECK(!choker.is_choked(first.value_or(0)));
+
+    choker.tick(start + Choker::REGULAR_INTERVAL);
+    CHECK(choker.optimistic() == first);
+    choker.tick(start + 2 * Choker::REGULAR_INTERVAL);
+    CHECK(choker.optimistic() == first);
+
+    choker.tick(start + Choker::OPTIMISTIC_INTERVAL);
+    std::optional<uint64_t> second = choker.optimistic();
+    CHECK(second.has_value());
+    CHECK(second != first);
+    CHECK(!choker.is_choked(second.value_or(0)));
+
+    // the same seed picks the same peers
+    Choker again(2, 7);
+    for (uint64_t id = 1; id <= 6; ++id) {
+        again.add_peer(id, start - std::chrono::minutes(5));
+        again.set_interested(id, true);
+    }
+    again.tick(start);
+    CHECK(again.optimistic() == first);
+
+    // a peer that goes away gives up the slot, the next round fills it
+    choker.remove_peer(second.value_or(0));
+    CHECK(!choker.optimistic().has_value());
+    choker.tick(start + Choker::OPTIMISTIC_INTERVAL + Choker::REGULAR_INTERVAL);
+    CHECK(choker.optimistic().has_value());
+}
+
+// Only interested peers we choke are optimistic candidates, whatever the seed
+void test_optimistic_needs_interest() {
+    Clock::time_point start{std::chrono::hours(1)};
+    for (uint32_t seed = 0; seed < 20; ++seed) {
+        Choker choker(1, seed);
+        choker.add_peer(1, start);
+        choker.add_peer(2, start);
+        choker.add_peer(3, start);
+        choker.set_interested(2, true);
+        choker.tick(start);
+        CHECK(choker.optimistic() == std::optional<uint64_t>(2));
+        CHECK(!choker.is_choked(2));
+        CHECK(choker.is_choked(1));
+        CHECK(choker.is_choked(3));
+    }
+}
+
+// Seeding ranks by what we upload to peers rather than what they give us
+void test_seeding_ranks_by_upload() {
+    Choker choker(2, 5);
+    Clock::time_point start{std::chrono::hours(1)};
+    for (uint64_t id = 1; id <= 4; ++id) {
+        choker.add_peer(id, start - std::chrono::minutes(5));
+        choker.set_interested(id, true);
+    }
+    choker.set_seeding(true);
+    choker.tick(start);
+    for (uint64_t id = 1; id <= 4; ++id) {
+        choker.on_downloaded(id, id * 1000000);
+        choker.on_uploaded(id, (5 - id) * 1000000); // peer 1 takes the most from us
+    }
+    choker.tick(start + Choker::REGULAR_INTERVAL);
+    uint64_t optimistic = choker.optimistic().value_or(0);
+    uint64_t regular = optimistic == 1 ? 2 : 1;
+    CHECK(!choker.is_choked(regular));
+    for (uint64_t id = 1; id <= 4; ++id) {
+        if (id != regular && id != optimistic) {
+            CHECK(choker.is_choked(id));
+        }
+    }
+}
+
+int main() {
+    test_regular_slots();
+    test_uninterested_peers_keep_slots();
+    test_optimistic_rotation();
+    test_optimistic_needs_interest();
+    test_seeding_ranks_by_upload();
+    return check_result();
+}
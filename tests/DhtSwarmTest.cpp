@@ -0,0 +1,92 @@
+// this is the entry point of the DHT swarm test: a few dozen DHT nodes on one event loop
+// and 127.0.0.1 bootstrap off each other, then one node announces an info hash and the
+// others have to find it with get_peers. Nothing leaves the machine.
+
+
+#include <chrono>
+#include <memory>
+#include <vector>
+#include "check.hpp"
+#include "lib/dht.hpp"
+
+const size_t NODE_COUNT = 32;
+const auto STEP_TIMEOUT = std::chrono::seconds(20);
+
+sockaddr_in loopback(uint16_t port) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return addr;
+}
+
+// Function to run a get_peers lookup from node and wait for it
+std::vector<PeerAddress> find_peers(Reactor& reactor, Dht& node, const std::vector<uint8_t>& info_hash,
+                                    uint16_t announce_port = 0) {
+    bool done = false;
+    std::vector<PeerAddress> peers;
+    node.get_peers(info_hash, [&](const std::vector<PeerAddress>& found) {
+        peers = found;
+        done = true;
+    }, announce_port);
+    reactor.run_until([&]() { return done; }, STEP_TIMEOUT);
+    CHECK(done);
+    return peers;
+}
+
+bool contains(const std::vector<PeerAddress>& peers, const std::string& ip, uint16_t port) {
+    for (const PeerAddress& peer : peers) {
+        if (peer.ip == ip && peer.port == port) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main() {
+    WSAInitializer wsa;
+    Reactor reactor;
+    std::vector<std::unique_ptr<Dht>> nodes;
+    for (size_t i = 0; i < NODE_COUNT; ++i) {
+        nodes.push_back(std::make_unique<Dht>(reactor));
+    }
+
+    // everyone joins through the first node, one after the other like real clients would
+    size_t bootstrapped = 0;
+    for (size_t i = 1; i < NODE_COUNT; ++i) {
+        nodes[i]->bootstrap(std::vector<sockaddr_in>{loopback(nodes[0]->port())}, [&]() { ++bootstrapped; });
+        reactor.run_until([&]() { return bootstrapped == i; }, STEP_TIMEOUT);
+    }
+    CHECK(bootstrapped == NODE_COUNT - 1);
+    // the first node learned of others from their queries, the rest from their lookups
+    for (size_t i = 0; i < NODE_COUNT; ++i) {
+        CHECK(nodes[i]->node_count() >= RoutingTable::K);
+    }
+
+    // nobody has announced yet
+    std::vector<uint8_t> info_hash(20);
+    for (size_t i = 0; i < info_hash.size(); ++i) {
+        info_hash[i] = static_cast<uint8_t>(0xA5 ^ (i * 37));
+    }
+    CHECK(find_peers(reactor, *nodes[3], info_hash).empty());
+
+    // two nodes announce, the announce_peer queries go out once their lookups finish
+    find_peers(reactor, *nodes[7], info_hash, 6881);
+    find_peers(reactor, *nodes[19], info_hash, 51413);
+    reactor.run_until([]() { return false; }, std::chrono::milliseconds(200));
+
+    // every other node finds both through its own lookup
+    size_t lookups = 0;
+    for (size_t i = 0; i < NODE_COUNT; i += 5) {
+        std::vector<PeerAddress> peers = find_peers(reactor, *nodes[i], info_hash);
+        CHECK(contains(peers, "127.0.0.1", 6881));
+        CHECK(contains(peers, "127.0.0.1", 51413));
+        ++lookups;
+    }
+    CHECK(lookups > 1);
+
+    // another info hash stays empty
+    std::vector<uint8_t> other_hash(20, 0x11);
+    CHECK(find_peers(reactor, *nodes[11], other_hash).empty());
+    return check_result();
+}
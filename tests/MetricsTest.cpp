@@ -0,0 +1,41 @@
+// this is the entry point of the metrics test: per peer series stay while any connection
+// to the peer uses them and are gone from the exposition once the last one released them
+
+
+#include "check.hpp"
+#include "lib/metrics.hpp"
+
+bool rendered(const MetricsRegistry& registry, const std::string& line) {
+    return registry.render().find(line) != std::string::npos;
+}
+
+int main() {
+    MetricsRegistry registry;
+    MetricLabels peer{{"peer", "10.0.0.1:6881"}};
+    MetricLabels other{{"peer", "10.0.0.2:6881"}};
+
+    // the same peer over two connections, say for two torrents, shares one series
+    Counter& first = registry.counter("peer_bytes_total", "Bytes", peer);
+    Counter& second = registry.counter("peer_bytes_total", "Bytes", peer);
+    CHECK(&first == &second);
+    registry.counter("peer_bytes_total", "Bytes", other).add(7);
+    first.add(5);
+    second.add(5);
+    CHECK(rendered(registry, "peer_bytes_total{peer=\"10.0.0.1:6881\"} 10"));
+
+    // one connection closing leaves the series to the other
+    registry.release("peer_bytes_total", peer);
+    CHECK(rendered(registry, "peer_bytes_total{peer=\"10.0.0.1:6881\"} 10"));
+
+    // the last one takes it out, other peers' series stay
+    registry.release("peer_bytes_total", peer);
+    CHECK(!rendered(registry, "10.0.0.1:6881"));
+    CHECK(rendered(registry, "peer_bytes_total{peer=\"10.0.0.2:6881\"} 7"));
+
+    // releasing what isn't there is harmless, a new connection starts from zero
+    registry.release("peer_bytes_total", peer);
+    registry.release("unknown_total", peer);
+    registry.counter("peer_bytes_total", "Bytes", peer).add(1);
+    CHECK(rendered(registry, "peer_bytes_total{peer=\"10.0.0.1:6881\"} 1"));
+    return check_result();
+}
@@ -0,0 +1,67 @@
+// this is the entry point of the PEX test: which peers go out in ut_pex messages, now that
+// the peers we reached recently are passed on besides the one we are connected to
+
+
+#include <chrono>
+#include "check.hpp"
+#include "lib/peers.hpp"
+#include "lib/pex.hpp"
+
+bool contains(const std::vector<PeerAddress>& peers, const PeerAddress& wanted) {
+    for (const PeerAddress& peer : peers) {
+        if (peer_key(peer) == peer_key(wanted)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int main() {
+    PeerAddress current{"10.0.0.1", 6881};  // the one connection, also the recipient
+    PeerAddress reached{"10.0.0.2", 6881};  // connected to earlier
+    PeerAddress dead{"10.0.0.3", 6881};     // reached once, then kept failing
+    PeerAddress untried{"10.0.0.4", 6881};  // only heard of from the tracker
+    PeerAddress banned{"10.0.0.5", 6881};
+
+    PeerPool pool;
+    pool.add({current, reached, dead, untried, banned}, PeerSource::Tracker);
+    pool.connect_succeeded(reached, std::chrono::milliseconds(20));
+    pool.mark_connected(reached, true);
+    pool.mark_connected(reached, false);
+    pool.connect_succeeded(dead, std::chrono::milliseconds(20));
+    for (int i = 0; i < 3; ++i) {
+        pool.mark_failed(dead);
+    }
+    pool.connect_succeeded(banned, std::chrono::milliseconds(20));
+    pool.ban(banned);
+    pool.connect_succeeded(current, std::chrono::milliseconds(20));
+    pool.mark_connected(current, true);
+
+    std::vector<PeerAddress> reachable = pool.reachable_peers();
+    CHECK(contains(reachable, current));
+    CHECK(contains(reachable, reached));
+    CHECK(!contains(reachable, dead));
+    CHECK(!contains(reachable, untried));
+    CHECK(!contains(reachable, banned));
+
+    // the peer being told never hears about itself, but does hear about the earlier one
+    PexState pex;
+    auto now = std::chrono::steady_clock::now();
+    PexMessage message;
+    CHECK(pex.next_message(reachable, current, now, message));
+    CHECK(message.added.size() == 1 && contains(message.added, reached));
+    CHECK(message.dropped.empty());
+
+    // nothing new a minute later, and nothing at all before then
+    CHECK(!pex.next_message(reachable, current, now + std::chrono::seconds(30), message));
+    CHECK(!pex.next_message(reachable, current, now + PexState::INTERVAL, message));
+
+    // a peer that stops being reachable is dropped in the next message
+    for (int i = 0; i < 3; ++i) {
+        pool.mark_failed(reached);
+    }
+    CHECK(pex.next_message(pool.reachable_peers(), current, now + 2 * PexState::INTERVAL, message));
+    CHECK(message.added.empty());
+    CHECK(message.dropped.size() == 1 && contains(message.dropped, reached));
+    return check_result();
+}
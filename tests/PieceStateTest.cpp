@@ -0,0 +1,98 @@
+// this is the entry point of the piece picker test: random peers come and go, pieces are
+// downloaded and deselected, and every pick has to be a rarest piece the peer can give us
+
+
+#include <random>
+#include "check.hpp"
+#include "lib/piece_state.hpp"
+
+// Function to find the lowest availability a pick could have, by looking at every piece
+uint32_t rarest_possible(const PieceState& state, const Bitset& peer_pieces, bool peer_has_all, const Bitset* excluded) {
+    uint32_t rarest = UINT32_MAX;
+    for (size_t piece = 0; piece < state.piece_count(); ++piece) {
+        if (!state.wants_piece(piece) || state.has_piece(piece) || state.is_requested(piece) ||
+            (!peer_has_all && !peer_pieces.test(piece)) || (excluded && excluded->test(piece))) {
+            continue;
+        }
+        rarest = std::min(rarest, state.piece_availability(piece));
+    }
+    return rarest;
+}
+
+Bitset random_pieces(std::mt19937& rng, size_t piece_count, double ratio) {
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    Bitset pieces(piece_count);
+    for (size_t i = 0; i < piece_count; ++i) {
+        if (unit(rng) < ratio) {
+            pieces.set(i);
+        }
+    }
+    return pieces;
+}
+
+int main() {
+    const size_t piece_count = 300;
+    std::mt19937 rng(7);
+    PieceState state(piece_count);
+    std::vector<Bitset> peers;
+
+    for (int round = 0; round < 2000; ++round) {
+        switch (rng() % 6) {
+        case 0: // a peer connects
+            peers.push_back(random_pieces(rng, piece_count, 0.3));
+            state.add_availability(peers.back());
+            break;
+        case 1: // one leaves
+            if (!peers.empty()) {
+                size_t leaving = rng() % peers.size();
+                state.remove_availability(peers[leaving]);
+                peers.erase(peers.begin() + static_cast<long>(leaving));
+            }
+            break;
+        case 2: { // a have
+            if (!peers.empty()) {
+                Bitset& peer = peers[rng() % peers.size()];
+                size_t piece = rng() % piece_count;
+                if (!peer.test(piece)) {
+                    peer.set(piece);
+                    state.add_availability(piece);
+                }
+            }
+            break;
+        }
+        case 3: // a piece finishes
+            state.mark_have(rng() % piece_count);
+            break;
+        case 4: // a file is deselected or selected again
+            state.set_wanted(rng() % piece_count, rng() % 2 == 0);
+            break;
+        default: { // a pick, which sometimes gets requested
+            Bitset peer_pieces = random_pieces(rng, piece_count, 0.5);
+            bool peer_has_all = rng() % 4 == 0;
+            Bitset excluded = random_pieces(rng, piece_count, 0.1);
+            size_t piece = state.pick_piece(peer_pieces, peer_has_all, &excluded);
+            uint32_t rarest = rarest_possible(state, peer_pieces, peer_has_all, &excluded);
+            if (piece == PieceState::NONE) {
+                CHECK(rarest == UINT32_MAX);
+                break;
+            }
+            CHECK(state.wants_piece(piece) && !state.has_piece(piece) && !state.is_requested(piece));
+            CHECK(peer_has_all || peer_pieces.test(piece));
+            CHECK(!excluded.test(piece));
+            CHECK(state.piece_availability(piece) == rarest);
+            if (rng() % 3 == 0) {
+                state.mark_requested(piece);
+            }
+            break;
+        }
+        }
+    }
+
+    // a finished download has nothing left to pick
+    for (size_t piece = 0; piece < piece_count; ++piece) {
+        state.mark_have(piece);
+    }
+    CHECK(state.complete());
+    CHECK(state.pick_piece(Bitset(), true) == PieceState::NONE);
+    return check_result();
+}
@@ -0,0 +1,32 @@
+#ifndef CHECK_HPP
+#define CHECK_HPP
+
+// this file contains the few helpers the test executables share: CHECK records a failure
+// and carries on, so one run reports everything that is wrong, and check_result() turns
+// the failures into the exit code ctest looks at
+
+#include <iostream>
+
+inline int& check_failures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition)                                                                          \
+    do {                                                                                          \
+        if (!(condition)) {                                                                       \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition << std::endl; \
+            ++check_failures();                                                                   \
+        }                                                                                         \
+    } while (0)
+
+inline int check_result() {
+    if (check_failures() > 0) {
+        std::cerr << check_failures() << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
+
+#endif